@@ -7,14 +7,23 @@ LOCAL_PATH := $(TOP_LOCAL_PATH)
 include $(CLEAR_VARS)
 LOCAL_MODULE := stm32flash
 LOCAL_SRC_FILES :=	\
+	agent.c		\
+	daemon.c	\
 	dev_table.c	\
+	devcache.c	\
+	gang.c		\
 	i2c.c		\
 	init.c		\
 	main.c		\
+	pagecache.c	\
 	port.c		\
+	scan.c		\
+	script.c	\
 	serial_common.c	\
 	serial_platform.c	\
+	session.c	\
 	stm32.c		\
+	tcp.c		\
 	utils.c
 LOCAL_STATIC_LIBRARIES := libparsers
 include $(BUILD_EXECUTABLE)
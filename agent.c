@@ -0,0 +1,461 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+ * Agent mode: a stm32flash instance next to the target executes whole
+ * jobs received from a controller, so the network round trip is paid
+ * once per job instead of once per bootloader command.
+ *
+ * Every message on the socket is
+ *	type (1 byte), length (4 bytes, MSB first), payload
+ * Controller to agent:
+ *	'A' one command line argument, argv[0] first
+ *	'I' a chunk of the binary image to write
+ *	'E' end of job description
+ * Agent to controller:
+ *	'O' output of the job (progress and errors)
+ *	'D' a chunk of data read from the target
+ *	'R' exit code of the job, 4 bytes MSB first; last message
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "agent.h"
+
+int agent_is_remote(const char *device)
+{
+	return device && !strncmp(device, AGENT_PREFIX, strlen(AGENT_PREFIX));
+}
+
+#if defined(__WIN32__)
+
+int agent_serve(const char *addr, agent_job_t job)
+{
+	fprintf(stderr, "Agent mode not available on this platform\n");
+	return 1;
+}
+
+int agent_run_remote(const char *device, int argc, char *argv[],
+		     const void *image, size_t len, FILE *out,
+		     agent_data_t data, void *ctx)
+{
+	fprintf(stderr, "Agent mode not available on this platform\n");
+	return 1;
+}
+
+#else
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define AGENT_MAX_ARGS		64
+#define AGENT_MAX_PAYLOAD	0x100000
+#define AGENT_CHUNK		0x10000
+
+/* split "[host:]port" or "[v6addr]:port", host is "" when missing */
+static int agent_parse_addr(const char *addr, char *host, size_t host_len,
+			    const char **port)
+{
+	const char *colon;
+	size_t len;
+
+	colon = strrchr(addr, ':');
+	if (colon == NULL) {
+		host[0] = '\0';
+		*port = addr;
+		return **port ? 0 : 1;
+	}
+
+	len = colon - addr;
+	if (len && addr[0] == '[' && addr[len - 1] == ']') {
+		addr++;
+		len -= 2;
+	}
+	if (len >= host_len || colon[1] == '\0')
+		return 1;
+	memcpy(host, addr, len);
+	host[len] = '\0';
+	*port = colon + 1;
+	return 0;
+}
+
+static int agent_write_all(int fd, const void *buf, size_t len)
+{
+	const uint8_t *pos = buf;
+	ssize_t r;
+
+	while (len) {
+		r = write(fd, pos, len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 1)
+			return 1;
+		len -= r;
+		pos += r;
+	}
+	return 0;
+}
+
+static int agent_read_all(int fd, void *buf, size_t len)
+{
+	uint8_t *pos = buf;
+	ssize_t r;
+
+	while (len) {
+		r = read(fd, pos, len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 1)
+			return 1;
+		len -= r;
+		pos += r;
+	}
+	return 0;
+}
+
+static int agent_send(int fd, uint8_t type, const void *buf, size_t len)
+{
+	uint8_t hdr[5];
+
+	hdr[0] = type;
+	hdr[1] = len >> 24;
+	hdr[2] = (len >> 16) & 0xFF;
+	hdr[3] = (len >> 8) & 0xFF;
+	hdr[4] = len & 0xFF;
+	if (agent_write_all(fd, hdr, sizeof(hdr)))
+		return 1;
+	return agent_write_all(fd, buf, len);
+}
+
+/* receive one message, payload is allocated and NUL terminated */
+static int agent_recv(int fd, uint8_t *type, uint8_t **buf, size_t *len)
+{
+	uint8_t hdr[5];
+
+	if (agent_read_all(fd, hdr, sizeof(hdr)))
+		return 1;
+	*type = hdr[0];
+	*len = (hdr[1] << 24) | (hdr[2] << 16) | (hdr[3] << 8) | hdr[4];
+	if (*len > AGENT_MAX_PAYLOAD) {
+		fprintf(stderr, "Agent message too long (%zu bytes)\n", *len);
+		return 1;
+	}
+	*buf = malloc(*len + 1);
+	if (*buf == NULL)
+		return 1;
+	if (agent_read_all(fd, *buf, *len)) {
+		free(*buf);
+		return 1;
+	}
+	(*buf)[*len] = '\0';
+	return 0;
+}
+
+static int agent_send_file(int fd, int file)
+{
+	uint8_t buf[AGENT_CHUNK];
+	ssize_t r;
+
+	if (lseek(file, 0, SEEK_SET) < 0)
+		return 1;
+	while ((r = read(file, buf, sizeof(buf))) > 0)
+		if (agent_send(fd, 'D', buf, r))
+			return 1;
+	return r < 0;
+}
+
+/*
+ * Run one job: collect the request, execute it in a child process with
+ * its output redirected to a pipe, relay the pipe to the controller.
+ */
+static int agent_handle(int fd, agent_job_t job)
+{
+	char tmpname[] = "/tmp/stm32flash-XXXXXX";
+	char *argv[AGENT_MAX_ARGS + 1];
+	int argc = 0, file, has_image = 0, ret = 1, status, p[2];
+	uint8_t type, *buf, res[4];
+	char out[1024];
+	size_t len;
+	ssize_t r;
+	pid_t pid;
+
+	file = mkstemp(tmpname);
+	if (file < 0) {
+		perror("mkstemp");
+		return 1;
+	}
+
+	do {
+		if (agent_recv(fd, &type, &buf, &len))
+			goto close;
+		switch (type) {
+		case 'A':
+			if (argc == AGENT_MAX_ARGS) {
+				free(buf);
+				goto close;
+			}
+			argv[argc++] = (char *)buf;
+			break;
+		case 'I':
+			has_image = 1;
+			r = agent_write_all(file, buf, len);
+			free(buf);
+			if (r)
+				goto close;
+			break;
+		case 'E':
+			free(buf);
+			break;
+		default:
+			fprintf(stderr, "Unexpected agent message '%c'\n", type);
+			free(buf);
+			goto close;
+		}
+	} while (type != 'E');
+	argv[argc] = NULL;
+
+	if (argc == 0)
+		goto close;
+
+	if (pipe(p)) {
+		perror("pipe");
+		goto close;
+	}
+
+	fflush(NULL);
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		close(p[0]);
+		close(p[1]);
+		goto close;
+	}
+	if (pid == 0) {
+		close(p[0]);
+		close(fd);
+		dup2(p[1], STDOUT_FILENO);
+		dup2(p[1], STDERR_FILENO);
+		close(p[1]);
+		exit(job(argc, argv, tmpname));
+	}
+
+	close(p[1]);
+	while ((r = read(p[0], out, sizeof(out))) != 0) {
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0 || agent_send(fd, 'O', out, r))
+			break;
+	}
+	close(p[0]);
+
+	while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+		;
+	ret = (WIFEXITED(status)) ? WEXITSTATUS(status) : 1;
+
+	/* whatever the job left in the file is the data read from target */
+	if (!has_image && agent_send_file(fd, file))
+		goto close;
+
+	res[0] = ret >> 24;
+	res[1] = (ret >> 16) & 0xFF;
+	res[2] = (ret >> 8) & 0xFF;
+	res[3] = ret & 0xFF;
+	agent_send(fd, 'R', res, sizeof(res));
+
+close:
+	while (argc)
+		free(argv[--argc]);
+	close(file);
+	unlink(tmpname);
+	return ret;
+}
+
+int agent_serve(const char *addr, agent_job_t job)
+{
+	struct addrinfo hints, *res, *ai;
+	char host[256];
+	const char *port;
+	int fd = -1, c, one = 1;
+
+	if (agent_parse_addr(addr, host, sizeof(host), &port)) {
+		fprintf(stderr, "Invalid agent address \"%s\"\n", addr);
+		return 1;
+	}
+
+	/* jobs are not authenticated, exposing the agent must be explicit */
+	if (!host[0])
+		strcpy(host, "127.0.0.1");
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if (getaddrinfo(host, port, &hints, &res)) {
+		fprintf(stderr, "Cannot resolve \"%s\"\n", addr);
+		return 1;
+	}
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0
+		    && listen(fd, 1) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd < 0) {
+		fprintf(stderr, "Cannot listen on \"%s\"\n", addr);
+		return 1;
+	}
+
+	/* a controller going away must not kill the agent */
+	signal(SIGPIPE, SIG_IGN);
+
+	fprintf(stderr, "Agent listening on %s\n", addr);
+	while (1) {
+		c = accept(fd, NULL, NULL);
+		if (c < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("accept");
+			break;
+		}
+		setsockopt(c, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		fprintf(stderr, "Agent job %s\n",
+			agent_handle(c, job) ? "failed" : "done");
+		close(c);
+	}
+
+	close(fd);
+	return 1;
+}
+
+static int agent_connect(const char *device)
+{
+	struct addrinfo hints, *res, *ai;
+	char host[256];
+	const char *port;
+	int fd = -1, one = 1;
+
+	device += strlen(AGENT_PREFIX);
+	if (agent_parse_addr(device, host, sizeof(host), &port) || !host[0]) {
+		fprintf(stderr, "Invalid agent address \"%s\"\n", device);
+		return -1;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &res)) {
+		fprintf(stderr, "Cannot resolve \"%s\"\n", device);
+		return -1;
+	}
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd < 0) {
+		fprintf(stderr, "Unable to connect to agent \"%s\"\n", device);
+		return -1;
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return fd;
+}
+
+int agent_run_remote(const char *device, int argc, char *argv[],
+		     const void *image, size_t len, FILE *out,
+		     agent_data_t data, void *ctx)
+{
+	const uint8_t *pos = image;
+	uint8_t type, *buf;
+	size_t n, l;
+	int fd, i, ret = 1;
+
+	fd = agent_connect(device);
+	if (fd < 0)
+		return 1;
+
+	signal(SIGPIPE, SIG_IGN);
+
+	for (i = 0; i < argc; i++)
+		if (agent_send(fd, 'A', argv[i], strlen(argv[i])))
+			goto lost;
+	while (len) {
+		n = len > AGENT_CHUNK ? AGENT_CHUNK : len;
+		if (agent_send(fd, 'I', pos, n))
+			goto lost;
+		pos += n;
+		len -= n;
+	}
+	if (agent_send(fd, 'E', NULL, 0))
+		goto lost;
+
+	while (1) {
+		if (agent_recv(fd, &type, &buf, &l))
+			goto lost;
+		switch (type) {
+		case 'O':
+			fwrite(buf, 1, l, out);
+			fflush(out);
+			break;
+		case 'D':
+			if (data && data(ctx, buf, l)) {
+				fprintf(stderr, "Failed to write data to file\n");
+				free(buf);
+				close(fd);
+				return 1;
+			}
+			break;
+		case 'R':
+			if (l == 4)
+				ret = (buf[0] << 24) | (buf[1] << 16)
+				      | (buf[2] << 8) | buf[3];
+			free(buf);
+			close(fd);
+			return ret;
+		}
+		free(buf);
+	}
+
+lost:
+	fprintf(stderr, "Connection to agent lost\n");
+	close(fd);
+	return 1;
+}
+
+#endif
@@ -0,0 +1,43 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#ifndef _H_AGENT
+#define _H_AGENT
+
+#include <stddef.h>
+#include <stdio.h>
+
+#define AGENT_PREFIX	"agent://"
+
+/*
+ * Runs one job on the agent side. "file" is the image received from the
+ * controller (write) or the file whose content is sent back (read).
+ */
+typedef int (*agent_job_t)(int argc, char *argv[], const char *file);
+
+/* receives data read from the target, on the controller side */
+typedef int (*agent_data_t)(void *ctx, const void *buf, size_t len);
+
+int agent_is_remote(const char *device);
+int agent_serve(const char *addr, agent_job_t job);
+int agent_run_remote(const char *device, int argc, char *argv[],
+		     const void *image, size_t len, FILE *out,
+		     agent_data_t data, void *ctx);
+
+#endif
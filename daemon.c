@@ -0,0 +1,596 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+ * Daemon mode: ports stay open and the bootloader sessions stay alive
+ * between jobs, so a job costs only its own bootloader commands.
+ *
+ * Jobs are text lines received on a Unix domain socket:
+ *	info DEVICE
+ *	read DEVICE ADDRESS LENGTH
+ *	write DEVICE ADDRESS FILE [verify]	(erases the pages written)
+ *	wdata DEVICE ADDRESS HEXBYTES		(no erase)
+ *	erase DEVICE ADDRESS LENGTH | erase DEVICE all
+ *	crc DEVICE ADDRESS LENGTH
+ *	go DEVICE [ADDRESS]
+ *	reset DEVICE
+ *	close DEVICE
+ * The answer is streamed back as lines: zero or more "data HEX" or
+ * "progress ADDRESS", then one "ok [result]" or "error MESSAGE".
+ *
+ * Every device has its own queue and worker thread: jobs on different
+ * devices run in parallel, jobs on the same device run in order. Parsed
+ * images are cached, and reloaded only when the file changes.
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "daemon.h"
+
+#if defined(__WIN32__)
+
+int daemon_serve(const char *path, const struct port_options *ops,
+		 const init_seq_t *gpio_seq, char init)
+{
+	fprintf(stderr, "Daemon mode not available on this platform\n");
+	return 1;
+}
+
+#else
+
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "init.h"
+#include "session.h"
+#include "stm32.h"
+#include "utils.h"
+#include "parsers/image.h"
+
+#define DAEMON_LINE		1024
+#define DAEMON_MAX_ARGS		8
+#define DAEMON_MAX_IMAGES	8
+
+struct daemon_job {
+	char line[DAEMON_LINE];
+	int argc;
+	char *argv[DAEMON_MAX_ARGS];
+	int fd;			/* answer goes to the client */
+	int done;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct daemon_job *next;
+};
+
+struct daemon_session {
+	char device[256];
+	session_t *session;
+	stm32_t *stm;		/* target of the session */
+	int fd;			/* client of the running job */
+	uint32_t progress;
+	char msg[128];		/* last error of the session */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct daemon_job *head, *tail;
+	struct daemon_session *next;
+};
+
+/* shared by the cache and the running jobs, freed with the last user */
+struct daemon_image {
+	char path[256];
+	time_t mtime;
+	off_t size;
+	uint8_t *data;
+	unsigned int len;
+	int refs;
+};
+
+static struct port_options d_ops;
+static const init_seq_t *d_gpio_seq;
+static char d_init;
+
+static struct daemon_session *sessions;
+static pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct daemon_image *images[DAEMON_MAX_IMAGES];
+static int next_image;
+static pthread_mutex_t images_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void daemon_reply(int fd, const char *fmt, ...)
+	__attribute__ ((format (printf, 2, 3)));
+
+static void daemon_reply(int fd, const char *fmt, ...)
+{
+	char buf[DAEMON_LINE];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf) - 1, fmt, ap);
+	va_end(ap);
+	if (len < 0)
+		return;
+	if (len > (int)sizeof(buf) - 2)
+		len = sizeof(buf) - 2;
+	buf[len++] = '\n';
+	/* a client that went away only loses its answer */
+	send(fd, buf, len, MSG_NOSIGNAL);
+}
+
+static void daemon_put_image(struct daemon_image *img)
+{
+	pthread_mutex_lock(&images_lock);
+	if (--img->refs == 0) {
+		free(img->data);
+		free(img);
+	}
+	pthread_mutex_unlock(&images_lock);
+}
+
+/* parse the file once for all the jobs using it */
+static struct daemon_image *daemon_parse_image(const char *path,
+					       const struct stat *st)
+{
+	struct daemon_image *img;
+
+	img = calloc(1, sizeof(*img));
+	if (!img)
+		return NULL;
+
+	img->data = image_load(path, &img->len);
+	if (!img->data)
+		goto err;
+
+	snprintf(img->path, sizeof(img->path), "%s", path);
+	img->mtime = st->st_mtime;
+	img->size = st->st_size;
+	img->refs = 1;
+	return img;
+
+err:
+	free(img->data);
+	free(img);
+	return NULL;
+}
+
+/* the cached image, parsed again only if the file has changed */
+static struct daemon_image *daemon_get_image(const char *path)
+{
+	struct daemon_image *img = NULL;
+	struct stat st;
+	int i, slot;
+
+	if (stat(path, &st))
+		return NULL;
+
+	pthread_mutex_lock(&images_lock);
+	slot = next_image;
+	for (i = 0; i < DAEMON_MAX_IMAGES; i++) {
+		if (!images[i] || strcmp(images[i]->path, path))
+			continue;
+		if (images[i]->mtime == st.st_mtime
+		    && images[i]->size == st.st_size) {
+			img = images[i];
+			goto out;
+		}
+		slot = i;
+		break;
+	}
+
+	img = daemon_parse_image(path, &st);
+	if (!img)
+		goto out;
+	if (images[slot] && --images[slot]->refs == 0) {
+		free(images[slot]->data);
+		free(images[slot]);
+	}
+	images[slot] = img;
+	if (slot == next_image)
+		next_image = (next_image + 1) % DAEMON_MAX_IMAGES;
+out:
+	if (img)
+		img->refs++;
+	pthread_mutex_unlock(&images_lock);
+	return img;
+}
+
+static void daemon_error(void *ctx, const char *msg)
+{
+	struct daemon_session *s = ctx;
+
+	snprintf(s->msg, sizeof(s->msg), "%s", msg);
+}
+
+/* one line every 4KiB, or less, written */
+static void daemon_progress(void *ctx, const char *op, uint32_t addr,
+			    uint32_t done, uint32_t total)
+{
+	struct daemon_session *s = ctx;
+
+	if (strcmp(op, "write"))
+		return;
+	if ((addr & ~0xFFF) != (s->progress & ~0xFFF) || done == total)
+		daemon_reply(s->fd, "progress 0x%08x", addr);
+	s->progress = addr;
+}
+
+static void daemon_close_session(struct daemon_session *s)
+{
+	session_close(s->session);
+	s->session = NULL;
+	s->stm = NULL;
+}
+
+/* the port is opened and the bootloader initialized on the first job */
+static int daemon_open_session(struct daemon_session *s)
+{
+	struct session_config cfg = {
+		.port		= d_ops,
+		.gpio_seq	= d_gpio_seq,
+		.init		= d_init,
+		.progress	= daemon_progress,
+		.error		= daemon_error,
+		.ctx		= s,
+	};
+
+	if (s->session)
+		return 0;
+
+	cfg.port.device = s->device;
+	s->session = session_open(&cfg);
+	if (!s->session) {
+		daemon_reply(s->fd, "error %s", s->msg);
+		return 1;
+	}
+	s->stm = session_target(s->session);
+	return 0;
+}
+
+/* returns 1 when the session must be closed */
+static int daemon_run_job(struct daemon_session *s, struct daemon_job *job)
+{
+	struct daemon_image *img;
+	const char *cmd = job->argv[0];
+	char **argv = job->argv;
+	int argc = job->argc, fd = job->fd;
+	uint32_t addr, len, crc, i;
+	int verify;
+	uint8_t buf[256];
+	char hex[2 * 256 + 1];
+
+	if (!strcmp(cmd, "close")) {
+		daemon_reply(fd, "ok");
+		return 1;
+	}
+
+	s->fd = fd;
+	s->progress = 0;
+	if (daemon_open_session(s))
+		return 0;
+
+	if (!strcmp(cmd, "info")) {
+		daemon_reply(fd, "ok 0x%04x 0x%02x %s", s->stm->pid,
+			     s->stm->bl_version, s->stm->dev->name);
+	} else if (!strcmp(cmd, "read") && argc == 4
+		   && !parse_u32(argv[2], &addr)
+		   && !parse_u32(argv[3], &len)) {
+		while (len) {
+			uint32_t n = len < (uint32_t)d_ops.rx_frame_max
+				     ? len : (uint32_t)d_ops.rx_frame_max;
+
+			if (session_read(s->session, addr, buf, n) != STM32_ERR_OK) {
+				daemon_reply(fd, "error %s", s->msg);
+				return 1;
+			}
+			for (i = 0; i < n; i++)
+				sprintf(hex + 2 * i, "%02x", buf[i]);
+			daemon_reply(fd, "data %s", hex);
+			addr += n;
+			len -= n;
+		}
+		daemon_reply(fd, "ok");
+	} else if (!strcmp(cmd, "write") && (argc == 4 || argc == 5)
+		   && !parse_u32(argv[2], &addr)) {
+		img = daemon_get_image(argv[3]);
+		if (!img) {
+			daemon_reply(fd, "error can't load %s", argv[3]);
+			return 0;
+		}
+		verify = argc == 5 && !strcmp(argv[4], "verify");
+		if ((stm32_addr_in_flash(s->stm, addr)
+		     && session_erase(s->session, addr, img->len) != STM32_ERR_OK)
+		    || session_write(s->session, addr, img->data, img->len,
+				     verify) != STM32_ERR_OK) {
+			daemon_reply(fd, "error %s", s->msg);
+			daemon_put_image(img);
+			return 1;
+		}
+		len = img->len;
+		daemon_put_image(img);
+		daemon_reply(fd, "ok %u", len);
+	} else if (!strcmp(cmd, "wdata") && argc == 4
+		   && !parse_u32(argv[2], &addr)
+		   && strlen(argv[3]) % 2 == 0 && strlen(argv[3]) <= 2 * 256) {
+		len = strlen(argv[3]) / 2;
+		for (i = 0; i < len; i++) {
+			unsigned int b;
+
+			if (sscanf(argv[3] + 2 * i, "%2x", &b) != 1) {
+				daemon_reply(fd, "error invalid data");
+				return 0;
+			}
+			buf[i] = b;
+		}
+		if (session_write(s->session, addr, buf, len, 0) != STM32_ERR_OK) {
+			daemon_reply(fd, "error %s", s->msg);
+			return 1;
+		}
+		daemon_reply(fd, "ok %u", len);
+	} else if (!strcmp(cmd, "erase") && argc == 3 && !strcmp(argv[2], "all")) {
+		const stm32_dev_t *dev = s->stm->dev;
+
+		if (session_erase(s->session, dev->fl_start,
+				  dev->fl_end - dev->fl_start) != STM32_ERR_OK) {
+			daemon_reply(fd, "error %s", s->msg);
+			return 1;
+		}
+		daemon_reply(fd, "ok");
+	} else if (!strcmp(cmd, "erase") && argc == 4
+		   && !parse_u32(argv[2], &addr)
+		   && !parse_u32(argv[3], &len)) {
+		if (!stm32_addr_in_flash(s->stm, addr)
+		    || addr != stm32_flash_page_to_addr(s->stm,
+				stm32_flash_addr_to_page_floor(s->stm, addr))) {
+			daemon_reply(fd, "error address must be page aligned");
+			return 0;
+		}
+		if (session_erase(s->session, addr, len) != STM32_ERR_OK) {
+			daemon_reply(fd, "error %s", s->msg);
+			return 1;
+		}
+		daemon_reply(fd, "ok");
+	} else if (!strcmp(cmd, "crc") && argc == 4
+		   && !parse_u32(argv[2], &addr)
+		   && !parse_u32(argv[3], &len)) {
+		if (session_crc(s->session, addr, len, &crc) != STM32_ERR_OK) {
+			daemon_reply(fd, "error %s", s->msg);
+			return 1;
+		}
+		daemon_reply(fd, "ok 0x%08x", crc);
+	} else if (!strcmp(cmd, "go") && (argc == 2 || argc == 3)) {
+		addr = s->stm->dev->fl_start;
+		if (argc == 3 && parse_u32(argv[2], &addr)) {
+			daemon_reply(fd, "error invalid address");
+			return 0;
+		}
+		if (session_go(s->session, addr) != STM32_ERR_OK) {
+			daemon_reply(fd, "error %s", s->msg);
+			return 1;
+		}
+		daemon_reply(fd, "ok");
+		/* the bootloader is gone */
+		return 1;
+	} else if (!strcmp(cmd, "reset") && argc == 2) {
+		if (session_reset(s->session) != STM32_ERR_OK) {
+			daemon_reply(fd, "error %s", s->msg);
+			return 1;
+		}
+		daemon_reply(fd, "ok");
+		return 1;
+	} else {
+		daemon_reply(fd, "error invalid job");
+	}
+	return 0;
+}
+
+static void *daemon_worker(void *arg)
+{
+	struct daemon_session *s = arg;
+	struct daemon_job *job;
+
+	while (1) {
+		pthread_mutex_lock(&s->lock);
+		while (s->head == NULL)
+			pthread_cond_wait(&s->cond, &s->lock);
+		job = s->head;
+		s->head = job->next;
+		if (s->head == NULL)
+			s->tail = NULL;
+		pthread_mutex_unlock(&s->lock);
+
+		if (daemon_run_job(s, job))
+			daemon_close_session(s);
+
+		pthread_mutex_lock(&job->lock);
+		job->done = 1;
+		pthread_cond_signal(&job->cond);
+		pthread_mutex_unlock(&job->lock);
+	}
+	return NULL;
+}
+
+static struct daemon_session *daemon_get_session(const char *device)
+{
+	struct daemon_session *s;
+	pthread_t thread;
+
+	pthread_mutex_lock(&sessions_lock);
+	for (s = sessions; s; s = s->next)
+		if (!strcmp(s->device, device))
+			goto out;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		goto out;
+	snprintf(s->device, sizeof(s->device), "%s", device);
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+	if (pthread_create(&thread, NULL, daemon_worker, s)) {
+		free(s);
+		s = NULL;
+		goto out;
+	}
+	pthread_detach(thread);
+	s->next = sessions;
+	sessions = s;
+out:
+	pthread_mutex_unlock(&sessions_lock);
+	return s;
+}
+
+/* queue the job on its device and wait for the end of it */
+static void daemon_submit(struct daemon_job *job)
+{
+	struct daemon_session *s;
+
+	s = daemon_get_session(job->argv[1]);
+	if (!s) {
+		daemon_reply(job->fd, "error out of resources");
+		return;
+	}
+
+	job->done = 0;
+	job->next = NULL;
+	pthread_mutex_lock(&s->lock);
+	if (s->tail)
+		s->tail->next = job;
+	else
+		s->head = job;
+	s->tail = job;
+	pthread_cond_signal(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+
+	pthread_mutex_lock(&job->lock);
+	while (!job->done)
+		pthread_cond_wait(&job->cond, &job->lock);
+	pthread_mutex_unlock(&job->lock);
+}
+
+static void *daemon_client(void *arg)
+{
+	struct daemon_job job;
+	int fd = (intptr_t)arg;
+	size_t len = 0;
+	char *eol, *tok;
+	ssize_t r;
+
+	memset(&job, 0, sizeof(job));
+	job.fd = fd;
+	pthread_mutex_init(&job.lock, NULL);
+	pthread_cond_init(&job.cond, NULL);
+
+	while (1) {
+		eol = memchr(job.line, '\n', len);
+		if (eol == NULL) {
+			if (len == sizeof(job.line) - 1) {
+				daemon_reply(fd, "error line too long");
+				break;
+			}
+			r = read(fd, job.line + len, sizeof(job.line) - 1 - len);
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r <= 0)
+				break;
+			len += r;
+			continue;
+		}
+
+		*eol = '\0';
+		job.argc = 0;
+		for (tok = strtok(job.line, " \t\r"); tok && job.argc < DAEMON_MAX_ARGS;
+		     tok = strtok(NULL, " \t\r"))
+			job.argv[job.argc++] = tok;
+		if (job.argc >= 2)
+			daemon_submit(&job);
+		else if (job.argc == 1)
+			daemon_reply(fd, "error missing device");
+
+		len -= eol + 1 - job.line;
+		memmove(job.line, eol + 1, len);
+	}
+
+	pthread_cond_destroy(&job.cond);
+	pthread_mutex_destroy(&job.lock);
+	close(fd);
+	return NULL;
+}
+
+int daemon_serve(const char *path, const struct port_options *ops,
+		 const init_seq_t *gpio_seq, char init)
+{
+	struct sockaddr_un addr;
+	pthread_t thread;
+	int fd, cfd;
+
+	d_ops = *ops;
+	d_gpio_seq = gpio_seq;
+	d_init = init;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long: %s\n", path);
+		return 1;
+	}
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		return 1;
+	}
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 8)) {
+		perror(path);
+		close(fd);
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	fprintf(stderr, "Daemon listening on %s\n", path);
+	while (1) {
+		cfd = accept(fd, NULL, NULL);
+		if (cfd < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("accept");
+			break;
+		}
+		if (pthread_create(&thread, NULL, daemon_client,
+				   (void *)(intptr_t)cfd)) {
+			close(cfd);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+
+	close(fd);
+	unlink(path);
+	return 1;
+}
+
+#endif
@@ -0,0 +1,206 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "devcache.h"
+
+#define DEVCACHE_PATH	4096
+
+struct devcache {
+	uint32_t start, end;	/* page aligned range */
+	uint32_t crc;		/* CRC of the whole range */
+	int n_pages;
+	uint32_t *page_crc;
+};
+
+static int devcache_path(const stm32_t *stm, const char *dir, char *path)
+{
+	uint8_t uid[12];
+	int i, n;
+
+	if (stm32_read_uid(stm, uid) != STM32_ERR_OK)
+		return 1;
+	n = snprintf(path, DEVCACHE_PATH, "%s/", dir);
+	for (i = 0; i < 12 && n < DEVCACHE_PATH; i++)
+		n += snprintf(path + n, DEVCACHE_PATH - n, "%02x", uid[i]);
+	return n >= DEVCACHE_PATH;
+}
+
+/* 1 if there is no usable record */
+static int devcache_load(const char *path, struct devcache *c)
+{
+	FILE *f;
+	int i;
+
+	c->page_crc = NULL;
+	f = fopen(path, "r");
+	if (!f)
+		return 1;
+	if (fscanf(f, "%x %x %x %d", &c->start, &c->end, &c->crc,
+		   &c->n_pages) != 4 || c->n_pages <= 0 || c->n_pages > 65536)
+		goto err;
+	c->page_crc = malloc(c->n_pages * sizeof(uint32_t));
+	if (!c->page_crc)
+		goto err;
+	for (i = 0; i < c->n_pages; i++)
+		if (fscanf(f, "%x", &c->page_crc[i]) != 1)
+			goto err;
+	fclose(f);
+	return 0;
+
+err:
+	free(c->page_crc);
+	c->page_crc = NULL;
+	fclose(f);
+	return 1;
+}
+
+static void devcache_save(const char *path, const struct devcache *c)
+{
+	char tmp[DEVCACHE_PATH + 4];
+	FILE *f;
+	int i;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	f = fopen(tmp, "w");
+	if (!f) {
+		fprintf(stderr, "Cannot write %s\n", tmp);
+		return;
+	}
+	fprintf(f, "%08x %08x %08x %d\n", c->start, c->end, c->crc, c->n_pages);
+	for (i = 0; i < c->n_pages; i++)
+		fprintf(f, "%08x\n", c->page_crc[i]);
+	if (fclose(f)) {
+		remove(tmp);
+		return;
+	}
+	remove(path);
+	if (rename(tmp, path))
+		remove(tmp);
+}
+
+/* the expected content of the range: the image, 0xFF around it */
+static stm32_err_t devcache_expect(const stm32_t *stm, uint32_t addr,
+				   const uint8_t *buf, uint32_t len,
+				   struct devcache *c)
+{
+	uint32_t pa, ps, from, to, crc;
+	uint8_t *page;
+	int first, p;
+
+	first = stm32_flash_addr_to_page_floor(stm, addr);
+	c->n_pages = stm32_flash_addr_to_page_ceil(stm, addr + len) - first;
+	c->start = stm32_flash_page_to_addr(stm, first);
+	c->end = stm32_flash_page_to_addr(stm, first + c->n_pages);
+	c->page_crc = malloc(c->n_pages * sizeof(uint32_t));
+	if (!c->page_crc)
+		return STM32_ERR_UNKNOWN;
+
+	crc = 0xFFFFFFFF;
+	for (p = 0; p < c->n_pages; p++) {
+		pa = stm32_flash_page_to_addr(stm, first + p);
+		ps = stm32_flash_page_to_addr(stm, first + p + 1) - pa;
+		page = malloc(ps);
+		if (!page) {
+			free(c->page_crc);
+			c->page_crc = NULL;
+			return STM32_ERR_UNKNOWN;
+		}
+		from = pa > addr ? pa : addr;
+		to = pa + ps < addr + len ? pa + ps : addr + len;
+		memset(page, 0xFF, ps);
+		memcpy(page + from - pa, buf + from - addr, to - from);
+		c->page_crc[p] = stm32_sw_crc(0xFFFFFFFF, page, ps);
+		crc = stm32_sw_crc(crc, page, ps);
+		free(page);
+	}
+	c->crc = crc;
+	return STM32_ERR_OK;
+}
+
+/*
+ * Write the image like session_write_diff(). The dirty pages come from
+ * the record of the device when the bootloader has the CRC command and
+ * the flash still matches the record, otherwise from session_write_diff().
+ * The record is replaced by the written range on success.
+ */
+stm32_err_t devcache_write(session_t *s, const char *dir, uint32_t addr,
+			   const uint8_t *buf, uint32_t len, int verify,
+			   int *changed, int *total)
+{
+	const stm32_t *stm = session_target(s);
+	struct devcache old, new;
+	char path[DEVCACHE_PATH];
+	uint8_t *dirty;
+	uint32_t crc;
+	int i, skip, known = 0;
+	stm32_err_t ret;
+
+	*changed = *total = 0;
+	if (!len)
+		return STM32_ERR_OK;
+	if (addr + len > stm->dev->fl_end || !stm32_addr_in_flash(stm, addr)
+	    || !stm32_has_crc(stm) || devcache_path(stm, dir, path))
+		return session_write_diff(s, addr, buf, len, verify, changed,
+					  total);
+
+	if (devcache_expect(stm, addr, buf, len, &new) != STM32_ERR_OK) {
+		fprintf(stderr, "Out of memory\n");
+		return STM32_ERR_UNKNOWN;
+	}
+	dirty = calloc(new.n_pages, 1);
+	if (!dirty) {
+		fprintf(stderr, "Out of memory\n");
+		free(new.page_crc);
+		return STM32_ERR_UNKNOWN;
+	}
+
+	/* one CRC over the recorded range tells if the record holds */
+	if (!devcache_load(path, &old)) {
+		skip = stm32_flash_addr_to_page_floor(stm, new.start)
+		       - stm32_flash_addr_to_page_floor(stm, old.start);
+		if (old.start <= new.start && old.end >= new.end
+		    && skip + new.n_pages <= old.n_pages
+		    && session_crc(s, old.start, old.end - old.start, &crc)
+		       == STM32_ERR_OK && crc == old.crc) {
+			for (i = 0; i < new.n_pages; i++) {
+				dirty[i] = old.page_crc[skip + i]
+					   != new.page_crc[i];
+				*changed += dirty[i];
+			}
+			known = 1;
+		}
+		free(old.page_crc);
+	}
+
+	if (known) {
+		*total = new.n_pages;
+		ret = session_write_pages(s, addr, buf, len, verify, dirty);
+	} else {
+		ret = session_write_diff(s, addr, buf, len, verify, changed,
+					 total);
+	}
+	if (ret == STM32_ERR_OK)
+		devcache_save(path, &new);
+	free(dirty);
+	free(new.page_crc);
+	return ret;
+}
@@ -0,0 +1,38 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#ifndef _H_DEVCACHE
+#define _H_DEVCACHE
+
+#include <stdint.h>
+
+#include "session.h"
+
+/*
+ * Host-side record of what was last written to each device, one file per
+ * unique device ID in a directory. When one CRC command confirms that the
+ * flash still holds the recorded content, the pages to rewrite are found
+ * without reading the flash back.
+ */
+
+stm32_err_t devcache_write(session_t *s, const char *dir, uint32_t addr,
+			   const uint8_t *buf, uint32_t len, int verify,
+			   int *changed, int *total);
+
+#endif
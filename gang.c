@@ -0,0 +1,396 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+ * Gang programming: the same job runs at the same time on many targets.
+ * The image is parsed once by the caller, every target then gets its own
+ * child process sharing it, so a slow or failed target cannot delay the
+ * others. The output of the children is collected here and reduced to
+ * one result line per target.
+ *
+ * Station mode is the same for a production line: the job is started on
+ * every new device that appears, as soon as it appears.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "gang.h"
+
+extern FILE *diag;
+
+#if defined(__WIN32__)
+
+int gang_run(char **devices, int count, gang_job_t job)
+{
+	fprintf(stderr, "Gang mode not available on this platform\n");
+	return 1;
+}
+
+int gang_station(const char *pattern, gang_job_t job)
+{
+	fprintf(stderr, "Station mode not available on this platform\n");
+	return 1;
+}
+
+#else
+
+#include <poll.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define GANG_LINE	128
+
+struct gang_target {
+	const char *device;
+	char path[GANG_LINE];
+	int delay_ms;
+	pid_t pid;
+	int fd;
+	int ret;
+	struct timeval start;
+	double time;
+	char line[GANG_LINE];
+	int line_len;
+	char last[GANG_LINE];
+	char dev_name[GANG_LINE];
+};
+
+static double gang_elapsed(const struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) +
+		(now.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+/* keep the device name and the last message, progress uses '\r' */
+static void gang_end_line(struct gang_target *t)
+{
+	const char *id = "Device ID    : ";
+
+	t->line[t->line_len] = '\0';
+	if (t->line_len) {
+		strcpy(t->last, t->line);
+		if (!strncmp(t->line, id, strlen(id)))
+			strcpy(t->dev_name, t->line + strlen(id));
+	}
+	t->line_len = 0;
+}
+
+static void gang_parse(struct gang_target *t, const char *buf, ssize_t len)
+{
+	ssize_t i;
+
+	for (i = 0; i < len; i++) {
+		if (buf[i] == '\n' || buf[i] == '\r') {
+			gang_end_line(t);
+			continue;
+		}
+		if (t->line_len < GANG_LINE - 1)
+			t->line[t->line_len++] = buf[i];
+	}
+}
+
+static int gang_start(struct gang_target *t, gang_job_t job)
+{
+	int p[2];
+
+	if (pipe(p)) {
+		perror("pipe");
+		return 1;
+	}
+
+	fflush(NULL);
+	gettimeofday(&t->start, NULL);
+	t->pid = fork();
+	if (t->pid < 0) {
+		perror("fork");
+		close(p[0]);
+		close(p[1]);
+		return 1;
+	}
+	if (t->pid == 0) {
+		close(p[0]);
+		dup2(p[1], STDOUT_FILENO);
+		dup2(p[1], STDERR_FILENO);
+		close(p[1]);
+		/* keep stdout and stderr in order */
+		setvbuf(stdout, NULL, _IOLBF, 0);
+		if (t->delay_ms)
+			usleep(t->delay_ms * 1000);
+		exit(job(t->device));
+	}
+
+	close(p[1]);
+	t->fd = p[0];
+	return 0;
+}
+
+static void gang_finish(struct gang_target *t)
+{
+	int status;
+
+	gang_end_line(t);
+	close(t->fd);
+	t->fd = -1;
+	while (waitpid(t->pid, &status, 0) < 0 && errno == EINTR)
+		;
+	t->ret = WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+	t->time = gang_elapsed(&t->start);
+	fprintf(diag, "%-24s %s (%.1f s)%s%s\n", t->device,
+		t->ret ? "FAILED" : "done", t->time,
+		t->ret ? ": " : "", t->ret ? t->last : "");
+	fflush(diag);
+}
+
+int gang_run(char **devices, int count, gang_job_t job)
+{
+	struct gang_target *targets;
+	struct pollfd *fds;
+	struct timeval start;
+	char buf[1024];
+	int i, n, running = 0, failed = 0;
+	ssize_t r;
+
+	targets = calloc(count, sizeof(*targets));
+	fds = calloc(count, sizeof(*fds));
+	if (targets == NULL || fds == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		free(targets);
+		free(fds);
+		return 1;
+	}
+
+	fprintf(diag, "Gang of %d target%s\n", count, count > 1 ? "s" : "");
+	gettimeofday(&start, NULL);
+	for (i = 0; i < count; i++) {
+		targets[i].device = devices[i];
+		targets[i].fd = -1;
+		targets[i].ret = 1;
+		if (gang_start(&targets[i], job))
+			strcpy(targets[i].last, "not started");
+		else
+			running++;
+	}
+
+	while (running) {
+		for (i = n = 0; i < count; i++) {
+			if (targets[i].fd < 0)
+				continue;
+			fds[n].fd = targets[i].fd;
+			fds[n].events = POLLIN;
+			n++;
+		}
+		if (poll(fds, n, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+		for (i = n = 0; i < count; i++) {
+			if (targets[i].fd < 0)
+				continue;
+			if (fds[n++].revents == 0)
+				continue;
+			r = read(targets[i].fd, buf, sizeof(buf));
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r > 0) {
+				gang_parse(&targets[i], buf, r);
+				continue;
+			}
+			gang_finish(&targets[i]);
+			running--;
+		}
+	}
+
+	fprintf(diag, "\n%-24s %-6s %7s  %s\n", "Port", "Result", "Time",
+		"Device / error");
+	for (i = 0; i < count; i++) {
+		struct gang_target *t = &targets[i];
+
+		if (t->ret)
+			failed++;
+		fprintf(diag, "%-24s %-6s %6.1fs  %s\n", t->device,
+			t->ret ? "FAIL" : "OK", t->time,
+			t->ret ? t->last : t->dev_name);
+	}
+	fprintf(diag, "\n%d/%d targets passed in %.1f s\n", count - failed,
+		count, gang_elapsed(&start));
+
+	free(fds);
+	free(targets);
+	return failed ? 1 : 0;
+}
+
+#if defined(__linux__)
+
+#include <fnmatch.h>
+#include <sys/inotify.h>
+
+#define GANG_STATION_MAX	64
+#define GANG_SETTLE_MS		200	/* let udev set up the new node */
+
+/*
+ * Watch the directory of "pattern", e.g. /dev/ttyUSB* or
+ * /dev/serial/by-id/usb-FTDI*, and run the job on each device created
+ * there. Runs until interrupted.
+ */
+int gang_station(const char *pattern, gang_job_t job)
+{
+	struct gang_target targets[GANG_STATION_MAX];
+	struct pollfd fds[GANG_STATION_MAX + 1];
+	struct inotify_event *ev;
+	char dir[GANG_LINE], path[GANG_LINE];
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const char *base;
+	int i, n, fd, pass = 0, fail = 0;
+	ssize_t r, pos;
+
+	base = strrchr(pattern, '/');
+	if (base) {
+		snprintf(dir, sizeof(dir), "%.*s", (int)(base - pattern), pattern);
+		if (!dir[0])
+			strcpy(dir, "/");
+		base++;
+	} else {
+		strcpy(dir, ".");
+		base = pattern;
+	}
+
+	fd = inotify_init();
+	if (fd < 0) {
+		perror("inotify_init");
+		return 1;
+	}
+	if (inotify_add_watch(fd, dir, IN_CREATE | IN_MOVED_TO) < 0) {
+		perror(dir);
+		close(fd);
+		return 1;
+	}
+
+	memset(targets, 0, sizeof(targets));
+	for (i = 0; i < GANG_STATION_MAX; i++)
+		targets[i].fd = -1;
+
+	fprintf(diag, "Station: waiting for devices %s/%s\n", dir, base);
+	fflush(diag);
+	while (1) {
+		fds[0].fd = fd;
+		fds[0].events = POLLIN;
+		for (i = 0, n = 1; i < GANG_STATION_MAX; i++) {
+			if (targets[i].fd < 0)
+				continue;
+			fds[n].fd = targets[i].fd;
+			fds[n].events = POLLIN;
+			n++;
+		}
+		if (poll(fds, n, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+
+		for (i = 0, n = 1; i < GANG_STATION_MAX; i++) {
+			struct gang_target *t = &targets[i];
+
+			if (t->fd < 0)
+				continue;
+			if (fds[n++].revents == 0)
+				continue;
+			r = read(t->fd, buf, sizeof(buf));
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r > 0) {
+				gang_parse(t, buf, r);
+				continue;
+			}
+			gang_finish(t);
+			if (t->ret)
+				fail++;
+			else
+				pass++;
+			fprintf(diag, "Station: %d passed, %d failed\n", pass, fail);
+			fflush(diag);
+		}
+
+		if (!(fds[0].revents & POLLIN))
+			continue;
+		r = read(fd, buf, sizeof(buf));
+		if (r <= 0)
+			continue;
+		for (pos = 0; pos < r; pos += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event *)(buf + pos);
+			if (!ev->len || fnmatch(base, ev->name, 0))
+				continue;
+			if (snprintf(path, sizeof(path), "%s/%s",
+				     strcmp(dir, "/") ? dir : "",
+				     ev->name) >= (int)sizeof(path))
+				continue;
+
+			/* same board seen twice, or station full */
+			for (i = 0; i < GANG_STATION_MAX; i++)
+				if (targets[i].fd >= 0
+				    && !strcmp(targets[i].path, path))
+					break;
+			if (i < GANG_STATION_MAX)
+				continue;
+			for (i = 0; i < GANG_STATION_MAX; i++)
+				if (targets[i].fd < 0)
+					break;
+			if (i == GANG_STATION_MAX) {
+				fprintf(stderr, "%s: too many boards, ignored\n", path);
+				continue;
+			}
+
+			memset(&targets[i], 0, sizeof(targets[i]));
+			strcpy(targets[i].path, path);
+			targets[i].device = targets[i].path;
+			targets[i].delay_ms = GANG_SETTLE_MS;
+			targets[i].fd = -1;
+			if (gang_start(&targets[i], job)) {
+				fail++;
+				continue;
+			}
+			fprintf(diag, "%-24s started\n", path);
+			fflush(diag);
+		}
+	}
+
+	close(fd);
+	return 1;
+}
+
+#else
+
+int gang_station(const char *pattern, gang_job_t job)
+{
+	fprintf(stderr, "Station mode not available on this platform\n");
+	return 1;
+}
+
+#endif
+
+#endif
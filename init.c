@@ -26,16 +26,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+#endif
 #include "init.h"
 #include "serial.h"
 #include "stm32.h"
 #include "port.h"
 #include "utils.h"
 
-extern FILE *diag;
-
 struct gpio_list {
 	struct gpio_list *next;
 	int gpio;
@@ -163,25 +166,279 @@ static int drive_gpio(int n, int level, struct gpio_list **gpio_to_release)
 }
 #endif
 
-static int gpio_sequence(struct port_interface *port, const char *seq, size_t len_seq)
+/*
+ * Lines given as "chip.line" go through the GPIO character device: all
+ * the lines of a chip used in the sequence are requested at once, and
+ * held by the port until gpio_lines_release(), so that BOOT0 and NRST
+ * keep their owner between the entry and the exit sequences. The
+ * signals joined by '&' are applied with a single ioctl.
+ */
+struct gpio_chip {
+	struct gpio_chip *next;
+	int chip;
+	int fd;			/* line request */
+	unsigned int n_lines;
+	unsigned int lines[64];
+	uint64_t out;		/* lines driven so far */
+	uint64_t values;
+	uint64_t pending;	/* changed since the last ioctl */
+	int reconfig;		/* a line becomes output */
+};
+
+#if defined(__linux__) && defined(GPIO_V2_GET_LINE_IOCTL)
+static struct gpio_chip *gpio_chip_find(struct gpio_chip *list, int chip)
 {
-	struct gpio_list *gpio_to_release = NULL;
-#if defined(__linux__)
-	struct gpio_list *to_free;
+	for (; list; list = list->next)
+		if (list->chip == chip)
+			return list;
+	return NULL;
+}
+
+static int gpio_chip_line(struct gpio_chip *c, unsigned int line)
+{
+	unsigned int i;
+
+	for (i = 0; i < c->n_lines; i++)
+		if (c->lines[i] == line)
+			return i;
+	return -1;
+}
+
+/* collect the "chip.line" signals of the sequence */
+static int gpio_chip_collect(const char *s, size_t l, struct gpio_chip **list)
+{
+	struct gpio_chip *c;
+	unsigned int line;
+	int chip;
+
+	while (l > 0 && *s) {
+		if (!isdigit(*s)) {
+			s++;
+			l--;
+			continue;
+		}
+		chip = atoi(s);
+		while (l > 0 && isdigit(*s)) {
+			s++;
+			l--;
+		}
+		if (l < 2 || *s != '.' || !isdigit(s[1]))
+			continue;
+		line = atoi(++s);
+		l--;
+		while (l > 0 && isdigit(*s)) {
+			s++;
+			l--;
+		}
+
+		c = gpio_chip_find(*list, chip);
+		if (!c) {
+			c = calloc(1, sizeof(*c));
+			if (!c) {
+				fprintf(stderr, "Out of memory\n");
+				return 1;
+			}
+			c->chip = chip;
+			c->fd = -1;
+			c->next = *list;
+			*list = c;
+		}
+		if (gpio_chip_line(c, line) >= 0)
+			continue;
+		if (c->n_lines == GPIO_V2_LINES_MAX) {
+			fprintf(stderr, "Too many lines on gpiochip%d\n", chip);
+			return 1;
+		}
+		c->lines[c->n_lines++] = line;
+	}
+	return 0;
+}
+
+/* the lines keep their direction until they are driven */
+static int gpio_chip_request(struct gpio_chip *list)
+{
+	struct gpio_v2_line_request req;
+	char file[32];
+	int fd, ret;
+
+	for (; list; list = list->next) {
+		sprintf(file, "/dev/gpiochip%d", list->chip);
+		fd = open(file, O_RDONLY);
+		if (fd < 0) {
+			fprintf(stderr, "Cannot open file \"%s\"\n", file);
+			return 1;
+		}
+		memset(&req, 0, sizeof(req));
+		memcpy(req.offsets, list->lines,
+		       list->n_lines * sizeof(list->lines[0]));
+		strcpy(req.consumer, "stm32flash");
+		req.num_lines = list->n_lines;
+		ret = ioctl(fd, GPIO_V2_GET_LINE_IOCTL, &req);
+		close(fd);
+		if (ret < 0) {
+			fprintf(stderr, "Cannot request lines of \"%s\"\n",
+				file);
+			return 1;
+		}
+		list->fd = req.fd;
+	}
+	return 0;
+}
+
+static int gpio_chip_set(struct gpio_chip *list, int chip, unsigned int line,
+			 int level)
+{
+	struct gpio_chip *c;
+	uint64_t bit;
+
+	c = gpio_chip_find(list, chip);
+	if (!c || gpio_chip_line(c, line) < 0)
+		return 0;
+	bit = 1ULL << gpio_chip_line(c, line);
+	if (!(c->out & bit))
+		c->reconfig = 1;
+	c->out |= bit;
+	c->pending |= bit;
+	if (level)
+		c->values |= bit;
+	else
+		c->values &= ~bit;
+	return 1;
+}
+
+/* apply the pending changes, one ioctl per chip */
+static int gpio_chip_flush(struct gpio_chip *list)
+{
+	struct gpio_v2_line_config cfg;
+	struct gpio_v2_line_values val;
+	int ret;
+
+	for (; list; list = list->next) {
+		if (!list->pending)
+			continue;
+		if (list->reconfig) {
+			memset(&cfg, 0, sizeof(cfg));
+			cfg.num_attrs = 2;
+			cfg.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_FLAGS;
+			cfg.attrs[0].attr.flags = GPIO_V2_LINE_FLAG_OUTPUT;
+			cfg.attrs[0].mask = list->out;
+			cfg.attrs[1].attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+			cfg.attrs[1].attr.values = list->values;
+			cfg.attrs[1].mask = list->out;
+			ret = ioctl(list->fd, GPIO_V2_LINE_SET_CONFIG_IOCTL, &cfg);
+		} else {
+			val.bits = list->values;
+			val.mask = list->pending;
+			ret = ioctl(list->fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &val);
+		}
+		if (ret < 0) {
+			fprintf(stderr, "Cannot set lines of gpiochip%d\n",
+				list->chip);
+			return 1;
+		}
+		list->pending = 0;
+		list->reconfig = 0;
+	}
+	return 0;
+}
+
+static void gpio_chip_release(struct gpio_chip *list)
+{
+	struct gpio_chip *next;
+
+	for (; list; list = next) {
+		next = list->next;
+		if (list->fd >= 0)
+			close(list->fd);
+		free(list);
+	}
+}
+#else
+static int gpio_chip_collect(const char *s, size_t l, struct gpio_chip **list)
+{
+	for (; l > 0 && *s; s++, l--)
+		if (*s == '.') {
+			fprintf(stderr, "GPIO character device not supported\n");
+			return 1;
+		}
+	return 0;
+}
+
+static int gpio_chip_request(struct gpio_chip *list)
+{
+	return 0;
+}
+
+static int gpio_chip_set(struct gpio_chip *list, int chip, unsigned int line,
+			 int level)
+{
+	return 0;
+}
+
+static int gpio_chip_flush(struct gpio_chip *list)
+{
+	return 0;
+}
+
+static void gpio_chip_release(struct gpio_chip *list)
+{
+}
 #endif
-	int ret = 0, level, gpio;
-	int sleep_time = 0;
-	int delimiter = 0;
-	const char *sig_str = NULL;
+
+/* one step of a compiled GPIO sequence */
+enum gpio_op {
+	GPIO_OP_PORT,		/* rts, dtr or brk of the port */
+	GPIO_OP_SYSFS,		/* GPIO number in /sys/class/gpio */
+	GPIO_OP_CHIP,		/* chip.line, changed at the next flush */
+	GPIO_OP_FLUSH,		/* apply the chip.line changes */
+	GPIO_OP_DELAY,
+};
+
+struct gpio_action {
+	enum gpio_op op;
+	int gpio;		/* port signal, GPIO number or chip */
+	int line;
+	int level;
+	long delay;		/* us */
+};
+
+static void gpio_add(struct gpio_action *a, int *n, enum gpio_op op, int gpio,
+		     int line, int level, long delay)
+{
+	/* a flush after a flush does nothing */
+	if (op == GPIO_OP_FLUSH && *n && a[*n - 1].op == GPIO_OP_FLUSH)
+		return;
+	a[*n].op = op;
+	a[*n].gpio = gpio;
+	a[*n].line = line;
+	a[*n].level = level;
+	a[*n].delay = delay;
+	(*n)++;
+}
+
+/*
+ * Parse the sequence into a list of actions, printed once here, so that
+ * the signals are then driven without any parsing or output in between.
+ */
+static int gpio_compile(const char *seq, size_t len_seq,
+			struct gpio_action **actions, int *n)
+{
+	struct gpio_action *a;
+	int level, gpio, line;
+	long delay;
 	const char *s = seq;
 	size_t l = len_seq;
 
-	fprintf(diag, "\nGPIO sequence start\n");
-	while (ret == 0 && *s && l > 0) {
-		sig_str = NULL;
-		sleep_time = 0;
-		delimiter = 0;
+	/* at most a flush and an action per character, and the last flush */
+	a = calloc(2 * len_seq + 1, sizeof(*a));
+	if (!a) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	*actions = a;
+	*n = 0;
 
+	while (*s && l > 0) {
 		if (*s == '-') {
 			level = 0;
 			s++;
@@ -195,23 +452,45 @@ static int gpio_sequence(struct port_interface *port, const char *seq, size_t le
 				s++;
 				l--;
 			}
-		} else if (l >= 3 && !strncmp(s, "rts", 3)) {
-			sig_str = s;
-			gpio = -GPIO_RTS;
-			s += 3;
-			l -= 3;
-		} else if (l >= 3 && !strncmp(s, "dtr", 3)) {
-			sig_str = s;
-			gpio = -GPIO_DTR;
-			s += 3;
-			l -= 3;
-		} else if (l >= 3 && !strncmp(s, "brk", 3)) {
-			sig_str = s;
-			gpio = -GPIO_BRK;
+			if (l > 1 && *s == '.' && isdigit(s[1])) {
+				line = atoi(++s);
+				l--;
+				while (isdigit(*s)) {
+					s++;
+					l--;
+				}
+				fprintf(diag, " setting gpio %i.%i to %i\n",
+					gpio, line, level);
+				gpio_add(a, n, GPIO_OP_CHIP, gpio, line, level, 0);
+				continue;
+			}
+			/* "10ms" or "500us" is a delay, joined with '&' */
+			if (l > 1 && (s[0] == 'm' || s[0] == 'u') && s[1] == 's') {
+				delay = s[0] == 'm' ? gpio * 1000L : gpio;
+				s += 2;
+				l -= 2;
+				if (!level)
+					goto invalid;
+				fprintf(diag, " delay %li us\n", delay);
+				gpio_add(a, n, GPIO_OP_FLUSH, 0, 0, 0, 0);
+				gpio_add(a, n, GPIO_OP_DELAY, 0, 0, 0, delay);
+				continue;
+			}
+			fprintf(diag, " setting gpio %i to %i\n", gpio, level);
+			gpio_add(a, n, GPIO_OP_FLUSH, 0, 0, 0, 0);
+			gpio_add(a, n, GPIO_OP_SYSFS, gpio, 0, level, 0);
+		} else if (l >= 3 && (!strncmp(s, "rts", 3)
+				      || !strncmp(s, "dtr", 3)
+				      || !strncmp(s, "brk", 3))) {
+			gpio = s[0] == 'r' ? GPIO_RTS
+			       : s[0] == 'd' ? GPIO_DTR : GPIO_BRK;
+			fprintf(diag, " setting port signal %.3s to %i\n", s,
+				level);
+			gpio_add(a, n, GPIO_OP_FLUSH, 0, 0, 0, 0);
+			gpio_add(a, n, GPIO_OP_PORT, gpio, 0, level, 0);
 			s += 3;
 			l -= 3;
-		} else if (*s && (l > 0)) {
-			delimiter = 1;
+		} else if (*s && (l > 0) && level) {
 			/* The ',' delimiter adds a 100 ms delay between signal toggles.
 			 * i.e -rts,dtr will reset rts, wait 100 ms, set dtr.
 			 *
@@ -222,42 +501,155 @@ static int gpio_sequence(struct port_interface *port, const char *seq, size_t le
 			 * without delay, then wait 300 ms, set rts, wait 100 ms, reset dtr.
 			 */
 			if (*s == ',') {
-				s++;
-				l--;
-				sleep_time = 100000;
-			} else if (*s == '&') {
-				s++;
-				l--;
-			} else {
+				fprintf(diag, " delay %i us\n", 100000);
+				gpio_add(a, n, GPIO_OP_FLUSH, 0, 0, 0, 0);
+				gpio_add(a, n, GPIO_OP_DELAY, 0, 0, 0, 100000);
+			} else if (*s != '&') {
 				fprintf(stderr, "Character \'%c\' is not a valid signal or separator\n", *s);
-				ret = 1;
-				break;
+				return 1;
 			}
-		} else {
-			/* E.g. modifier without signal */
-			fprintf(stderr, "Invalid sequence %.*s\n", (int) len_seq, seq);
-			ret = 1;
+			s++;
+			l--;
+		} else
+			goto invalid;
+	}
+	gpio_add(a, n, GPIO_OP_FLUSH, 0, 0, 0, 0);
+	return 0;
+
+invalid:
+	/* E.g. modifier without signal */
+	fprintf(stderr, "Invalid sequence %.*s\n", (int) len_seq, seq);
+	return 1;
+}
+
+#if defined(__linux__)
+/* absolute deadlines: the time spent driving the signals is not added */
+static void gpio_delay(struct timespec *t, long us)
+{
+	t->tv_nsec += us % 1000000 * 1000;
+	t->tv_sec += us / 1000000 + t->tv_nsec / 1000000000;
+	t->tv_nsec %= 1000000000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, t, NULL)
+	       == EINTR)
+		;
+}
+#else
+static void gpio_delay(struct timespec *t, long us)
+{
+	usleep(us);
+}
+#endif
+
+static int gpio_run(struct port_interface *port, const struct gpio_action *a,
+		    int n, struct gpio_chip *chips,
+		    struct gpio_list **gpio_to_release)
+{
+	struct timespec t;
+	int i, ret = 0;
+
+#if defined(__linux__)
+	clock_gettime(CLOCK_MONOTONIC, &t);
+#endif
+	for (i = 0; i < n && !ret; i++) {
+		switch (a[i].op) {
+		case GPIO_OP_PORT:
+			ret = (port->gpio(port, a[i].gpio, a[i].level)
+			       != PORT_ERR_OK);
+			if (ret)
+				fprintf(stderr, "Failed to set port signal\n");
+			break;
+		case GPIO_OP_SYSFS:
+			ret = (drive_gpio(a[i].gpio, a[i].level,
+					  gpio_to_release) != 1);
+			break;
+		case GPIO_OP_CHIP:
+			ret = (gpio_chip_set(chips, a[i].gpio, a[i].line,
+					     a[i].level) != 1);
+			break;
+		case GPIO_OP_FLUSH:
+			ret = gpio_chip_flush(chips);
+			break;
+		case GPIO_OP_DELAY:
+			gpio_delay(&t, a[i].delay);
 			break;
 		}
+	}
+	return ret;
+}
 
-		if (!delimiter) { /* actual gpio/port signal driving */
-			if (gpio < 0) {
-				gpio = -gpio;
-				fprintf(diag, " setting port signal %.3s to %i... ", sig_str, level);
-				ret = (port->gpio(port, gpio, level) != PORT_ERR_OK);
-				printStatus(diag, ret);
-			} else {
-				fprintf(diag, " setting gpio %i to %i... ", gpio, level);
-				ret = (drive_gpio(gpio, level, &gpio_to_release) != 1);
-				printStatus(diag, ret);
-			}
-		}
+/* a sequence split in entry and exit parts, parsed once */
+struct init_seq {
+	char *seq;			/* as given, for the "chip.line" lines */
+	struct gpio_action *entry;	/* NULL if empty */
+	struct gpio_action *exit;
+	int n_entry, n_exit;
+	int has_exit;			/* an exit part, even empty, was given */
+};
 
-		if (sleep_time) {
-			fprintf(diag, " delay %i us\n", sleep_time);
-			usleep(sleep_time);
-		}
+init_seq_t *init_seq_compile(const char *seq)
+{
+	init_seq_t *c;
+	char *s;
+	int ret = 0;
+
+	c = calloc(1, sizeof(*c));
+	if (c)
+		c->seq = strdup(seq);
+	if (!c || !c->seq) {
+		fprintf(stderr, "Out of memory\n");
+		free(c);
+		return NULL;
+	}
+
+	s = strchr(seq, ':');
+	if (seq[0] != ':') {
+		fprintf(diag, "\nGPIO entry sequence\n");
+		ret = gpio_compile(seq, s ? (size_t)(s - seq) : strlen(seq),
+				   &c->entry, &c->n_entry);
+	}
+	c->has_exit = s != NULL;
+	if (!ret && s && s[1]) {
+		fprintf(diag, "GPIO exit sequence\n");
+		ret = gpio_compile(s + 1, strlen(s + 1), &c->exit, &c->n_exit);
 	}
+	if (ret) {
+		init_seq_free(c);
+		return NULL;
+	}
+	return c;
+}
+
+void init_seq_free(init_seq_t *seq)
+{
+	if (!seq)
+		return;
+	free(seq->entry);
+	free(seq->exit);
+	free(seq->seq);
+	free(seq);
+}
+
+int init_seq_has_exit(const init_seq_t *seq)
+{
+	return seq && seq->has_exit;
+}
+
+static int gpio_sequence(struct port_interface *port,
+			 const struct gpio_action *actions, int n,
+			 gpio_lines_t *lines)
+{
+	struct gpio_list *gpio_to_release = NULL;
+#if defined(__linux__)
+	struct gpio_list *to_free;
+#endif
+	int ret;
+
+	/* an empty part of the sequence can't be run */
+	if (!actions)
+		return 1;
+
+	fprintf(diag, "\nGPIO sequence start\n");
+	ret = gpio_run(port, actions, n, lines, &gpio_to_release);
 #if defined(__linux__)
 	while (gpio_to_release) {
 		release_gpio(gpio_to_release->gpio, gpio_to_release->input, gpio_to_release->exported);
@@ -266,50 +658,53 @@ static int gpio_sequence(struct port_interface *port, const char *seq, size_t le
 		free(to_free);
 	}
 #endif
-	fprintf(diag, "GPIO sequence end\n\n");
+	fprintf(diag, "GPIO sequence %s\n\n", ret ? "failed" : "end");
 	return ret;
 }
 
-static int gpio_bl_entry(struct port_interface *port, const char *seq)
+/* the whole sequence, entry and exit, is scanned for "chip.line" */
+int gpio_lines_request(const init_seq_t *seq, gpio_lines_t **lines)
 {
-	char *s;
-
-	if (seq == NULL || seq[0] == ':')
+	*lines = NULL;
+	if (seq == NULL)
+		return 0;
+	if (gpio_chip_collect(seq->seq, strlen(seq->seq), lines)
+	    || gpio_chip_request(*lines)) {
+		gpio_chip_release(*lines);
+		*lines = NULL;
 		return 1;
-
-	s = strchr(seq, ':');
-	if (s == NULL)
-		return gpio_sequence(port, seq, strlen(seq));
-
-	return gpio_sequence(port, seq, s - seq);
+	}
+	return 0;
 }
 
-int gpio_bl_exit(struct port_interface *port, const char *seq)
+void gpio_lines_release(gpio_lines_t *lines)
 {
-	char *s;
+	gpio_chip_release(lines);
+}
 
+int gpio_bl_exit(struct port_interface *port, const init_seq_t *seq,
+		 gpio_lines_t *lines)
+{
 	if (seq == NULL)
 		return 1;
 
-	s = strchr(seq, ':');
-	if (s == NULL || s[1] == '\0')
-		return 1;
-
-	return gpio_sequence(port, s + 1, strlen(s + 1));
+	return gpio_sequence(port, seq->exit, seq->n_exit, lines);
 }
 
-int init_bl_entry(struct port_interface *port, const char *seq)
+int init_bl_entry(struct port_interface *port, const init_seq_t *seq,
+		  gpio_lines_t *lines)
 {
 	if (seq)
-		return gpio_bl_entry(port, seq);
+		return gpio_sequence(port, seq->entry, seq->n_entry, lines);
 
 	return 0;
 }
 
-int init_bl_exit(stm32_t *stm, struct port_interface *port, const char *seq)
+int init_bl_exit(stm32_t *stm, struct port_interface *port,
+		 const init_seq_t *seq, gpio_lines_t *lines)
 {
-	if (seq && strchr(seq, ':'))
-		return gpio_bl_exit(port, seq);
+	if (init_seq_has_exit(seq))
+		return gpio_bl_exit(port, seq, lines);
 
 	return stm32_reset_device(stm);
 }
@@ -25,8 +25,24 @@
 #include "stm32.h"
 #include "port.h"
 
-int init_bl_entry(struct port_interface *port, const char *seq);
-int init_bl_exit(stm32_t *stm, struct port_interface *port, const char *seq);
-int gpio_bl_exit(struct port_interface *port, const char *seq);
+/* a -i sequence, compiled once and shared by all the ports using it */
+typedef struct init_seq init_seq_t;
+
+/* the "chip.line" GPIOs of a sequence, requested for the life of a port */
+typedef struct gpio_chip gpio_lines_t;
+
+init_seq_t *init_seq_compile(const char *seq);
+void init_seq_free(init_seq_t *seq);
+int init_seq_has_exit(const init_seq_t *seq);
+
+int gpio_lines_request(const init_seq_t *seq, gpio_lines_t **lines);
+void gpio_lines_release(gpio_lines_t *lines);
+
+int init_bl_entry(struct port_interface *port, const init_seq_t *seq,
+		  gpio_lines_t *lines);
+int init_bl_exit(stm32_t *stm, struct port_interface *port,
+		 const init_seq_t *seq, gpio_lines_t *lines);
+int gpio_bl_exit(struct port_interface *port, const init_seq_t *seq,
+		 gpio_lines_t *lines);
 
 #endif
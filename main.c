@@ -22,6 +22,7 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -37,7 +38,16 @@
 #include "port.h"
 
 #include "parsers/binary.h"
-#include "parsers/hex.h"
+#include "parsers/image.h"
+#include "parsers/memory.h"
+#include "agent.h"
+#include "scan.h"
+#include "gang.h"
+#include "daemon.h"
+#include "session.h"
+#include "pagecache.h"
+#include "devcache.h"
+#include "script.h"
 
 #if defined(__WIN32__) || defined(__CYGWIN__)
 #include <windows.h>
@@ -50,6 +60,7 @@ stm32_t		*stm		= NULL;
 void		*p_st		= NULL;
 parser_t	*parser		= NULL;
 struct port_interface *port = NULL;
+session_t	*session	= NULL;
 
 /* settings */
 struct port_options port_opts = {
@@ -69,26 +80,64 @@ enum actions {
 	ACT_READ_PROTECT,
 	ACT_READ_UNPROTECT,
 	ACT_ERASE_ONLY,
-	ACT_CRC
+	ACT_CRC,
+	ACT_SCAN,
+	ACT_PATCH,
+	ACT_SCRIPT
+};
+
+/* -k, -u and -j given with another action, run before or after it */
+#define CHAIN_READ_UNPROTECT	1
+#define CHAIN_WRITE_UNPROTECT	2
+#define CHAIN_READ_PROTECT	4
+
+/* bytes given with -P */
+struct patch {
+	uint32_t	addr;
+	uint8_t		*data;
+	unsigned int	len;
 };
 
 enum actions	action		= ACT_NONE;
 int		npages		= 0;
 int             spage           = 0;
 int             no_erase        = 0;
+char		skip_blank	= 0;
 char		verify		= 0;
+char		diff_flag	= 0;
+char		*uid_cache	= NULL;
 int		retry		= 10;
 char		exec_flag	= 0;
 uint32_t	execute		= 0;
 char		init_flag	= 1;
+int		ready_timeout	= 0;
 int		use_stdinout	= 0;
 char		force_binary	= 0;
-FILE		*diag;
 char		reset_flag	= 0;
 char		*filename;
 char		*gpio_seq	= NULL;
+init_seq_t	*gpio_compiled	= NULL;	/* gpio_seq, parsed once */
+char		*caps_file	= NULL;
+char		*agent_addr	= NULL;
+char		gang		= 0;
+char		bcast		= 0;
+char		station		= 0;
+char		*daemon_path	= NULL;
+const char	**dev_list	= NULL;
+int		dev_count	= 0;
+uint8_t		*image		= NULL;
+size_t		image_size	= 0;
+unsigned int	*image_ranges	= NULL;	/* start/end pairs of the data */
+unsigned int	n_image_ranges	= 0;
+char		streaming	= 0;	/* stdin written as it comes */
+int		chain		= 0;
+struct patch	*patches	= NULL;
+int		n_patches	= 0;
 uint32_t	start_addr	= 0;
 uint32_t	readwrite_len	= 0;
+char		fp_flag		= 0;
+uint32_t	fp_addr		= 0;
+uint32_t	fp_build	= 0;
 
 /* functions */
 int  parse_options(int argc, char *argv[]);
@@ -111,6 +160,12 @@ static const char *action2str(enum actions act)
 			return "flash erase";
 		case ACT_CRC:
 			return "memory crc";
+		case ACT_SCAN:
+			return "port scan";
+		case ACT_PATCH:
+			return "memory patch";
+		case ACT_SCRIPT:
+			return "job script";
 		default:
 			return "";
 	};
@@ -124,119 +179,580 @@ static void err_multi_action(enum actions new)
 		action2str(action), action2str(new));
 }
 
-static int is_addr_in_ram(uint32_t addr)
+/*
+ * Cleanup addresses:
+ *
+ * Starting from options
+ *	start_addr, readwrite_len, spage, npages
+ * and using device memory size, compute
+ *	start, end, first_page, num_pages
+ */
+static int compute_range(uint32_t *p_start, uint32_t *p_end,
+			 int *p_first_page, int *p_num_pages)
 {
-	return addr >= stm->dev->ram_start && addr < stm->dev->ram_end;
+	uint32_t start, end;
+	int first_page, num_pages;
+
+	if (start_addr || readwrite_len) {
+		start = start_addr;
+
+		if (stm32_addr_in_flash(stm, start))
+			end = stm->dev->fl_end;
+		else {
+			no_erase = 1;
+			if (stm32_addr_in_ram(stm, start))
+				end = stm->dev->ram_end;
+			else if (stm32_addr_in_opt_bytes(stm, start))
+				end = stm->dev->opt_end + 1;
+			else if (stm32_addr_in_sysmem(stm, start))
+				end = stm->dev->mem_end;
+			else {
+				/* Unknown territory */
+				if (readwrite_len)
+					end = start + readwrite_len;
+				else
+					end = start + sizeof(uint32_t);
+			}
+		}
+
+		if (readwrite_len && (end > start + readwrite_len))
+			end = start + readwrite_len;
+
+		first_page = stm32_flash_addr_to_page_floor(stm, start);
+		if (!first_page && end == stm->dev->fl_end)
+			num_pages = STM32_MASS_ERASE;
+		else
+			num_pages = stm32_flash_addr_to_page_ceil(stm, end) - first_page;
+	} else if (!spage && !npages) {
+		start = stm->dev->fl_start;
+		end = stm->dev->fl_end;
+		first_page = 0;
+		num_pages = STM32_MASS_ERASE;
+	} else {
+		first_page = spage;
+		start = stm32_flash_page_to_addr(stm, first_page);
+		if (start > stm->dev->fl_end) {
+			fprintf(stderr, "Address range exceeds flash size.\n");
+			return 1;
+		}
+
+		if (npages) {
+			num_pages = npages;
+			end = stm32_flash_page_to_addr(stm, first_page + num_pages);
+			if (end > stm->dev->fl_end)
+				end = stm->dev->fl_end;
+		} else {
+			end = stm->dev->fl_end;
+			num_pages = stm32_flash_addr_to_page_ceil(stm, end) - first_page;
+		}
+
+		if (!first_page && end == stm->dev->fl_end)
+			num_pages = STM32_MASS_ERASE;
+	}
+
+	*p_start = start;
+	*p_end = end;
+	*p_first_page = first_page;
+	*p_num_pages = num_pages;
+	return 0;
 }
 
-static int is_addr_in_flash(uint32_t addr)
+
+#if defined(__WIN32__) || defined(__CYGWIN__)
+BOOL CtrlHandler( DWORD fdwCtrlType )
 {
-	return addr >= stm->dev->fl_start && addr < stm->dev->fl_end;
+	fprintf(stderr, "\nCaught signal %lu\n",fdwCtrlType);
+	if (p_st &&  parser ) parser->close(p_st);
+	if (session) session_close(session);
+	exit(1);
 }
+#else
+void sighandler(int s){
+	fprintf(stderr, "\nCaught signal %d\n",s);
+	if (p_st &&  parser ) parser->close(p_st);
+	if (session) session_close(session);
+	exit(1);
+}
+#endif
 
-static int is_addr_in_opt_bytes(uint32_t addr)
+/* select and open the parser for the input/output file */
+static int open_image(void)
 {
-	/* option bytes upper range is inclusive in our device table */
-	return addr >= stm->dev->opt_start && addr <= stm->dev->opt_end;
+	if (action == ACT_WRITE && image) {
+		parser = &PARSER_MEMORY;
+		p_st = parser->init();
+		if (!p_st) {
+			fprintf(stderr, "%s Parser failed to initialize\n", parser->name);
+			return 1;
+		}
+		memory_set(p_st, image, image_size);
+		parser->open(p_st, NULL, 0);
+		use_stdinout = 0;
+	} else if (action == ACT_WRITE) {
+		if (image_open(filename, force_binary, &parser, &p_st)
+		    != PARSER_ERR_OK)
+			return 1;
+		fprintf(diag, "Using Parser : %s\n", parser->name);
+	} else {
+		parser = &PARSER_BINARY;
+		p_st = parser->init();
+		if (!p_st) {
+			fprintf(stderr, "%s Parser failed to initialize\n", parser->name);
+			return 1;
+		}
+	}
+
+	return 0;
 }
 
-static int is_addr_in_sysmem(uint32_t addr)
+static void free_image(void)
 {
-	return addr >= stm->dev->mem_start && addr < stm->dev->mem_end;
+	free(image);
+	image = NULL;
+	free(image_ranges);
+	image_ranges = NULL;
+	n_image_ranges = 0;
 }
 
-/* returns the page that contains address "addr" */
-static int flash_addr_to_page_floor(uint32_t addr)
+static int remote_data(void *ctx, const void *buf, size_t len)
 {
-	int page;
-	uint32_t *psize;
+	(void)ctx;
+	return parser->write(p_st, (void *)buf, len) != PARSER_ERR_OK;
+}
 
-	if (!is_addr_in_flash(addr))
-		return 0;
+/* parse the whole input image into memory, for the jobs sharing it */
+static int load_image(void)
+{
+	uint8_t *tmp;
+	size_t alloc = 0;
+	unsigned int len;
+	int ret = 1;
 
-	page = 0;
-	addr -= stm->dev->fl_start;
-	psize = stm->dev->fl_ps;
+	if (open_image())
+		goto close;
 
-	while (addr >= psize[0]) {
-		addr -= psize[0];
-		page++;
-		if (psize[1])
-			psize++;
+	/* size of stdin is unknown, read it in blocks of a frame */
+	do {
+		if (alloc == image_size) {
+			alloc += 0x10000;
+			tmp = realloc(image, alloc);
+			if (!tmp) {
+				fprintf(stderr, "Out of memory\n");
+				goto close;
+			}
+			image = tmp;
+		}
+		len = use_stdinout ? 256 : parser->size(p_st) - image_size;
+		if (len > alloc - image_size)
+			len = alloc - image_size;
+		if (parser->read(p_st, image + image_size, &len) != PARSER_ERR_OK) {
+			fprintf(stderr, "Failed to read input file\n");
+			goto close;
+		}
+		image_size += len;
+	} while (len);
+
+	/* the gaps of a hex file are neither erased nor written */
+	if (parser->ranges) {
+		const unsigned int *ranges;
+
+		n_image_ranges = parser->ranges(p_st, &ranges);
+		image_ranges = malloc(2 * n_image_ranges * sizeof(*ranges));
+		if (n_image_ranges && !image_ranges) {
+			fprintf(stderr, "Out of memory\n");
+			n_image_ranges = 0;
+			goto close;
+		}
+		memcpy(image_ranges, ranges, 2 * n_image_ranges * sizeof(*ranges));
 	}
+	ret = 0;
 
-	return page;
+close:
+	if (p_st) parser->close(p_st);
+	p_st = NULL;
+	return ret;
 }
 
-/* returns the first page whose start addr is >= "addr" */
-int flash_addr_to_page_ceil(uint32_t addr)
+/*
+ * Forward the job to a remote agent: the image is parsed here and sent
+ * as raw binary, data read from the target comes back to our file.
+ */
+static int run_remote(int argc, char *argv[])
 {
-	int page;
-	uint32_t *psize;
+	int ret = 1;
+	parser_err_t perr;
 
-	if (!(addr >= stm->dev->fl_start && addr <= stm->dev->fl_end))
-		return 0;
+	if (action == ACT_WRITE) {
+		if (load_image())
+			goto close;
+	} else if (open_image()) {
+		goto close;
+	} else if (action == ACT_READ) {
+		perr = parser->open(p_st, filename, 1);
+		if (perr != PARSER_ERR_OK) {
+			fprintf(stderr, "%s ERROR: %s\n", parser->name, parser_errstr(perr));
+			if (perr == PARSER_ERR_SYSTEM)
+				perror(filename);
+			goto close;
+		}
+	}
+
+	fprintf(diag, "Agent        : %s\n", port_opts.device);
+	fflush(diag);
+	ret = agent_run_remote(port_opts.device, argc, argv, image, image_size,
+			       diag, remote_data, NULL);
+
+close:
+	free_image();
+	if (p_st) parser->close(p_st);
+	p_st = NULL;
+	return ret;
+}
+
+static int run_action(void);
+
+static int run_gang_job(const char *device)
+{
+	port_opts.device = device;
+	return run_action();
+}
 
-	page = 0;
-	addr -= stm->dev->fl_start;
-	psize = stm->dev->fl_ps;
+/* the image is parsed once, before the jobs are started */
+static int run_gang(void)
+{
+	char **devices;
+	int n, ret = 1;
+
+	if (action == ACT_WRITE && load_image())
+		goto close;
 
-	while (addr >= psize[0]) {
-		addr -= psize[0];
-		page++;
-		if (psize[1])
-			psize++;
+	n = scan_expand(dev_list, dev_count, &devices);
+	if (n < 0)
+		goto close;
+	if (n == 0) {
+		fprintf(stderr, "No device matches\n");
+		goto close;
 	}
 
-	return addr ? page + 1 : page;
+	ret = gang_run(devices, n, run_gang_job);
+	scan_free(devices, n);
+
+close:
+	free_image();
+	return ret;
 }
 
-/* returns the lower address of flash page "page" */
-static uint32_t flash_page_to_addr(int page)
+/*
+ * Called by the agent, in a child process, for every job received.
+ * The file exchanged with the controller replaces the one on its
+ * command line: it holds the parsed image for write, and collects
+ * the data for read.
+ */
+static int run_agent_job(int argc, char *argv[], const char *file)
 {
-	int i;
-	uint32_t addr, *psize;
+	char *agent_caps = caps_file, *agent_uids = uid_cache;
+	char *agent_seq = gpio_seq;
 
-	addr = stm->dev->fl_start;
-	psize = stm->dev->fl_ps;
+	agent_addr = NULL;
+	caps_file = NULL;
+	uid_cache = NULL;
+	optind = 1;
+	if (parse_options(argc, argv) != 0)
+		return 1;
+	if (agent_addr) {
+		fprintf(stderr, "ERROR: Agent jobs can't start an agent\n");
+		return 1;
+	}
+	/* the job comes from the network, it can't name files on this host */
+	if (action == ACT_SCRIPT || action == ACT_SCAN || caps_file || uid_cache
+	    || daemon_path || gang || station) {
+		fprintf(stderr, "ERROR: Agent jobs can't use -J, -K, -U, -D, -G, -H or -l\n");
+		return 1;
+	}
+	caps_file = agent_caps;
+	uid_cache = agent_uids;
 
-	for (i = 0; i < page; i++) {
-		addr += psize[0];
-		if (psize[1])
-			psize++;
+	/* the agent's own sequence is already compiled */
+	if (gpio_seq != agent_seq) {
+		gpio_compiled = init_seq_compile(gpio_seq);
+		if (!gpio_compiled)
+			return 1;
 	}
 
-	return addr;
+	if (action == ACT_WRITE || action == ACT_READ) {
+		filename = (char *)file;
+		use_stdinout = 0;
+		if (action == ACT_WRITE)
+			force_binary = 1;
+	}
+	return run_action();
 }
 
+/* the job runs on every board plugged in, the image is parsed only once */
+static int run_station(void)
+{
+	int ret = 1;
 
-#if defined(__WIN32__) || defined(__CYGWIN__)
-BOOL CtrlHandler( DWORD fdwCtrlType )
+	if (action == ACT_WRITE && load_image())
+		goto close;
+
+	ret = gang_station(port_opts.device, run_gang_job);
+
+close:
+	free_image();
+	return ret;
+}
+
+struct bcast_target {
+	const char *device;
+	session_t *session;
+	char msg[64];
+};
+
+static void bcast_error(void *ctx, const char *msg)
 {
-	fprintf(stderr, "\nCaught signal %lu\n",fdwCtrlType);
-	if (p_st &&  parser ) parser->close(p_st);
-	if (stm  ) stm32_close  (stm);
-	if (port) port->close(port);
-	exit(1);
+	struct bcast_target *tg = ctx;
+
+	snprintf(tg->msg, sizeof(tg->msg), "%s", msg);
 }
-#else
-void sighandler(int s){
-	fprintf(stderr, "\nCaught signal %d\n",s);
-	if (p_st &&  parser ) parser->close(p_st);
-	if (stm  ) stm32_close  (stm);
-	if (port) port->close(port);
-	exit(1);
+
+/* report, once, the targets dropped by the last operation */
+static int bcast_drop(struct bcast_target *tg, const stm32_err_t err[], int n,
+		      const char *what, uint32_t addr)
+{
+	int i, alive = 0;
+
+	for (i = 0; i < n; i++) {
+		if (err[i] == STM32_ERR_OK) {
+			alive++;
+			continue;
+		}
+		if (tg[i].msg[0])
+			continue;
+		snprintf(tg[i].msg, sizeof(tg[i].msg), "%s at 0x%08x", what, addr);
+		fprintf(stderr, "\n%s: %s, target dropped\n", tg[i].device,
+			tg[i].msg);
+	}
+	return alive;
+}
+
+/*
+ * Single process broadcast: all the targets are written in lockstep
+ * with the same frames, see stm32_bcast_write_memory().
+ */
+static int run_broadcast(void)
+{
+	struct session_config cfg = {
+		.port		= port_opts,
+		.gpio_seq	= gpio_compiled,
+		.init		= init_flag,
+		.ready_timeout	= ready_timeout,
+		.caps_file	= caps_file,
+		.error		= bcast_error,
+	};
+	struct bcast_target *tg = NULL;
+	stm32_t **stms = NULL;
+	stm32_err_t *err = NULL;
+	uint8_t **compare = NULL;
+	char **devices = NULL;
+	int i, n = 0, ref = -1, alive = 0, ret = 1;
+	uint32_t addr, start, end;
+	int first_page, num_pages, failed;
+	unsigned int len, max_wlen, max_rlen, off, rlen;
+	size_t offset;
+
+	if (action == ACT_WRITE && load_image())
+		goto close;
+
+	n = scan_expand(dev_list, dev_count, &devices);
+	if (n < 0)
+		goto close;
+	if (n == 0) {
+		fprintf(stderr, "No device matches\n");
+		goto close;
+	}
+
+	tg = calloc(n, sizeof(*tg));
+	stms = calloc(n, sizeof(*stms));
+	err = calloc(n, sizeof(*err));
+	compare = calloc(n, sizeof(*compare));
+	if (!tg || !stms || !err || !compare) {
+		fprintf(stderr, "Out of memory\n");
+		goto close;
+	}
+
+	fprintf(diag, "Broadcast to %d target%s\n", n, n > 1 ? "s" : "");
+	for (i = 0; i < n; i++) {
+		tg[i].device = devices[i];
+		err[i] = STM32_ERR_UNKNOWN;
+		cfg.port.device = devices[i];
+		cfg.ctx = &tg[i];
+		tg[i].session = session_open(&cfg);
+		if (!tg[i].session)
+			continue;
+		stms[i] = session_target(tg[i].session);
+		if (ref < 0)
+			ref = i;
+		if (stms[i]->dev != stms[ref]->dev) {
+			strcpy(tg[i].msg, "different device");
+			continue;
+		}
+		err[i] = STM32_ERR_OK;
+		alive++;
+		fprintf(diag, "%-24s 0x%04x (%s)\n", tg[i].device, stms[i]->pid,
+			stms[i]->dev->name);
+	}
+	if (!alive)
+		goto report;
+
+	/* the address helpers work on the reference target */
+	stm = stms[ref];
+	if (compute_range(&start, &end, &first_page, &num_pages))
+		goto report;
+
+	if (action == ACT_ERASE_ONLY
+	    && num_pages != STM32_MASS_ERASE
+	    && (start != stm32_flash_page_to_addr(stm, first_page)
+		|| end != stm32_flash_page_to_addr(stm, first_page + num_pages))) {
+		fprintf(stderr, "Specified start & length are invalid (must be page aligned)\n");
+		goto report;
+	}
+
+	if (action == ACT_ERASE_ONLY || (!no_erase && num_pages)) {
+		fprintf(diag, "Erasing memory\n");
+		fflush(diag);
+		stm32_bcast_erase_memory(stms, n, err, first_page, num_pages);
+		alive = bcast_drop(tg, err, n, "erase failed", start);
+	}
+
+	if (action != ACT_WRITE || !alive) {
+		ret = 0;
+		goto report;
+	}
+
+	max_wlen = port_opts.tx_frame_max - 2;	/* skip len and crc */
+	max_wlen &= ~3;	/* 32 bit aligned */
+
+	max_rlen = port_opts.rx_frame_max;
+	max_rlen = max_rlen < max_wlen ? max_rlen : max_wlen;
+
+	for (i = 0; verify && i < n; i++) {
+		compare[i] = malloc(max_wlen);
+		if (!compare[i]) {
+			fprintf(stderr, "Out of memory\n");
+			goto report;
+		}
+	}
+
+	fprintf(diag, "Write to memory\n");
+	fflush(diag);
+	addr = start;
+	offset = 0;
+	while (alive && addr < end && offset < image_size) {
+		uint32_t left	= end - addr;
+		len		= max_wlen > left ? left : max_wlen;
+		len		= len > image_size - offset ? image_size - offset : len;
+
+		if (!skip_blank || !stm32_addr_in_flash(stm, addr)
+		    || !is_blank(image + offset, len)) {
+			stm32_bcast_write_memory(stms, n, err, addr,
+						 image + offset, len);
+			alive = bcast_drop(tg, err, n, "write failed", addr);
+		}
+
+		for (off = 0; verify && off < len; off += rlen) {
+			uint8_t *dst[n];
+
+			rlen = len - off < max_rlen ? len - off : max_rlen;
+			for (i = 0; i < n; i++)
+				dst[i] = compare[i] ? compare[i] + off : NULL;
+			stm32_bcast_read_memory(stms, n, err, addr + off, dst, rlen);
+		}
+		if (verify)
+			alive = bcast_drop(tg, err, n, "read failed", addr);
+
+		/* a target that doesn't match is retried alone */
+		for (i = 0; verify && i < n; i++) {
+			failed = 0;
+			while (err[i] == STM32_ERR_OK
+			       && memcmp(compare[i], image + offset, len)) {
+				if (failed++ == retry) {
+					err[i] = STM32_ERR_UNKNOWN;
+					break;
+				}
+				if (stm32_write_memory(stms[i], addr, image + offset, len) != STM32_ERR_OK)
+					err[i] = STM32_ERR_UNKNOWN;
+				for (off = 0; err[i] == STM32_ERR_OK && off < len; off += rlen) {
+					rlen = len - off < max_rlen ? len - off : max_rlen;
+					err[i] = stm32_read_memory(stms[i], addr + off,
+								   compare[i] + off, rlen);
+				}
+			}
+		}
+		if (verify)
+			alive = bcast_drop(tg, err, n, "failed to verify", addr);
+
+		addr	+= len;
+		offset	+= len;
+
+		fprintf(diag,
+			"\rWrote %saddress 0x%08x (%.2f%%) on %d target%s ",
+			verify ? "and verified " : "",
+			addr,
+			(100.0f / image_size) * offset,
+			alive, alive > 1 ? "s" : ""
+		);
+		fflush(diag);
+	}
+	fprintf(diag, "Done.\n");
+	ret = 0;
+
+report:
+	for (i = 0; ret == 0 && i < n; i++) {
+		if (err[i] != STM32_ERR_OK)
+			continue;
+		if (exec_flag) {
+			if (stm32_go(stms[i], execute ? execute : stms[i]->dev->fl_start) != STM32_ERR_OK)
+				strcpy(tg[i].msg, "failed to start execution");
+		} else if (reset_flag) {
+			session_reset(tg[i].session);
+		} else {
+			session_exit(tg[i].session);
+		}
+	}
+
+	fprintf(diag, "\n%-24s %-6s %s\n", "Port", "Result", "Error");
+	for (i = 0; i < n; i++) {
+		if (tg[i].msg[0] || err[i] != STM32_ERR_OK)
+			ret = 1;
+		fprintf(diag, "%-24s %-6s %s\n", tg[i].device,
+			tg[i].msg[0] ? "FAIL" : "OK", tg[i].msg);
+	}
+
+close:
+	for (i = 0; i < n && tg; i++) {
+		session_close(tg[i].session);
+		if (compare)
+			free(compare[i]);
+	}
+	stm = NULL;
+	free(compare);
+	free(err);
+	free(stms);
+	free(tg);
+	if (devices)
+		scan_free(devices, n);
+	free_image();
+	return ret;
 }
-#endif
 
 int main(int argc, char* argv[]) {
-	int ret = 1;
-	stm32_err_t s_err;
-	parser_err_t perr;
 	diag = stdout;
 
-	if (parse_options(argc, argv) != 0)
-		goto close;
+	if (parse_options(argc, argv) != 0) {
+		fprintf(diag, "\n");
+		return 1;
+	}
 
 	if (action == ACT_READ && use_stdinout) {
 		diag = stderr;
@@ -245,6 +761,12 @@ int main(int argc, char* argv[]) {
 	fprintf(diag, "stm32flash " VERSION "\n\n");
 	fprintf(diag, "http://stm32flash.sourceforge.net/\n\n");
 
+	if (gpio_seq) {
+		gpio_compiled = init_seq_compile(gpio_seq);
+		if (!gpio_compiled)
+			return 1;
+	}
+
 #if defined(__WIN32__) || defined(__CYGWIN__)
 	SetConsoleCtrlHandler( (PHANDLER_ROUTINE) CtrlHandler, TRUE );
 #else
@@ -257,155 +779,386 @@ int main(int argc, char* argv[]) {
 	sigaction(SIGINT, &sigIntHandler, NULL);
 #endif
 
-	if (action == ACT_WRITE) {
-		/* first try hex */
-		if (!force_binary) {
-			parser = &PARSER_HEX;
-			p_st = parser->init();
-			if (!p_st) {
-				fprintf(stderr, "%s Parser failed to initialize\n", parser->name);
-				goto close;
-			}
-		}
+	if (action == ACT_SCAN)
+		return scan_ports(&port_opts, dev_list, dev_count,
+				  init_flag, gpio_compiled);
 
-		if (force_binary || (perr = parser->open(p_st, filename, 0)) != PARSER_ERR_OK) {
-			if (force_binary || perr == PARSER_ERR_INVALID_FILE) {
-				if (!force_binary) {
-					parser->close(p_st);
-					p_st = NULL;
-				}
+	if (daemon_path)
+		return daemon_serve(daemon_path, &port_opts, gpio_compiled,
+				    init_flag);
 
-				/* now try binary */
-				parser = &PARSER_BINARY;
-				p_st = parser->init();
-				if (!p_st) {
-					fprintf(stderr, "%s Parser failed to initialize\n", parser->name);
-					goto close;
-				}
-				perr = parser->open(p_st, filename, 0);
-			}
+	if (gang)
+		return run_gang();
 
-			/* if still have an error, fail */
-			if (perr != PARSER_ERR_OK) {
-				fprintf(stderr, "%s ERROR: %s\n", parser->name, parser_errstr(perr));
-				if (perr == PARSER_ERR_SYSTEM) perror(filename);
-				goto close;
-			}
+	if (bcast)
+		return run_broadcast();
+
+	if (station)
+		return run_station();
+
+	if (agent_addr)
+		return agent_serve(agent_addr, run_agent_job);
+
+	/* positional device argument is not forwarded to the agent */
+	if (agent_is_remote(port_opts.device))
+		return run_remote(optind, argv);
+
+	return run_action();
+}
+
+static void show_progress(void *ctx, const char *op, uint32_t addr,
+			  uint32_t done, uint32_t total)
+{
+	(void)ctx;
+	if (!strcmp(op, "write") && streaming)
+		fprintf(diag, "\rWrote %saddress 0x%08x ",
+			verify ? "and verified " : "", addr);
+	else if (!strcmp(op, "write"))
+		fprintf(diag, "\rWrote %saddress 0x%08x (%.2f%%) ",
+			verify ? "and verified " : "", addr,
+			(100.0f / total) * done);
+	else if (!strcmp(op, "read"))
+		fprintf(diag, "\rRead address 0x%08x (%.2f%%) ", addr,
+			(100.0f / total) * done);
+	else
+		return;
+	fflush(diag);
+}
+
+/* the part of the image range "i" below "size", 0 if none */
+static uint32_t image_range(unsigned int i, uint32_t size, uint32_t *off)
+{
+	uint32_t end;
+
+	*off = n_image_ranges ? image_ranges[2 * i] : 0;
+	end = n_image_ranges ? image_ranges[2 * i + 1] : size;
+	if (end > size)
+		end = size;
+	return *off < end ? end - *off : 0;
+}
+
+/*
+ * Erase only the pages holding data of the image, with the real page
+ * sizes, in one command for up to 512 of them; or their bank, or the
+ * whole flash, when the erase time model of the device says it's faster
+ * and the range from -S or -e lets it be erased.
+ */
+static stm32_err_t erase_image_pages(uint32_t start, uint32_t size,
+				     int first_page, int num_pages)
+{
+	uint32_t off, len, *list, n = 0;
+	unsigned int i;
+	int p, last, total;
+	uint8_t *mark;
+	stm32_err_t s_err;
+
+	total = stm32_flash_addr_to_page_ceil(stm, stm->dev->fl_end);
+	mark = calloc(total, 1);
+	list = malloc(total * sizeof(*list));
+	if (!mark || !list) {
+		free(mark);
+		free(list);
+		fprintf(stderr, "Out of memory\n");
+		return STM32_ERR_UNKNOWN;
+	}
+	for (i = 0; i < (n_image_ranges ? n_image_ranges : 1); i++) {
+		len = image_range(i, size, &off);
+		if (!len)
+			continue;
+		last = stm32_flash_addr_to_page_ceil(stm, start + off + len);
+		for (p = stm32_flash_addr_to_page_floor(stm, start + off);
+		     p < last; p++)
+			mark[p] = 1;
+	}
+	for (p = 0; p < total; p++)
+		if (mark[p])
+			list[n++] = p;
+
+	if (num_pages == STM32_MASS_ERASE)
+		s_err = stm32_erase_fastest(stm, list, n, stm->dev->fl_start,
+					    stm->dev->fl_end);
+	else
+		s_err = stm32_erase_fastest(stm, list, n,
+			stm32_flash_page_to_addr(stm, first_page),
+			stm32_flash_page_to_addr(stm, first_page + num_pages));
+	free(mark);
+	free(list);
+	return s_err;
+}
+
+/*
+ * Write stdin as it comes, its size is unknown: each page is erased
+ * right before the first block lands in it, unless -e gives the pages.
+ */
+static int write_stream(uint32_t start, uint32_t end, int first_page,
+			int num_pages)
+{
+	uint8_t buf[256];
+	uint32_t addr;
+	unsigned int len;
+	int page, last, erased = -1;
+
+	if (!no_erase && npages) {
+		fprintf(diag, "Erasing memory\n");
+		if (stm32_erase_memory(stm, first_page, num_pages)
+		    != STM32_ERR_OK) {
+			fprintf(stderr, "Failed to erase memory\n");
+			return 1;
 		}
+	}
 
-		fprintf(diag, "Using Parser : %s\n", parser->name);
-	} else {
-		parser = &PARSER_BINARY;
-		p_st = parser->init();
-		if (!p_st) {
-			fprintf(stderr, "%s Parser failed to initialize\n", parser->name);
-			goto close;
+	fflush(diag);
+	for (addr = start; addr < end; addr += len) {
+		len = end - addr < sizeof(buf) ? end - addr : sizeof(buf);
+		if (parser->read(p_st, buf, &len) != PARSER_ERR_OK) {
+			fprintf(stderr, "Failed to read input file\n");
+			return 1;
+		}
+		if (!len)
+			break;
+
+		page = stm32_flash_addr_to_page_floor(stm, addr);
+		last = stm32_flash_addr_to_page_ceil(stm, addr + len);
+		if (page <= erased)
+			page = erased + 1;
+		if (!no_erase && !npages && page < last) {
+			if (stm32_erase_memory(stm, page, last - page)
+			    != STM32_ERR_OK) {
+				fprintf(stderr, "Failed to erase memory\n");
+				return 1;
+			}
+			erased = last - 1;
 		}
+		if (session_write(session, addr, buf, len, verify)
+		    != STM32_ERR_OK)
+			return 1;
 	}
+	return 0;
+}
 
-	if (port_open(&port_opts, &port) != PORT_ERR_OK) {
-		fprintf(stderr, "Failed to open port: %s\n", port_opts.device);
-		goto close;
+/* fingerprint record: magic, image length, image CRC, build ID */
+#define FP_MAGIC	0x31504653	/* "SFP1" */
+#define FP_SIZE		16
+
+static void fp_put32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static void fp_record(uint8_t *rec, const uint8_t *buf, uint32_t len)
+{
+	uint8_t tail[4];
+	uint32_t crc, n = len & ~3;
+
+	crc = stm32_sw_crc(0xFFFFFFFF, (uint8_t *)buf, n);
+	if (len > n) {
+		memset(tail, 0xFF, sizeof(tail));
+		memcpy(tail, buf + n, len - n);
+		crc = stm32_sw_crc(crc, tail, sizeof(tail));
 	}
+	fp_put32(rec, FP_MAGIC);
+	fp_put32(rec + 4, len);
+	fp_put32(rec + 8, crc);
+	fp_put32(rec + 12, fp_build);
+}
 
-	fprintf(diag, "Interface %s: %s\n", port->name, port->get_cfg_str(port));
-	if (init_flag && init_bl_entry(port, gpio_seq)){
-		ret = 1;
-		fprintf(stderr, "Failed to send boot enter sequence\n");
-		goto close;
+/*
+ * Read the record of the image in the target: 0 if it matches "buf",
+ * 1 if the image has to be written, -1 on error. A stale record is
+ * erased first, an interrupted write can't leave it matching.
+ */
+static int fp_check(const uint8_t *buf, uint32_t len, uint32_t start)
+{
+	uint8_t rec[FP_SIZE], cur[FP_SIZE];
+	int page, i;
+
+	if ((fp_addr & 3) || !stm32_addr_in_flash(stm, fp_addr)
+	    || fp_addr + FP_SIZE > stm->dev->fl_end) {
+		fprintf(stderr, "Invalid fingerprint address 0x%08x\n", fp_addr);
+		return -1;
+	}
+	page = stm32_flash_addr_to_page_floor(stm, fp_addr);
+	if (page < stm32_flash_addr_to_page_ceil(stm, start + len)
+	    && stm32_flash_addr_to_page_ceil(stm, fp_addr + FP_SIZE)
+	       > stm32_flash_addr_to_page_floor(stm, start)) {
+		fprintf(stderr, "The fingerprint can't share a page with the image\n");
+		return -1;
 	}
 
-	port->flush(port);
+	if (stm32_read_memory(stm, fp_addr, cur, FP_SIZE) != STM32_ERR_OK) {
+		fprintf(stderr, "Failed to read the fingerprint at 0x%08x\n",
+			fp_addr);
+		return -1;
+	}
+	fp_record(rec, buf, len);
+	if (!memcmp(rec, cur, FP_SIZE))
+		return 0;
 
-	stm = stm32_init(port, init_flag);
-	if (!stm)
-		goto close;
+	for (i = 0; i < FP_SIZE && cur[i] == 0xFF; i++)
+		;
+	if (i < FP_SIZE && stm32_erase_memory(stm, page, 1) != STM32_ERR_OK) {
+		fprintf(stderr, "Failed to erase the fingerprint page\n");
+		return -1;
+	}
+	return 1;
+}
 
-	fprintf(diag, "Version      : 0x%02x\n", stm->bl_version);
-	if (port->flags & PORT_GVR_ETX) {
-		fprintf(diag, "Option 1     : 0x%02x\n", stm->option1);
-		fprintf(diag, "Option 2     : 0x%02x\n", stm->option2);
+static int fp_write(const uint8_t *buf, uint32_t len)
+{
+	uint8_t rec[FP_SIZE], cur[FP_SIZE];
+
+	fp_record(rec, buf, len);
+	if (stm32_write_memory(stm, fp_addr, rec, FP_SIZE) != STM32_ERR_OK
+	    || (verify && (stm32_read_memory(stm, fp_addr, cur, FP_SIZE)
+			   != STM32_ERR_OK || memcmp(rec, cur, FP_SIZE)))) {
+		fprintf(stderr, "Failed to write the fingerprint at 0x%08x\n",
+			fp_addr);
+		return 1;
 	}
-	fprintf(diag, "Device ID    : 0x%04x (%s)\n", stm->pid, stm->dev->name);
-	fprintf(diag, "- RAM        : Up to %dKiB  (%db reserved by bootloader)\n", (stm->dev->ram_end - 0x20000000) / 1024, stm->dev->ram_start - 0x20000000);
-	fprintf(diag, "- Flash      : Up to %dKiB (size first sector: %dx%d)\n", (stm->dev->fl_end - stm->dev->fl_start ) / 1024, stm->dev->fl_pps, stm->dev->fl_ps[0]);
-	fprintf(diag, "- Option RAM : %db\n", stm->dev->opt_end - stm->dev->opt_start + 1);
-	fprintf(diag, "- System RAM : %dKiB\n", (stm->dev->mem_end - stm->dev->mem_start) / 1024);
+	return 0;
+}
 
-	uint8_t		buffer[256];
-	uint32_t	addr, start, end;
-	unsigned int	len;
-	int		failed = 0;
-	int		first_page, num_pages;
+/*
+ * The device automatically performs a reset after sending the ACK. With
+ * "reconnect" the bootloader is waited for and the session goes on.
+ */
+static int run_protect(enum actions act, int reconnect)
+{
+	stm32_err_t s_err;
 
-	/*
-	 * Cleanup addresses:
-	 *
-	 * Starting from options
-	 *	start_addr, readwrite_len, spage, npages
-	 * and using device memory size, compute
-	 *	start, end, first_page, num_pages
-	 */
-	if (start_addr || readwrite_len) {
-		start = start_addr;
+	if (!reconnect)
+		reset_flag = 0;
+	if (act == ACT_READ_PROTECT) {
+		fprintf(diag, "Read-Protecting flash\n");
+		s_err = stm32_readprot_memory(stm);
+	} else if (act == ACT_READ_UNPROTECT) {
+		fprintf(diag, "Read-UnProtecting flash\n");
+		s_err = stm32_runprot_memory(stm);
+	} else {
+		fprintf(diag, "Write-unprotecting flash\n");
+		s_err = stm32_wunprot_memory(stm);
+	}
+	if (s_err != STM32_ERR_OK) {
+		fprintf(stderr, "Failed to %s flash\n",
+			act == ACT_READ_PROTECT ? "read-protect"
+			: act == ACT_READ_UNPROTECT ? "read-unprotect"
+			: "write-unprotect");
+		return 1;
+	}
+	fprintf(diag,	"Done.\n");
+	if (!reconnect)
+		return 0;
 
-		if (is_addr_in_flash(start))
-			end = stm->dev->fl_end;
-		else {
-			no_erase = 1;
-			if (is_addr_in_ram(start))
-				end = stm->dev->ram_end;
-			else if (is_addr_in_opt_bytes(start))
-				end = stm->dev->opt_end + 1;
-			else if (is_addr_in_sysmem(start))
-				end = stm->dev->mem_end;
-			else {
-				/* Unknown territory */
-				if (readwrite_len)
-					end = start + readwrite_len;
-				else
-					end = start + sizeof(uint32_t);
-			}
-		}
+	fprintf(diag, "Waiting for the bootloader after the reset\n");
+	if (session_reconnect(session) != STM32_ERR_OK)
+		return 1;
+	stm = session_target(session);
+	return 0;
+}
 
-		if (readwrite_len && (end > start + readwrite_len))
-			end = start + readwrite_len;
+static void *load_image_thread(void *arg)
+{
+	int *ret = arg;
+
+	*ret = load_image();
+	return NULL;
+}
+
+static int run_action(void)
+{
+	int ret = 1, loading = 0, load_ret = 0;
+	struct script_end script_end;
+	script_t *script = NULL;
+	pthread_t loader;
+	stm32_err_t s_err;
+	parser_err_t perr;
+	struct session_config cfg = {
+		.port		= port_opts,
+		.gpio_seq	= gpio_compiled,
+		.init		= init_flag,
+		.ready_timeout	= ready_timeout,
+		.caps_file	= caps_file,
+		.retry		= retry,
+		.skip_blank	= skip_blank,
+		.progress	= show_progress,
+	};
 
-		first_page = flash_addr_to_page_floor(start);
-		if (!first_page && end == stm->dev->fl_end)
-			num_pages = STM32_MASS_ERASE;
-		else
-			num_pages = flash_addr_to_page_ceil(end) - first_page;
-	} else if (!spage && !npages) {
-		start = stm->dev->fl_start;
-		end = stm->dev->fl_end;
-		first_page = 0;
-		num_pages = STM32_MASS_ERASE;
-	} else {
-		first_page = spage;
-		start = flash_page_to_addr(first_page);
-		if (start > stm->dev->fl_end) {
-			fprintf(stderr, "Address range exceeds flash size.\n");
+	/*
+	 * stdin is written as it streams in, unless a differential mode needs
+	 * the whole image first. Otherwise the image is parsed while the port
+	 * opens and the bootloader answers; gang jobs get it already parsed
+	 * by the parent.
+	 */
+	streaming = action == ACT_WRITE && use_stdinout && !image && !diff_flag
+		    && !fp_flag;
+	if (streaming) {
+		if (open_image())
+			goto close;
+	} else if (action == ACT_WRITE) {
+		/* a missing file must not leave the target in the bootloader */
+		if (!image && strcmp(filename, "-") && access(filename, R_OK)) {
+			perror(filename);
 			goto close;
 		}
-
-		if (npages) {
-			num_pages = npages;
-			end = flash_page_to_addr(first_page + num_pages);
-			if (end > stm->dev->fl_end)
-				end = stm->dev->fl_end;
-		} else {
-			end = stm->dev->fl_end;
-			num_pages = flash_addr_to_page_ceil(end) - first_page;
+		if (!image && pthread_create(&loader, NULL, load_image_thread,
+					     &load_ret) == 0)
+			loading = 1;
+		else if (!image && load_image())
+			goto close;
+	} else if (action == ACT_SCRIPT) {
+		script = script_load(filename, &script_end);
+		if (!script)
+			goto close;
+		if (script_end.go) {
+			exec_flag = 1;
+			execute = script_end.go_addr;
 		}
+		if (script_end.reset)
+			reset_flag = 1;
+	} else if (open_image())
+		goto close;
 
-		if (!first_page && end == stm->dev->fl_end)
-			num_pages = STM32_MASS_ERASE;
+	session = session_open(&cfg);
+	if (loading) {
+		pthread_join(loader, NULL);
+		if (load_ret)
+			goto close;
 	}
+	if (!session)
+		goto close;
+	port = session_port(session);
+	stm = session_target(session);
 
-	if (action == ACT_READ) {
-		unsigned int max_len = port_opts.rx_frame_max;
+	fprintf(diag, "Interface %s: %s\n", port->name, port->get_cfg_str(port));
+	fprintf(diag, "Version      : 0x%02x\n", stm->bl_version);
+	if (port->flags & PORT_GVR_ETX) {
+		fprintf(diag, "Option 1     : 0x%02x\n", stm->option1);
+		fprintf(diag, "Option 2     : 0x%02x\n", stm->option2);
+	}
+	fprintf(diag, "Device ID    : 0x%04x (%s)\n", stm->pid, stm->dev->name);
+	fprintf(diag, "- RAM        : Up to %dKiB  (%db reserved by bootloader)\n", (stm->dev->ram_end - 0x20000000) / 1024, stm->dev->ram_start - 0x20000000);
+	fprintf(diag, "- Flash      : Up to %dKiB (size first sector: %dx%d)\n", (stm->dev->fl_end - stm->dev->fl_start ) / 1024, stm->dev->fl_pps, stm->dev->fl_ps[0]);
+	fprintf(diag, "- Option RAM : %db\n", stm->dev->opt_end - stm->dev->opt_start + 1);
+	fprintf(diag, "- System RAM : %dKiB\n", (stm->dev->mem_end - stm->dev->mem_start) / 1024);
+
+	if ((chain & CHAIN_READ_UNPROTECT)
+	    && run_protect(ACT_READ_UNPROTECT, 1))
+		goto close;
+	if ((chain & CHAIN_WRITE_UNPROTECT)
+	    && run_protect(ACT_WRITE_UNPROTECT, 1))
+		goto close;
+
+	uint8_t		*buffer;
+	uint32_t	start, end;
+	int		first_page, num_pages;
+
+	if (compute_range(&start, &end, &first_page, &num_pages))
+		goto close;
 
+	if (action == ACT_READ) {
 		fprintf(diag, "Memory read\n");
 
 		perr = parser->open(p_st, filename, 1);
@@ -416,62 +1169,37 @@ int main(int argc, char* argv[]) {
 			goto close;
 		}
 
-		fflush(diag);
-		addr = start;
-		while(addr < end) {
-			uint32_t left	= end - addr;
-			len		= max_len > left ? left : max_len;
-			s_err = stm32_read_memory(stm, addr, buffer, len);
-			if (s_err != STM32_ERR_OK) {
-				fprintf(stderr, "Failed to read memory at address 0x%08x, target write-protected?\n", addr);
-				goto close;
-			}
-			if (parser->write(p_st, buffer, len) != PARSER_ERR_OK)
-			{
-				fprintf(stderr, "Failed to write data to file\n");
-				goto close;
-			}
-			addr += len;
-
-			fprintf(diag,
-				"\rRead address 0x%08x (%.2f%%) ",
-				addr,
-				(100.0f / (float)(end - start)) * (float)(addr - start)
-			);
-			fflush(diag);
+		buffer = malloc(end - start);
+		if (!buffer) {
+			fprintf(stderr, "Out of memory\n");
+			goto close;
 		}
-		fprintf(diag,	"Done.\n");
-		ret = 0;
-		goto close;
-	} else if (action == ACT_READ_PROTECT) {
-		fprintf(diag, "Read-Protecting flash\n");
-		/* the device automatically performs a reset after the sending the ACK */
-		reset_flag = 0;
-		s_err = stm32_readprot_memory(stm);
-		if (s_err != STM32_ERR_OK) {
-			fprintf(stderr, "Failed to read-protect flash\n");
+		fflush(diag);
+		if (session_read(session, start, buffer, end - start)
+		    != STM32_ERR_OK) {
+			free(buffer);
 			goto close;
 		}
-		fprintf(diag,	"Done.\n");
-		ret = 0;
-	} else if (action == ACT_READ_UNPROTECT) {
-		fprintf(diag, "Read-UnProtecting flash\n");
-		/* the device automatically performs a reset after the sending the ACK */
-		reset_flag = 0;
-		s_err = stm32_runprot_memory(stm);
-		if (s_err != STM32_ERR_OK) {
-			fprintf(stderr, "Failed to read-unprotect flash\n");
+		if (parser->write(p_st, buffer, end - start) != PARSER_ERR_OK) {
+			fprintf(stderr, "Failed to write data to file\n");
+			free(buffer);
 			goto close;
 		}
+		free(buffer);
 		fprintf(diag,	"Done.\n");
 		ret = 0;
+		goto close;
+	} else if (action == ACT_READ_PROTECT
+		   || action == ACT_READ_UNPROTECT
+		   || action == ACT_WRITE_UNPROTECT) {
+		ret = run_protect(action, 0);
 	} else if (action == ACT_ERASE_ONLY) {
 		ret = 0;
 		fprintf(diag, "Erasing flash\n");
 
 		if (num_pages != STM32_MASS_ERASE &&
-		    (start != flash_page_to_addr(first_page)
-		     || end != flash_page_to_addr(first_page + num_pages))) {
+		    (start != stm32_flash_page_to_addr(stm, first_page)
+		     || end != stm32_flash_page_to_addr(stm, first_page + num_pages))) {
 			fprintf(stderr, "Specified start & length are invalid (must be page aligned)\n");
 			ret = 1;
 			goto close;
@@ -484,49 +1212,69 @@ int main(int argc, char* argv[]) {
 			goto close;
 		}
 		ret = 0;
-	} else if (action == ACT_WRITE_UNPROTECT) {
-		fprintf(diag, "Write-unprotecting flash\n");
-		/* the device automatically performs a reset after the sending the ACK */
-		reset_flag = 0;
-		s_err = stm32_wunprot_memory(stm);
-		if (s_err != STM32_ERR_OK) {
-			fprintf(stderr, "Failed to write-unprotect flash\n");
-			goto close;
-		}
-		fprintf(diag,	"Done.\n");
-		ret = 0;
 	} else if (action == ACT_WRITE) {
+		uint32_t size, off, len;
+		unsigned int i;
+
 		fprintf(diag, "Write to memory\n");
 
-		off_t 	offset = 0;
-		ssize_t r;
-		unsigned int size;
-		unsigned int max_wlen, max_rlen;
+		if (streaming) {
+			if (write_stream(start, end, first_page, num_pages))
+				goto close;
+			fprintf(diag, "Done.\n");
+			ret = 0;
+			goto close;
+		}
 
-		max_wlen = port_opts.tx_frame_max - 2;	/* skip len and crc */
-		max_wlen &= ~3;	/* 32 bit aligned */
+		/* data from stdin may be shorter than the device */
+		size = end - start;
+		if (size > image_size)
+			size = image_size;
 
-		max_rlen = port_opts.rx_frame_max;
-		max_rlen = max_rlen < max_wlen ? max_rlen : max_wlen;
+		/* one read of the record tells if the target is current */
+		if (fp_flag) {
+			int cur = fp_check(image, size, start);
 
-		/* Assume data from stdin is whole device */
-		if (use_stdinout)
-			size = end - start;
-		else
-			size = parser->size(p_st);
+			if (cur < 0)
+				goto close;
+			if (!cur) {
+				fprintf(diag, "Already up to date.\n");
+				ret = 0;
+				goto close;
+			}
+		}
+
+		/* only the pages that change, checked by CRC or read back */
+		if (diff_flag && stm32_addr_in_flash(stm, start)) {
+			int changed, total;
 
-		// TODO: It is possible to write to non-page boundaries, by reading out flash
-		//       from partial pages and combining with the input data
-		// if ((start % stm->dev->fl_ps[i]) != 0 || (end % stm->dev->fl_ps[i]) != 0) {
-		//	fprintf(stderr, "Specified start & length are invalid (must be page aligned)\n");
-		//	goto close;
-		// }
+			fflush(diag);
+			if (uid_cache)
+				s_err = devcache_write(session, uid_cache,
+						       start, image, size, verify,
+						       &changed, &total);
+			else
+				s_err = session_write_diff(session, start,
+							   image, size, verify,
+							   &changed, &total);
+			if (s_err != STM32_ERR_OK
+			    || (fp_flag && fp_write(image, size)))
+				goto close;
+			fprintf(diag, "\nDone, %d of %d page%s changed.\n",
+				changed, total, total != 1 ? "s" : "");
+			ret = 0;
+			goto close;
+		}
 
 		// TODO: If writes are not page aligned, we should probably read out existing flash
 		//       contents first, so it can be preserved and combined with new data
 		if (!no_erase && num_pages) {
 			fprintf(diag, "Erasing memory\n");
-			s_err = stm32_erase_memory(stm, first_page, num_pages);
+			if (npages)
+				s_err = stm32_erase_memory(stm, first_page, num_pages);
+			else
+				s_err = erase_image_pages(start, size,
+							  first_page, num_pages);
 			if (s_err != STM32_ERR_OK) {
 				fprintf(stderr, "Failed to erase memory\n");
 				goto close;
@@ -534,78 +1282,56 @@ int main(int argc, char* argv[]) {
 		}
 
 		fflush(diag);
-		addr = start;
-		while(addr < end && offset < size) {
-			uint32_t left	= end - addr;
-			len		= max_wlen > left ? left : max_wlen;
-			len		= len > size - offset ? size - offset : len;
-
-			if (parser->read(p_st, buffer, &len) != PARSER_ERR_OK)
-				goto close;
-
-			if (len == 0) {
-				if (use_stdinout) {
-					break;
-				} else {
-					fprintf(stderr, "Failed to read input file\n");
-					goto close;
-				}
-			}
-
-			again:
-			s_err = stm32_write_memory(stm, addr, buffer, len);
-			if (s_err != STM32_ERR_OK) {
-				fprintf(stderr, "Failed to write memory at address 0x%08x\n", addr);
+		for (i = 0; i < (n_image_ranges ? n_image_ranges : 1); i++) {
+			len = image_range(i, size, &off);
+			if (len && session_write(session, start + off, image + off,
+						 len, verify) != STM32_ERR_OK)
 				goto close;
-			}
+		}
+		if (fp_flag && fp_write(image, size))
+			goto close;
 
-			if (verify) {
-				uint8_t compare[len];
-				unsigned int offset, rlen;
-
-				offset = 0;
-				while (offset < len) {
-					rlen = len - offset;
-					rlen = rlen < max_rlen ? rlen : max_rlen;
-					s_err = stm32_read_memory(stm, addr + offset, compare + offset, rlen);
-					if (s_err != STM32_ERR_OK) {
-						fprintf(stderr, "Failed to read memory at address 0x%08x\n", addr + offset);
-						goto close;
-					}
-					offset += rlen;
-				}
+		fprintf(diag,	"Done.\n");
+		ret = 0;
+		goto close;
+	} else if (action == ACT_PATCH) {
+		pagecache_t *cache;
+		uint32_t written;
+		int i, erased;
 
-				for(r = 0; r < len; ++r)
-					if (buffer[r] != compare[r]) {
-						if (failed == retry) {
-							fprintf(stderr, "Failed to verify at address 0x%08x, expected 0x%02x and found 0x%02x\n",
-								(uint32_t)(addr + r),
-								buffer [r],
-								compare[r]
-							);
-							goto close;
-						}
-						++failed;
-						goto again;
-					}
+		fprintf(diag, "Patching memory\n");
 
-				failed = 0;
+		cache = pagecache_new(session);
+		if (!cache) {
+			fprintf(stderr, "Out of memory\n");
+			goto close;
+		}
+		for (i = 0; i < n_patches; i++)
+			if (pagecache_write(cache, patches[i].addr,
+					    patches[i].data, patches[i].len)
+			    != STM32_ERR_OK) {
+				fprintf(stderr, "Failed to patch at address 0x%08x\n",
+					patches[i].addr);
+				pagecache_free(cache);
+				goto close;
 			}
 
-			addr	+= len;
-			offset	+= len;
-
-			fprintf(diag,
-				"\rWrote %saddress 0x%08x (%.2f%%) ",
-				verify ? "and verified " : "",
-				addr,
-				(100.0f / size) * offset
-			);
-			fflush(diag);
-
+		fflush(diag);
+		if (pagecache_flush(cache, verify) != STM32_ERR_OK) {
+			pagecache_free(cache);
+			goto close;
 		}
-
-		fprintf(diag,	"Done.\n");
+		pagecache_stats(cache, &erased, &written);
+		pagecache_free(cache);
+		fprintf(diag, "Done, %d page%s erased, %u bytes written.\n",
+			erased, erased != 1 ? "s" : "", written);
+		ret = 0;
+		goto close;
+	} else if (action == ACT_SCRIPT) {
+		fflush(diag);
+		if (script_run(script, session))
+			goto close;
+		fprintf(diag, "Done.\n");
 		ret = 0;
 		goto close;
 	} else if (action == ACT_CRC) {
@@ -613,11 +1339,9 @@ int main(int argc, char* argv[]) {
 
 		fprintf(diag, "CRC computation\n");
 
-		s_err = stm32_crc_wrapper(stm, start, end - start, &crc_val);
-		if (s_err != STM32_ERR_OK) {
-			fprintf(stderr, "Failed to read CRC\n");
+		if (session_crc(session, start, end - start, &crc_val)
+		    != STM32_ERR_OK)
 			goto close;
-		}
 		fprintf(diag, "CRC(0x%08x-0x%08x) = 0x%08x\n", start, end,
 			crc_val);
 		ret = 0;
@@ -626,7 +1350,13 @@ int main(int argc, char* argv[]) {
 		ret = 0;
 
 close:
-	if (stm && exec_flag && ret == 0) {
+	/* the device resets and stays protected, nothing can follow */
+	if (session && ret == 0 && (chain & CHAIN_READ_PROTECT)) {
+		ret = run_protect(ACT_READ_PROTECT, 0);
+		exec_flag = 0;
+	}
+
+	if (session && exec_flag && ret == 0) {
 		if (execute == 0)
 			execute = stm->dev->fl_start;
 
@@ -639,35 +1369,77 @@ close:
 			fprintf(diag, "failed.\n");
 	}
 
-	if (stm && reset_flag) {
+	if (session && reset_flag) {
 		fprintf(diag, "\nResetting device... \n");
 		fflush(diag);
-		if (init_bl_exit(stm, port, gpio_seq)) {
+		if (session_reset(session) != STM32_ERR_OK)
 			ret = 1;
-			fprintf(diag, "Reset failed.\n");
-		} else
+		else
 			fprintf(diag, "Reset done.\n");
-	} else if (port) {
+	} else if (session) {
 		/* Always run exit sequence if present */
-		if (gpio_seq && strchr(gpio_seq, ':'))
-			ret = gpio_bl_exit(port, gpio_seq) || ret;
+		if (session_exit(session) != STM32_ERR_OK)
+			ret = 1;
 	}
 
 	if (p_st  ) parser->close(p_st);
-	if (stm   ) stm32_close  (stm);
-	if (port)
-		port->close(port);
+	p_st = NULL;
+	script_free(script);
+	session_close(session);
+	session = NULL;
+	stm = NULL;
+	port = NULL;
 
 	fprintf(diag, "\n");
 	return ret;
 }
 
+/* "address:hexbytes", the bytes in memory order */
+static int parse_patch(const char *arg)
+{
+	struct patch *tmp, *p;
+	unsigned int i, b;
+	const char *hex;
+	char *end;
+
+	tmp = realloc(patches, (n_patches + 1) * sizeof(*patches));
+	if (!tmp) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	patches = tmp;
+	p = &patches[n_patches];
+
+	p->addr = strtoul(arg, &end, 0);
+	hex = end + 1;
+	p->len = strlen(hex) / 2;
+	if (*end != ':' || !p->len || strlen(hex) % 2) {
+		fprintf(stderr, "ERROR: Invalid patch \"%s\", expected address:hexbytes\n", arg);
+		return 1;
+	}
+	p->data = malloc(p->len);
+	if (!p->data) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	for (i = 0; i < p->len; i++) {
+		if (sscanf(hex + 2 * i, "%2x", &b) != 1) {
+			fprintf(stderr, "ERROR: Invalid patch \"%s\", expected address:hexbytes\n", arg);
+			free(p->data);
+			return 1;
+		}
+		p->data[i] = b;
+	}
+	n_patches++;
+	return 0;
+}
+
 int parse_options(int argc, char *argv[])
 {
 	int c;
 	char *pLen;
 
-	while ((c = getopt(argc, argv, "a:b:m:r:w:e:vn:g:jkfcChuos:S:F:i:R")) != -1) {
+	while ((c = getopt(argc, argv, "a:b:m:r:w:e:vdn:g:jkfcChuos:S:F:i:RA:lGBHD:P:K:W:J:U:T:E")) != -1) {
 		switch(c) {
 			case 'a':
 				port_opts.bus_addr = strtoul(optarg, NULL, 0);
@@ -722,27 +1494,15 @@ int parse_options(int argc, char *argv[])
 					no_erase = 1;
 				break;
 			case 'u':
-				if (action != ACT_NONE) {
-					err_multi_action(ACT_WRITE_UNPROTECT);
-					return 1;
-				}
-				action = ACT_WRITE_UNPROTECT;
+				chain |= CHAIN_WRITE_UNPROTECT;
 				break;
 
 			case 'j':
-				if (action != ACT_NONE) {
-					err_multi_action(ACT_READ_PROTECT);
-					return 1;
-				}
-				action = ACT_READ_PROTECT;
+				chain |= CHAIN_READ_PROTECT;
 				break;
 
 			case 'k':
-				if (action != ACT_NONE) {
-					err_multi_action(ACT_READ_UNPROTECT);
-					return 1;
-				}
-				action = ACT_READ_UNPROTECT;
+				chain |= CHAIN_READ_UNPROTECT;
 				break;
 
 			case 'o':
@@ -757,6 +1517,26 @@ int parse_options(int argc, char *argv[])
 				verify = 1;
 				break;
 
+			case 'd':
+				diff_flag = 1;
+				break;
+
+			case 'U':
+				uid_cache = optarg;
+				diff_flag = 1;
+				break;
+
+			case 'E':
+				skip_blank = 1;
+				break;
+
+			case 'T':
+				fp_flag = 1;
+				fp_addr = strtoul(optarg, &pLen, 0);
+				if (*pLen == ':')
+					fp_build = strtoul(pLen + 1, NULL, 0);
+				break;
+
 			case 'n':
 				retry = strtoul(optarg, NULL, 0);
 				break;
@@ -838,6 +1618,18 @@ int parse_options(int argc, char *argv[])
 				gpio_seq = optarg;
 				break;
 
+			case 'K':
+				caps_file = optarg;
+				break;
+
+			case 'W':
+				ready_timeout = strtoul(optarg, NULL, 0);
+				if (ready_timeout <= 0) {
+					fprintf(stderr, "ERROR: Invalid bootloader wait time\n");
+					return 1;
+				}
+				break;
+
 			case 'R':
 				reset_flag = 1;
 				break;
@@ -849,9 +1641,64 @@ int parse_options(int argc, char *argv[])
 				}
 				action = ACT_CRC;
 				break;
+
+			case 'J':
+				if (action != ACT_NONE) {
+					err_multi_action(ACT_SCRIPT);
+					return 1;
+				}
+				action = ACT_SCRIPT;
+				filename = optarg;
+				break;
+
+			case 'P':
+				if (action != ACT_NONE && action != ACT_PATCH) {
+					err_multi_action(ACT_PATCH);
+					return 1;
+				}
+				action = ACT_PATCH;
+				if (parse_patch(optarg))
+					return 1;
+				break;
+
+			case 'A':
+				agent_addr = optarg;
+				break;
+
+			case 'l':
+				if (action != ACT_NONE) {
+					err_multi_action(ACT_SCAN);
+					return 1;
+				}
+				action = ACT_SCAN;
+				break;
+
+			case 'G':
+				gang = 1;
+				break;
+
+			case 'B':
+				bcast = 1;
+				break;
+
+			case 'H':
+				station = 1;
+				break;
+
+			case 'D':
+				daemon_path = optarg;
+				break;
 		}
 	}
 
+	/* scan and gang take a list of devices, or patterns like /dev/ttyUSB* */
+	if ((action == ACT_SCAN || gang || bcast) && optind < argc) {
+		dev_list = (const char **)&argv[optind];
+		dev_count = argc - optind;
+		port_opts.device = argv[optind];
+		optind = argc;
+	}
+
 	for (c = optind; c < argc; ++c) {
 		if (port_opts.device) {
 			fprintf(stderr, "ERROR: Invalid parameter specified\n");
@@ -861,13 +1708,94 @@ int parse_options(int argc, char *argv[])
 		port_opts.device = argv[c];
 	}
 
+	/* alone, -u, -j and -k are the action */
+	if (action == ACT_NONE) {
+		if (chain == CHAIN_WRITE_UNPROTECT)
+			action = ACT_WRITE_UNPROTECT;
+		else if (chain == CHAIN_READ_PROTECT)
+			action = ACT_READ_PROTECT;
+		else if (chain == CHAIN_READ_UNPROTECT)
+			action = ACT_READ_UNPROTECT;
+		if (action != ACT_NONE)
+			chain = 0;
+	}
+
+	if (chain && (action == ACT_SCAN || bcast)) {
+		fprintf(stderr, "ERROR: Invalid options, -u, -j and -k can't be used to scan or in broadcast mode\n");
+		return 1;
+	}
+
+	if (daemon_path) {
+		if (port_opts.device || action != ACT_NONE || chain || agent_addr
+		    || gang || bcast || station) {
+			fprintf(stderr, "ERROR: Invalid options, the daemon receives devices and actions from its clients\n");
+			return 1;
+		}
+		return 0;
+	}
+
 	if (port_opts.device == NULL) {
 		fprintf(stderr, "ERROR: Device not specified\n");
 		show_help(argv[0]);
 		return 1;
 	}
 
-	if ((action != ACT_WRITE) && verify) {
+	if (action == ACT_SCAN && (agent_addr || agent_is_remote(port_opts.device))) {
+		fprintf(stderr, "ERROR: Invalid options, scan needs local devices\n");
+		return 1;
+	}
+
+	if (gang && (action == ACT_SCAN || action == ACT_READ)) {
+		fprintf(stderr, "ERROR: Invalid options, gang mode can't be used with \"%s\"\n",
+			action2str(action));
+		return 1;
+	}
+
+	if ((gang || bcast) && (agent_addr || agent_is_remote(port_opts.device))) {
+		fprintf(stderr, "ERROR: Invalid options, gang and broadcast modes need local devices\n");
+		return 1;
+	}
+
+	if (station && (gang || bcast || action == ACT_SCAN || action == ACT_READ
+			|| agent_addr || agent_is_remote(port_opts.device))) {
+		fprintf(stderr, "ERROR: Invalid options, station mode can't be used with these options\n");
+		return 1;
+	}
+
+	if (bcast && (gang || (action != ACT_WRITE && action != ACT_ERASE_ONLY))) {
+		fprintf(stderr, "ERROR: Invalid options, broadcast mode is only for write and erase\n");
+		return 1;
+	}
+
+	if (agent_addr && (action != ACT_NONE || chain)) {
+		fprintf(stderr, "ERROR: Invalid options, the agent receives the actions from the controller\n");
+		return 1;
+	}
+
+	if (agent_addr && agent_is_remote(port_opts.device)) {
+		fprintf(stderr, "ERROR: Invalid options, the agent needs a local device\n");
+		return 1;
+	}
+
+	if (action != ACT_WRITE && diff_flag) {
+		fprintf(stderr, "ERROR: Invalid usage, -d and -U are only valid when writing\n");
+		show_help(argv[0]);
+		return 1;
+	}
+
+	if (skip_blank && no_erase) {
+		fprintf(stderr, "ERROR: Invalid usage, -E needs the flash erased before writing\n");
+		show_help(argv[0]);
+		return 1;
+	}
+
+	if (action != ACT_WRITE && fp_flag) {
+		fprintf(stderr, "ERROR: Invalid usage, -T is only valid when writing\n");
+		show_help(argv[0]);
+		return 1;
+	}
+
+	if ((action != ACT_WRITE && action != ACT_PATCH) && verify) {
 		fprintf(stderr, "ERROR: Invalid usage, -v is only valid when writing\n");
 		show_help(argv[0]);
 		return 1;
@@ -878,19 +1806,33 @@ int parse_options(int argc, char *argv[])
 
 void show_help(char *name) {
 	fprintf(stderr,
-		"Usage: %s [-bvngfhc] [-[rw] filename] [tty_device | i2c_device]\n"
+		"Usage: %s [-bvngfhc] [-[rw] filename] [tty_device | i2c_device | tcp_device]\n"
+		"       %s -l [-bmci] device|pattern...\n"
 		"	-a bus_address	Bus address (e.g. for I2C port)\n"
 		"	-b rate		Baud rate (default 57600)\n"
 		"	-m mode		Serial port mode (default 8e1)\n"
 		"	-r filename	Read flash to file (or - stdout)\n"
 		"	-w filename	Write flash from file (or - stdout)\n"
 		"	-C		Compute CRC of flash content\n"
+		"	-J file		Run the jobs of the script file in one session:\n"
+		"			erase, write, read, crc lines, then go or reset\n"
+		"	-P address:bytes	Patch flash with the hex bytes, rewriting\n"
+		"			only the pages that change (can be repeated)\n"
 		"	-u		Disable the flash write-protection\n"
 		"	-j		Enable the flash read-protection\n"
 		"	-k		Disable the flash read-protection\n"
+		"			With another action, -k and -u run before it and\n"
+		"			-j after it, reconnecting after each reset\n"
 		"	-o		Erase only\n"
 		"	-e n		Only erase n pages before writing the flash\n"
+		"	-E		Don't send the blocks of 0xFF, already in the erased flash\n"
 		"	-v		Verify writes\n"
+		"	-d		Differential write: erase and write only the pages\n"
+		"			whose content changes (checked by CRC or read back)\n"
+		"	-U dir		Like -d, the pages to write are found from the record\n"
+		"			kept in dir for the unique ID of the device\n"
+		"	-T address[:build_id]	Keep a fingerprint of the image at address\n"
+		"			(own page) and skip the write if it matches\n"
 		"	-n count	Retry failed writes up to count times (default 10)\n"
 		"	-g address	Start execution at specified address (0 = flash start)\n"
 		"	-S address[:length]	Specify start address and optionally length for\n"
@@ -906,6 +1848,25 @@ void show_help(char *name) {
 		"	-i GPIO_string	GPIO sequence to enter/exit bootloader mode\n"
 		"			GPIO_string=[entry_seq][:[exit_seq]]\n"
 		"			sequence=[[-]signal]&|,[sequence]\n"
+		"			signal=gpio|chip.line|rts|dtr|brk|delay\n"
+		"			delay=<n>ms|<n>us, ',' waits 100 ms\n"
+		"	-W ms		After the entry sequence, poll the bootloader with INIT\n"
+		"			for up to ms milliseconds instead of a fixed delay\n"
+		"	-K file		Cache the bootloader information of each port in file\n"
+		"			and check it with a single command on the next run\n"
+		"	-A [host:]port	Run as agent, executing jobs from remote controllers\n"
+		"			on the device (controller uses agent://host:port)\n"
+		"			host defaults to 127.0.0.1\n"
+		"	-l		Scan all the given devices in parallel and list\n"
+		"			the bootloaders that answer\n"
+		"	-G		Gang mode, run the same job on all the given\n"
+		"			devices at the same time\n"
+		"	-B		Broadcast mode, write or erase all the given devices\n"
+		"			in lockstep with the same frames\n"
+		"	-H		Station mode, wait for new devices matching the\n"
+		"			pattern and run the job on each one\n"
+		"	-D socket	Run as daemon, executing jobs received on the Unix\n"
+		"			socket and keeping the bootloader sessions open\n"
 		"\n"
 		"GPIO sequence:\n"
 		"	The following signals can appear in a sequence:\n"
@@ -922,6 +1883,8 @@ void show_help(char *name) {
 		"		%s /dev/ttyS0\n"
 		"	  or:\n"
 		"		%s /dev/i2c-0\n"
+		"	  or, through a network terminal server:\n"
+		"		%s rfc2217://192.168.1.10:4001\n"
 		"\n"
 		"	Write with verify and then start execution:\n"
 		"		%s -w filename -v -g 0x0 /dev/ttyS0\n"
@@ -935,6 +1898,23 @@ void show_help(char *name) {
 		"	Start execution:\n"
 		"		%s -g 0x0 /dev/ttyS0\n"
 		"\n"
+		"	Find the bootloaders on all the USB serial adapters:\n"
+		"		%s -l '/dev/ttyUSB*'\n"
+		"\n"
+		"	Write and verify the same image on 16 boards at once:\n"
+		"		%s -G -w filename -v '/dev/ttyUSB*'\n"
+		"\n"
+		"	Program every board plugged in a production station:\n"
+		"		%s -H -i rts,-rts -w filename -v -g 0x0 '/dev/ttyUSB*'\n"
+		"\n"
+		"	Daemon, then a job sent to it:\n"
+		"		%s -D /tmp/stm32flash.sock\n"
+		"		echo 'crc /dev/ttyS0 0x08000000 1024' | socat - UNIX:/tmp/stm32flash.sock\n"
+		"\n"
+		"	Write through an agent running next to the target:\n"
+		"		%s -A 0.0.0.0:4242 /dev/ttyS0	(on the agent host)\n"
+		"		%s -w filename -v agent://agenthost:4242\n"
+		"\n"
 		"	GPIO sequence:\n"
 		"	- entry sequence: GPIO_3=low, GPIO_2=low, 100ms delay, GPIO_2=high\n"
 		"	- exit sequence: GPIO_3=high, GPIO_2=low, 300ms delay, GPIO_2=high\n"
@@ -951,6 +1931,14 @@ void show_help(char *name) {
 		name,
 		name,
 		name,
+		name,
+		name,
+		name,
+		name,
+		name,
+		name,
+		name,
+		name,
 		name
 	);
 }
@@ -0,0 +1,203 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pagecache.h"
+#include "utils.h"
+
+struct pagecache_page {
+	uint32_t addr, size;
+	uint8_t *data;		/* content as the application sees it */
+	uint8_t *orig;		/* content in the target */
+};
+
+struct pagecache {
+	session_t *s;
+	stm32_t *stm;
+	int n_pages;
+	struct pagecache_page *pages;	/* indexed by page number */
+	int erased;
+	uint32_t written;
+};
+
+pagecache_t *pagecache_new(session_t *s)
+{
+	pagecache_t *c;
+	stm32_t *stm = session_target(s);
+	int i;
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return NULL;
+	c->s = s;
+	c->stm = stm;
+	c->n_pages = stm32_flash_addr_to_page_ceil(stm, stm->dev->fl_end);
+	c->pages = calloc(c->n_pages, sizeof(*c->pages));
+	if (!c->pages) {
+		free(c);
+		return NULL;
+	}
+	for (i = 0; i < c->n_pages; i++) {
+		c->pages[i].addr = stm32_flash_page_to_addr(stm, i);
+		c->pages[i].size = stm32_flash_page_to_addr(stm, i + 1)
+				   - c->pages[i].addr;
+	}
+	return c;
+}
+
+void pagecache_free(pagecache_t *c)
+{
+	int i;
+
+	if (!c)
+		return;
+	for (i = 0; i < c->n_pages; i++) {
+		free(c->pages[i].data);
+		free(c->pages[i].orig);
+	}
+	free(c->pages);
+	free(c);
+}
+
+/* the page holding "addr", read from the target on first use */
+static struct pagecache_page *pagecache_get(pagecache_t *c, uint32_t addr)
+{
+	struct pagecache_page *p;
+	int page;
+
+	if (!stm32_addr_in_flash(c->stm, addr))
+		return NULL;
+	page = stm32_flash_addr_to_page_floor(c->stm, addr);
+	if (page >= c->n_pages)
+		return NULL;
+	p = &c->pages[page];
+	if (p->data)
+		return p;
+
+	p->data = malloc(p->size);
+	p->orig = malloc(p->size);
+	if (!p->data || !p->orig
+	    || session_read(c->s, p->addr, p->orig, p->size) != STM32_ERR_OK) {
+		free(p->data);
+		free(p->orig);
+		p->data = p->orig = NULL;
+		return NULL;
+	}
+	memcpy(p->data, p->orig, p->size);
+	return p;
+}
+
+stm32_err_t pagecache_read(pagecache_t *c, uint32_t addr, uint8_t *buf,
+			   uint32_t len)
+{
+	struct pagecache_page *p;
+	uint32_t off, n;
+
+	while (len) {
+		p = pagecache_get(c, addr);
+		if (!p)
+			return STM32_ERR_UNKNOWN;
+		off = addr - p->addr;
+		n = p->size - off < len ? p->size - off : len;
+		memcpy(buf, p->data + off, n);
+		addr += n;
+		buf += n;
+		len -= n;
+	}
+	return STM32_ERR_OK;
+}
+
+stm32_err_t pagecache_write(pagecache_t *c, uint32_t addr, const uint8_t *buf,
+			    uint32_t len)
+{
+	struct pagecache_page *p;
+	uint32_t off, n;
+
+	while (len) {
+		p = pagecache_get(c, addr);
+		if (!p)
+			return STM32_ERR_UNKNOWN;
+		off = addr - p->addr;
+		n = p->size - off < len ? p->size - off : len;
+		memcpy(p->data + off, buf, n);
+		addr += n;
+		buf += n;
+		len -= n;
+	}
+	return STM32_ERR_OK;
+}
+
+static int pagecache_dirty(const struct pagecache_page *p)
+{
+	return p->data && memcmp(p->data, p->orig, p->size);
+}
+
+/* erased pages read as 0xFF, only the other frames are written back */
+static stm32_err_t pagecache_write_page(pagecache_t *c,
+					struct pagecache_page *p, int verify)
+{
+	uint32_t off, n;
+
+	for (off = 0; off < p->size; off += n) {
+		n = p->size - off < 256 ? p->size - off : 256;
+		if (is_blank(p->data + off, n))
+			continue;
+		if (session_write(c->s, p->addr + off, p->data + off, n, verify)
+		    != STM32_ERR_OK)
+			return STM32_ERR_UNKNOWN;
+		c->written += n;
+	}
+	memcpy(p->orig, p->data, p->size);
+	return STM32_ERR_OK;
+}
+
+/* each run of consecutive changed pages costs one erase command */
+stm32_err_t pagecache_flush(pagecache_t *c, int verify)
+{
+	int first, last, i;
+
+	for (first = 0; first < c->n_pages; first = last) {
+		if (!pagecache_dirty(&c->pages[first])) {
+			last = first + 1;
+			continue;
+		}
+		for (last = first + 1; last < c->n_pages; last++)
+			if (!pagecache_dirty(&c->pages[last]))
+				break;
+
+		if (session_erase(c->s, c->pages[first].addr,
+				  c->pages[last - 1].addr
+				  + c->pages[last - 1].size
+				  - c->pages[first].addr) != STM32_ERR_OK)
+			return STM32_ERR_UNKNOWN;
+		c->erased += last - first;
+		for (i = first; i < last; i++)
+			if (pagecache_write_page(c, &c->pages[i], verify)
+			    != STM32_ERR_OK)
+				return STM32_ERR_UNKNOWN;
+	}
+	return STM32_ERR_OK;
+}
+
+void pagecache_stats(const pagecache_t *c, int *erased, uint32_t *written)
+{
+	*erased = c->erased;
+	*written = c->written;
+}
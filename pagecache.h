@@ -0,0 +1,44 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#ifndef _H_PAGECACHE
+#define _H_PAGECACHE
+
+#include <stdint.h>
+
+#include "session.h"
+
+/*
+ * Target flash seen as a buffer: pages are read on first touch, writes
+ * go to the cached copy, and a flush erases and rewrites only the pages
+ * whose content changed.
+ */
+
+typedef struct pagecache pagecache_t;
+
+pagecache_t *pagecache_new(session_t *s);
+void pagecache_free(pagecache_t *c);
+stm32_err_t pagecache_read(pagecache_t *c, uint32_t addr, uint8_t *buf,
+			   uint32_t len);
+stm32_err_t pagecache_write(pagecache_t *c, uint32_t addr, const uint8_t *buf,
+			    uint32_t len);
+stm32_err_t pagecache_flush(pagecache_t *c, int verify);
+void pagecache_stats(const pagecache_t *c, int *erased, uint32_t *written);
+
+#endif
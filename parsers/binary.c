@@ -97,12 +97,10 @@ parser_err_t binary_read(void *storage, void *data, unsigned int *len) {
 	ssize_t r;
 	while(left > 0) {
 		r = read(st->fd, data, left);
-		/* If there is no data to read at all, return OK, but with zero read */
-		if (r == 0 && left == *len) {
-			*len = 0;
-			return PARSER_ERR_OK;
-		}
-		if (r <= 0) return PARSER_ERR_SYSTEM;
+		/* At end of file, return OK with what has been read so far */
+		if (r == 0)
+			break;
+		if (r < 0) return PARSER_ERR_SYSTEM;
 		left -= r;
 		data += r;
 	}
@@ -135,6 +133,7 @@ parser_t PARSER_BINARY = {
 	binary_close,
 	binary_size,
 	binary_read,
-	binary_write
+	binary_write,
+	NULL
 };
 
@@ -33,8 +33,29 @@ typedef struct {
 	size_t		data_len, offset;
 	uint8_t		*data;
 	uint32_t	base;
+	unsigned int	*ranges;	/* start/end pairs of the data records */
+	unsigned int	n_ranges;
 } hex_t;
 
+/* records following each other make one range */
+static int hex_add_range(hex_t *st, unsigned int start, unsigned int end)
+{
+	unsigned int *tmp;
+
+	if (st->n_ranges && st->ranges[2 * st->n_ranges - 1] == start) {
+		st->ranges[2 * st->n_ranges - 1] = end;
+		return 0;
+	}
+	tmp = realloc(st->ranges, 2 * (st->n_ranges + 1) * sizeof(*tmp));
+	if (!tmp)
+		return 1;
+	st->ranges = tmp;
+	st->ranges[2 * st->n_ranges] = start;
+	st->ranges[2 * st->n_ranges + 1] = end;
+	st->n_ranges++;
+	return 0;
+}
+
 void* hex_init() {
 	return calloc(sizeof(hex_t), 1);
 }
@@ -95,6 +116,11 @@ parser_err_t hex_open(void *storage, const char *filename, const char write) {
 
 					last_address = address + reclen;
 					record = &st->data[st->data_len];
+					if (reclen && hex_add_range(st, st->data_len,
+								    st->data_len + reclen)) {
+						close(fd);
+						return PARSER_ERR_SYSTEM;
+					}
 					st->data_len += reclen;
 					break;
 
@@ -191,7 +217,10 @@ parser_err_t hex_open(void *storage, const char *filename, const char write) {
 
 parser_err_t hex_close(void *storage) {
 	hex_t *st = storage;
-	if (st) free(st->data);
+	if (st) {
+		free(st->data);
+		free(st->ranges);
+	}
 	free(st);
 	return PARSER_ERR_OK;
 }
@@ -217,6 +246,12 @@ parser_err_t hex_write(void *storage, void *data, unsigned int len) {
 	return PARSER_ERR_RDONLY;
 }
 
+unsigned int hex_ranges(void *storage, const unsigned int **ranges) {
+	hex_t *st = storage;
+	*ranges = st->ranges;
+	return st->n_ranges;
+}
+
 parser_t PARSER_HEX = {
 	"Intel HEX",
 	hex_init,
@@ -224,6 +259,7 @@ parser_t PARSER_HEX = {
 	hex_close,
 	hex_size,
 	hex_read,
-	hex_write
+	hex_write,
+	hex_ranges
 };
 
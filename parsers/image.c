@@ -0,0 +1,90 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "binary.h"
+#include "hex.h"
+#include "image.h"
+
+/* 1 if the parser can't even be set up, the error is reported */
+static int image_try(parser_t *parser, const char *filename, void **storage,
+		     parser_err_t *perr)
+{
+	*storage = parser->init();
+	if (!*storage) {
+		fprintf(stderr, "%s Parser failed to initialize\n", parser->name);
+		return 1;
+	}
+	*perr = parser->open(*storage, filename, 0);
+	if (*perr != PARSER_ERR_OK) {
+		parser->close(*storage);
+		*storage = NULL;
+	}
+	return 0;
+}
+
+parser_err_t image_open(const char *filename, int force_binary,
+			parser_t **parser, void **storage)
+{
+	parser_err_t perr = PARSER_ERR_INVALID_FILE;
+
+	if (!force_binary) {
+		*parser = &PARSER_HEX;
+		if (image_try(*parser, filename, storage, &perr))
+			return PARSER_ERR_SYSTEM;
+	}
+	if (perr == PARSER_ERR_INVALID_FILE) {
+		*parser = &PARSER_BINARY;
+		if (image_try(*parser, filename, storage, &perr))
+			return PARSER_ERR_SYSTEM;
+	}
+	if (perr != PARSER_ERR_OK) {
+		fprintf(stderr, "%s ERROR: %s\n", (*parser)->name,
+			parser_errstr(perr));
+		if (perr == PARSER_ERR_SYSTEM)
+			perror(filename);
+	}
+	return perr;
+}
+
+uint8_t *image_load(const char *filename, unsigned int *len)
+{
+	parser_t *parser;
+	void *storage;
+	uint8_t *data;
+	unsigned int size;
+
+	if (image_open(filename, 0, &parser, &storage) != PARSER_ERR_OK)
+		return NULL;
+
+	size = parser->size(storage);
+	data = malloc(size ? size : 1);
+	if (!data || parser->read(storage, data, &size) != PARSER_ERR_OK) {
+		fprintf(stderr, "Failed to read \"%s\"\n", filename);
+		free(data);
+		parser->close(storage);
+		return NULL;
+	}
+	parser->close(storage);
+	*len = size;
+	return data;
+}
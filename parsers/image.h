@@ -0,0 +1,36 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#ifndef _PARSER_IMAGE_H
+#define _PARSER_IMAGE_H
+
+#include <stdint.h>
+
+#include "parser.h"
+
+/*
+ * Open an image to read it, as the hex format first unless force_binary
+ * is set, then as raw binary. Errors are reported on stderr.
+ */
+parser_err_t image_open(const char *filename, int force_binary,
+			parser_t **parser, void **storage);
+
+/* the whole image in a buffer to free(), NULL on error */
+uint8_t *image_load(const char *filename, unsigned int *len);
+#endif
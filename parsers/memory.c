@@ -0,0 +1,90 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+
+typedef struct {
+	const unsigned char	*data;
+	unsigned int		size;
+	unsigned int		offset;
+} memory_t;
+
+void* memory_init() {
+	return calloc(sizeof(memory_t), 1);
+}
+
+void memory_set(void *storage, const void *data, unsigned int len) {
+	memory_t *st = storage;
+
+	st->data	= data;
+	st->size	= len;
+	st->offset	= 0;
+}
+
+parser_err_t memory_open(void *storage, const char *filename, const char write) {
+	memory_t *st = storage;
+
+	(void)filename;
+	if (write)
+		return PARSER_ERR_RDONLY;
+	st->offset = 0;
+	return st->data ? PARSER_ERR_OK : PARSER_ERR_INVALID_FILE;
+}
+
+parser_err_t memory_close(void *storage) {
+	free(storage);
+	return PARSER_ERR_OK;
+}
+
+unsigned int memory_size(void *storage) {
+	memory_t *st = storage;
+	return st->size;
+}
+
+parser_err_t memory_read(void *storage, void *data, unsigned int *len) {
+	memory_t *st = storage;
+	unsigned int left = st->size - st->offset;
+
+	if (*len > left)
+		*len = left;
+	memcpy(data, st->data + st->offset, *len);
+	st->offset += *len;
+	return PARSER_ERR_OK;
+}
+
+parser_err_t memory_write(void *storage, void *data, unsigned int len) {
+	(void)storage;
+	(void)data;
+	(void)len;
+	return PARSER_ERR_RDONLY;
+}
+
+parser_t PARSER_MEMORY = {
+	"Memory image",
+	memory_init,
+	memory_open,
+	memory_close,
+	memory_size,
+	memory_read,
+	memory_write,
+	NULL
+};
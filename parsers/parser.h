@@ -38,6 +38,7 @@ struct parser {
 	unsigned int (*size )(void *storage);						/* get the total data size */
 	parser_err_t (*read )(void *storage, void *data, unsigned int *len);		/* read a block of data */
 	parser_err_t (*write)(void *storage, void *data, unsigned int len);		/* write a block of data */
+	unsigned int (*ranges)(void *storage, const unsigned int **ranges);		/* start/end offsets of the data, the gaps are not part of the image (optional) */
 };
 typedef struct parser     parser_t;
 
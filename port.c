@@ -19,6 +19,7 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "serial.h"
 #include "port.h"
@@ -26,21 +27,34 @@
 
 extern struct port_interface port_serial;
 extern struct port_interface port_i2c;
+extern struct port_interface port_tcp;
 
 static struct port_interface *ports[] = {
+	&port_tcp,
 	&port_serial,
 	&port_i2c,
 	NULL,
 };
 
 
+/*
+ * Every opened port gets its own copy of the interface, so that several
+ * ports can be used at the same time. Release it with port_close().
+ */
 port_err_t port_open(struct port_options *ops, struct port_interface **outport)
 {
 	int ret;
-	static struct port_interface **port;
+	struct port_interface **port, *p;
+
+	p = malloc(sizeof(*p));
+	if (p == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return PORT_ERR_UNKNOWN;
+	}
 
 	for (port = ports; *port; port++) {
-		ret = (*port)->open(*port, ops);
+		*p = **port;
+		ret = p->open(p, ops);
 		if (ret == PORT_ERR_NODEV)
 			continue;
 		if (ret == PORT_ERR_OK)
@@ -51,9 +65,16 @@ port_err_t port_open(struct port_options *ops, struct port_interface **outport)
 	if (*port == NULL) {
 		fprintf(stderr, "Cannot handle device \"%s\"\n",
 			ops->device);
+		free(p);
 		return PORT_ERR_UNKNOWN;
 	}
 
-	*outport = *port;
+	*outport = p;
 	return PORT_ERR_OK;
 }
+
+void port_close(struct port_interface *port)
+{
+	port->close(port);
+	free(port);
+}
@@ -43,6 +43,7 @@ struct port_options {
 	int bus_addr;
 	int rx_frame_max;
 	int tx_frame_max;
+	int rx_timeout;		/* ms, 0 for the interface default */
 };
 
 /*
@@ -67,10 +68,15 @@ struct port_interface {
 	port_err_t (*write)(struct port_interface *port, void *buf, size_t nbyte);
 	port_err_t (*gpio)(struct port_interface *port, serial_gpio_t n, int level);
 	const char *(*get_cfg_str)(struct port_interface *port);
+	/* optional, for event loops: never block, *nbyte is what was done */
+	int (*get_fd)(struct port_interface *port);
+	port_err_t (*read_nb)(struct port_interface *port, void *buf, size_t *nbyte);
+	port_err_t (*write_nb)(struct port_interface *port, void *buf, size_t *nbyte);
 	struct varlen_cmd *cmd_get_reply;
 	void *private;
 };
 
 port_err_t port_open(struct port_options *ops, struct port_interface **outport);
+void port_close(struct port_interface *port);
 
 #endif
@@ -0,0 +1,289 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(__WIN32__)
+#include <errno.h>
+#include <glob.h>
+#include <poll.h>
+#endif
+
+#include "init.h"
+#include "scan.h"
+#include "session.h"
+
+extern FILE *diag;
+
+struct scan_target {
+	struct session_config cfg;
+	struct port_interface *port;
+	gpio_lines_t *lines;
+	stm32_async_t *async;
+	int busy;
+	pthread_t thread;
+	int started;
+	int found;
+	uint8_t bl_version;
+	uint16_t pid;
+	const char *name;
+};
+
+static int scan_add(char ***devices, int *count, const char *dev)
+{
+	char **tmp;
+
+	tmp = realloc(*devices, (*count + 1) * sizeof(char *));
+	if (tmp == NULL)
+		return 1;
+	*devices = tmp;
+	tmp[*count] = strdup(dev);
+	if (tmp[*count] == NULL)
+		return 1;
+	(*count)++;
+	return 0;
+}
+
+/*
+ * Expand the shell-like patterns (e.g. "/dev/ttyUSB*") in the list of
+ * devices; names without wildcards are taken as they are.
+ * Returns the number of devices, or -1 on error.
+ */
+int scan_expand(const char **patterns, int count, char ***devices)
+{
+	int i, n = 0;
+#if !defined(__WIN32__)
+	glob_t g;
+	size_t j;
+#endif
+
+	*devices = NULL;
+	for (i = 0; i < count; i++) {
+#if !defined(__WIN32__)
+		if (strpbrk(patterns[i], "*?[")) {
+			if (glob(patterns[i], 0, NULL, &g) == 0)
+				for (j = 0; j < g.gl_pathc; j++)
+					if (scan_add(devices, &n, g.gl_pathv[j])) {
+						globfree(&g);
+						goto err;
+					}
+			globfree(&g);
+			continue;
+		}
+#endif
+		if (scan_add(devices, &n, patterns[i]))
+			goto err;
+	}
+	return n;
+
+err:
+	fprintf(stderr, "Out of memory\n");
+	scan_free(*devices, n);
+	*devices = NULL;
+	return -1;
+}
+
+void scan_free(char **devices, int count)
+{
+	while (count)
+		free(devices[--count]);
+	free(devices);
+}
+
+/* a port without bootloader is not an error */
+static void scan_error(void *ctx, const char *msg)
+{
+	(void)ctx;
+	(void)msg;
+}
+
+static void scan_found(struct scan_target *t, const stm32_t *stm)
+{
+	t->found = 1;
+	t->bl_version = stm->bl_version;
+	t->pid = stm->pid;
+	t->name = stm->dev->name;
+}
+
+/* blocking probe, in its own thread, for the ports without event loop */
+static void *scan_probe(void *arg)
+{
+	struct scan_target *t = arg;
+	session_t *s;
+
+	s = session_open(&t->cfg);
+	if (!s)
+		return NULL;
+	scan_found(t, session_target(s));
+	session_close(s);
+	return NULL;
+}
+
+/* open the port and start the non-blocking init, 1 if not possible */
+static int scan_start(struct scan_target *t)
+{
+	if (port_open(&t->cfg.port, &t->port) != PORT_ERR_OK) {
+		t->port = NULL;
+		return 0;
+	}
+	t->async = stm32_async_new(t->port, SCAN_TIMEOUT_MS);
+	if (!t->async) {
+		port_close(t->port);
+		t->port = NULL;
+		return 1;
+	}
+	if (t->cfg.init
+	    && (gpio_lines_request(t->cfg.gpio_seq, &t->lines)
+		|| init_bl_entry(t->port, t->cfg.gpio_seq, t->lines)))
+		return 0;
+	t->port->flush(t->port);
+	if (stm32_async_init(t->async, t->cfg.init) != STM32_ERR_OK)
+		return 0;
+	t->busy = 1;
+	return 0;
+}
+
+#if !defined(__WIN32__)
+/* one thread drives all the ports, until every init is over */
+static void scan_loop(struct scan_target *targets, int n)
+{
+	struct pollfd *pfd;
+	int i, k, ev, timeout, t;
+
+	pfd = calloc(n, sizeof(*pfd));
+	if (!pfd)
+		return;
+
+	for (;;) {
+		timeout = -1;
+		for (i = 0, k = 0; i < n; i++) {
+			if (!targets[i].busy)
+				continue;
+			ev = stm32_async_events(targets[i].async);
+			pfd[k].fd = stm32_async_fd(targets[i].async);
+			pfd[k].events = (ev & STM32_ASYNC_READ ? POLLIN : 0)
+					| (ev & STM32_ASYNC_WRITE ? POLLOUT : 0);
+			k++;
+			t = stm32_async_timeout(targets[i].async);
+			if (timeout < 0 || t < timeout)
+				timeout = t;
+		}
+		if (!k)
+			break;
+		if (poll(pfd, k, timeout) < 0 && errno != EINTR)
+			break;
+
+		/* a step that has nothing to do returns at once */
+		for (i = 0; i < n; i++) {
+			if (!targets[i].busy)
+				continue;
+			if (stm32_async_step(targets[i].async) == STM32_ASYNC_BUSY)
+				continue;
+			targets[i].busy = 0;
+			if (stm32_async_target(targets[i].async))
+				scan_found(&targets[i],
+					   stm32_async_target(targets[i].async));
+		}
+	}
+	free(pfd);
+}
+#else
+static void scan_loop(struct scan_target *targets, int n)
+{
+}
+#endif
+
+/*
+ * Probe all the devices at the same time and report the bootloaders
+ * that answer: the serial and TCP ports are driven from a single event
+ * loop, the others get a thread each. Returns 0 if at least one is found.
+ */
+int scan_ports(const struct port_options *ops, const char **patterns,
+	       int count, char init, const init_seq_t *gpio_seq)
+{
+	struct scan_target *targets;
+	char **devices;
+	int i, n, found = 0;
+
+	n = scan_expand(patterns, count, &devices);
+	if (n < 0)
+		return 1;
+	if (n == 0) {
+		fprintf(stderr, "No device matches\n");
+		return 1;
+	}
+
+	targets = calloc(n, sizeof(*targets));
+	if (targets == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		scan_free(devices, n);
+		return 1;
+	}
+
+	fprintf(diag, "Scanning %d port%s\n", n, n > 1 ? "s" : "");
+	fflush(diag);
+	for (i = 0; i < n; i++) {
+		targets[i].cfg.port = *ops;
+		targets[i].cfg.port.device = devices[i];
+		targets[i].cfg.port.rx_timeout = SCAN_TIMEOUT_MS;
+		targets[i].cfg.init = init;
+		targets[i].cfg.gpio_seq = gpio_seq;
+		targets[i].cfg.error = scan_error;
+		if (!scan_start(&targets[i]))
+			continue;
+		if (pthread_create(&targets[i].thread, NULL, scan_probe,
+				   &targets[i]) == 0)
+			targets[i].started = 1;
+		else
+			scan_probe(&targets[i]);
+	}
+
+	scan_loop(targets, n);
+
+	for (i = 0; i < n; i++) {
+		if (targets[i].started)
+			pthread_join(targets[i].thread, NULL);
+		stm32_async_free(targets[i].async);
+		if (targets[i].port)
+			port_close(targets[i].port);
+		gpio_lines_release(targets[i].lines);
+	}
+
+	fprintf(diag, "\n%-24s %-8s %-10s %s\n", "Port", "BL", "Device ID",
+		"Name");
+	for (i = 0; i < n; i++) {
+		if (!targets[i].found) {
+			fprintf(diag, "%-24s %-8s %-10s %s\n",
+				devices[i], "-", "-", "no answer");
+			continue;
+		}
+		found++;
+		fprintf(diag, "%-24s 0x%02x     0x%04x     %s\n",
+			devices[i], targets[i].bl_version,
+			targets[i].pid, targets[i].name);
+	}
+	fprintf(diag, "\n%d bootloader%s found\n", found, found != 1 ? "s" : "");
+
+	free(targets);
+	scan_free(devices, n);
+	return found ? 0 : 1;
+}
@@ -0,0 +1,35 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#ifndef _H_SCAN
+#define _H_SCAN
+
+#include "init.h"
+#include "serial.h"
+#include "port.h"
+
+/* read timeout while probing, a bootloader answers in a few ms */
+#define SCAN_TIMEOUT_MS	100
+
+int scan_expand(const char **patterns, int count, char ***devices);
+void scan_free(char **devices, int count);
+int scan_ports(const struct port_options *ops, const char **patterns,
+	       int count, char init, const init_seq_t *gpio_seq);
+
+#endif
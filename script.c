@@ -0,0 +1,275 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+ * Job scripts: the operations of a job, one per line, run in order in a
+ * single bootloader session.
+ *	erase ADDRESS LENGTH | erase all
+ *	write ADDRESS FILE [verify]	(erases the pages written)
+ *	read ADDRESS LENGTH FILE
+ *	crc ADDRESS LENGTH [EXPECTED]
+ *	go [ADDRESS] | reset		(last line only)
+ * Empty lines and lines starting with '#' are ignored. The whole script
+ * and its images are loaded before the device is opened, so a typo does
+ * not stop it halfway.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "parsers/image.h"
+#include "script.h"
+#include "utils.h"
+
+#define SCRIPT_MAX_ARGS	5
+
+enum script_op {
+	SCRIPT_ERASE,
+	SCRIPT_ERASE_ALL,
+	SCRIPT_WRITE,
+	SCRIPT_READ,
+	SCRIPT_CRC,
+};
+
+struct script_step {
+	enum script_op op;
+	int line;
+	uint32_t addr, len;
+	uint32_t crc;
+	int check;		/* compare the CRC with "crc" */
+	int verify;
+	uint8_t *data;		/* write */
+	char *file;		/* read */
+};
+
+struct script {
+	struct script_step *steps;
+	int n_steps;
+};
+
+static int script_parse(script_t *sc, char *line, int n, struct script_end *end)
+{
+	struct script_step *st;
+	char *argv[SCRIPT_MAX_ARGS + 1];
+	int argc = 0;
+
+	while ((argv[argc] = strtok(argc ? NULL : line, " \t\r\n"))) {
+		if (argv[argc][0] == '#')
+			break;
+		if (++argc > SCRIPT_MAX_ARGS)
+			return 1;
+	}
+	argv[argc] = NULL;
+	if (!argc)
+		return 0;
+	if (end->go || end->reset) {
+		fprintf(stderr, "Line %d: nothing can follow go or reset\n", n);
+		return 1;
+	}
+
+	if (!strcmp(argv[0], "go") && argc <= 2) {
+		end->go = 1;
+		end->go_addr = 0;
+		return argc == 2 && parse_u32(argv[1], &end->go_addr);
+	}
+	if (!strcmp(argv[0], "reset") && argc == 1) {
+		end->reset = 1;
+		return 0;
+	}
+
+	st = realloc(sc->steps, (sc->n_steps + 1) * sizeof(*st));
+	if (!st) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	sc->steps = st;
+	st = &sc->steps[sc->n_steps];
+	memset(st, 0, sizeof(*st));
+	st->line = n;
+
+	if (!strcmp(argv[0], "erase") && argc == 2 && !strcmp(argv[1], "all")) {
+		st->op = SCRIPT_ERASE_ALL;
+	} else if (!strcmp(argv[0], "erase") && argc == 3
+		   && !parse_u32(argv[1], &st->addr)
+		   && !parse_u32(argv[2], &st->len)) {
+		st->op = SCRIPT_ERASE;
+	} else if (!strcmp(argv[0], "write") && (argc == 3 || argc == 4)
+		   && !parse_u32(argv[1], &st->addr)
+		   && (argc == 3 || !strcmp(argv[3], "verify"))) {
+		st->op = SCRIPT_WRITE;
+		st->verify = argc == 4;
+		st->data = image_load(argv[2], &st->len);
+		if (!st->data) {
+			fprintf(stderr, "Line %d: can't load \"%s\"\n", n, argv[2]);
+			return 1;
+		}
+	} else if (!strcmp(argv[0], "read") && argc == 4
+		   && !parse_u32(argv[1], &st->addr)
+		   && !parse_u32(argv[2], &st->len)) {
+		st->op = SCRIPT_READ;
+		st->file = strdup(argv[3]);
+		if (!st->file) {
+			fprintf(stderr, "Out of memory\n");
+			return 1;
+		}
+	} else if (!strcmp(argv[0], "crc") && (argc == 3 || argc == 4)
+		   && !parse_u32(argv[1], &st->addr)
+		   && !parse_u32(argv[2], &st->len)
+		   && (argc == 3 || !parse_u32(argv[3], &st->crc))) {
+		st->op = SCRIPT_CRC;
+		st->check = argc == 4;
+	} else
+		return 1;
+	sc->n_steps++;
+	return 0;
+}
+
+script_t *script_load(const char *path, struct script_end *end)
+{
+	char line[1024];
+	script_t *sc;
+	FILE *f;
+	int n = 0;
+
+	memset(end, 0, sizeof(*end));
+	sc = calloc(1, sizeof(*sc));
+	if (!sc) {
+		fprintf(stderr, "Out of memory\n");
+		return NULL;
+	}
+	f = strcmp(path, "-") ? fopen(path, "r") : stdin;
+	if (!f) {
+		perror(path);
+		free(sc);
+		return NULL;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		n++;
+		if (script_parse(sc, line, n, end)) {
+			fprintf(stderr, "%s:%d: invalid job\n", path, n);
+			if (f != stdin)
+				fclose(f);
+			script_free(sc);
+			return NULL;
+		}
+	}
+	if (f != stdin)
+		fclose(f);
+	return sc;
+}
+
+static int script_step(const struct script_step *st, session_t *s)
+{
+	const stm32_t *stm = session_target(s);
+	uint32_t crc;
+	FILE *f;
+	uint8_t *buf;
+
+	switch (st->op) {
+	case SCRIPT_ERASE_ALL:
+		fprintf(diag, "Erasing flash\n");
+		return session_erase(s, stm->dev->fl_start,
+				     stm->dev->fl_end - stm->dev->fl_start)
+		       != STM32_ERR_OK;
+	case SCRIPT_ERASE:
+		fprintf(diag, "Erasing 0x%08x-0x%08x\n", st->addr,
+			st->addr + st->len);
+		return session_erase(s, st->addr, st->len) != STM32_ERR_OK;
+	case SCRIPT_WRITE:
+		fprintf(diag, "Writing %u bytes at 0x%08x\n", st->len, st->addr);
+		fflush(diag);
+		if (stm32_addr_in_flash(stm, st->addr)
+		    && session_erase(s, st->addr, st->len) != STM32_ERR_OK)
+			return 1;
+		if (session_write(s, st->addr, st->data, st->len, st->verify)
+		    != STM32_ERR_OK)
+			return 1;
+		fprintf(diag, "\n");
+		return 0;
+	case SCRIPT_READ:
+		fprintf(diag, "Reading 0x%08x-0x%08x to %s\n", st->addr,
+			st->addr + st->len, st->file);
+		fflush(diag);
+		buf = malloc(st->len ? st->len : 1);
+		if (!buf) {
+			fprintf(stderr, "Out of memory\n");
+			return 1;
+		}
+		if (session_read(s, st->addr, buf, st->len) != STM32_ERR_OK) {
+			free(buf);
+			return 1;
+		}
+		fprintf(diag, "\n");
+		f = fopen(st->file, "wb");
+		if (!f || fwrite(buf, 1, st->len, f) != st->len) {
+			perror(st->file);
+			if (f)
+				fclose(f);
+			free(buf);
+			return 1;
+		}
+		free(buf);
+		if (fclose(f)) {
+			perror(st->file);
+			return 1;
+		}
+		return 0;
+	case SCRIPT_CRC:
+		if (session_crc(s, st->addr, st->len, &crc) != STM32_ERR_OK)
+			return 1;
+		fprintf(diag, "CRC(0x%08x-0x%08x) = 0x%08x\n", st->addr,
+			st->addr + st->len, crc);
+		if (st->check && crc != st->crc) {
+			fprintf(stderr, "CRC mismatch, expected 0x%08x\n",
+				st->crc);
+			return 1;
+		}
+		return 0;
+	}
+	return 1;
+}
+
+/* stops at the first failing step */
+int script_run(script_t *sc, session_t *s)
+{
+	int i;
+
+	for (i = 0; i < sc->n_steps; i++)
+		if (script_step(&sc->steps[i], s)) {
+			fprintf(stderr, "Job failed at line %d\n",
+				sc->steps[i].line);
+			return 1;
+		}
+	return 0;
+}
+
+void script_free(script_t *sc)
+{
+	int i;
+
+	if (!sc)
+		return;
+	for (i = 0; i < sc->n_steps; i++) {
+		free(sc->steps[i].data);
+		free(sc->steps[i].file);
+	}
+	free(sc->steps);
+	free(sc);
+}
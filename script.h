@@ -0,0 +1,40 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#ifndef _H_SCRIPT
+#define _H_SCRIPT
+
+#include <stdint.h>
+
+#include "session.h"
+
+typedef struct script script_t;
+
+/* the final "go" or "reset" line, run by the caller after the session */
+struct script_end {
+	int go;
+	uint32_t go_addr;	/* 0 for the start of flash */
+	int reset;
+};
+
+script_t *script_load(const char *path, struct script_end *end);
+int script_run(script_t *sc, session_t *s);
+void script_free(script_t *sc);
+
+#endif
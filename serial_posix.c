@@ -27,6 +27,8 @@
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <stdio.h>
+#include <errno.h>
+#include <poll.h>
 #include <sys/file.h>
 
 #include "serial.h"
@@ -40,6 +42,7 @@
 
 struct serial {
 	int fd;
+	int timeout;	/* ms */
 	struct termios oldtio;
 	struct termios newtio;
 	char setup_str[11];
@@ -250,6 +253,7 @@ static port_err_t serial_posix_open(struct port_interface *port,
 		return PORT_ERR_UNKNOWN;
 	}
 
+	h->timeout = ops->rx_timeout ? ops->rx_timeout : TERMIOS_TIMEOUT_MS;
 	port->private = h;
 	return PORT_ERR_OK;
 }
@@ -273,12 +277,24 @@ static port_err_t serial_posix_read(struct port_interface *port, void *buf,
 	serial_t *h;
 	ssize_t r;
 	uint8_t *pos = (uint8_t *)buf;
+	struct pollfd pfd;
 
 	h = (serial_t *)port->private;
 	if (h == NULL)
 		return PORT_ERR_UNKNOWN;
 
+	pfd.fd = h->fd;
+	pfd.events = POLLIN;
 	while (nbyte) {
+		/* VTIME has 100 ms resolution, poll() gives the ms timeout */
+		r = poll(&pfd, 1, h->timeout);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r == 0)
+			return PORT_ERR_TIMEDOUT;
+		if (r < 0)
+			return PORT_ERR_UNKNOWN;
+
 		r = read(h->fd, pos, nbyte);
 		if (r == 0)
 			return PORT_ERR_TIMEDOUT;
@@ -373,6 +389,83 @@ static port_err_t serial_posix_flush(struct port_interface *port)
 	return PORT_ERR_OK;
 }
 
+static int serial_posix_get_fd(struct port_interface *port)
+{
+	serial_t *h;
+
+	h = (serial_t *)port->private;
+	return h ? h->fd : -1;
+}
+
+/* poll() with no timeout first, the descriptor stays in blocking mode */
+static int serial_posix_ready(serial_t *h, short events)
+{
+	struct pollfd pfd;
+	int r;
+
+	pfd.fd = h->fd;
+	pfd.events = events;
+	do {
+		r = poll(&pfd, 1, 0);
+	} while (r < 0 && errno == EINTR);
+	if (r < 0)
+		return -1;
+	return r > 0 && (pfd.revents & (events | POLLERR | POLLHUP));
+}
+
+static port_err_t serial_posix_read_nb(struct port_interface *port, void *buf,
+				       size_t *nbyte)
+{
+	serial_t *h;
+	ssize_t r;
+
+	h = (serial_t *)port->private;
+	if (h == NULL)
+		return PORT_ERR_UNKNOWN;
+
+	r = serial_posix_ready(h, POLLIN);
+	if (r <= 0) {
+		*nbyte = 0;
+		return r ? PORT_ERR_UNKNOWN : PORT_ERR_OK;
+	}
+	r = read(h->fd, buf, *nbyte);
+	if (r < 1)
+		return PORT_ERR_UNKNOWN;
+	*nbyte = r;
+	return PORT_ERR_OK;
+}
+
+/* write what the tty takes now, the descriptor is non-blocking meanwhile */
+static port_err_t serial_posix_write_nb(struct port_interface *port, void *buf,
+					size_t *nbyte)
+{
+	serial_t *h;
+	ssize_t r;
+	int flags, err;
+
+	h = (serial_t *)port->private;
+	if (h == NULL)
+		return PORT_ERR_UNKNOWN;
+
+	flags = fcntl(h->fd, F_GETFL);
+	if (flags < 0 || fcntl(h->fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		return PORT_ERR_UNKNOWN;
+	do {
+		r = write(h->fd, buf, *nbyte);
+	} while (r < 0 && errno == EINTR);
+	err = errno;
+	/* the other port calls expect a blocking fd */
+	if (fcntl(h->fd, F_SETFL, flags) < 0)
+		return PORT_ERR_UNKNOWN;
+
+	if (r < 0 && (err == EAGAIN || err == EWOULDBLOCK))
+		r = 0;
+	if (r < 0)
+		return PORT_ERR_UNKNOWN;
+	*nbyte = r;
+	return PORT_ERR_OK;
+}
+
 struct port_interface port_serial = {
 	.name	= "serial_posix",
 	.flags	= PORT_BYTE | PORT_GVR_ETX | PORT_CMD_INIT | PORT_RETRY,
@@ -383,4 +476,7 @@ struct port_interface port_serial = {
 	.write	= serial_posix_write,
 	.gpio	= serial_posix_gpio,
 	.get_cfg_str	= serial_posix_get_cfg_str,
+	.get_fd	= serial_posix_get_fd,
+	.read_nb	= serial_posix_read_nb,
+	.write_nb	= serial_posix_write_nb,
 };
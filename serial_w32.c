@@ -37,13 +37,13 @@ struct serial {
 	char setup_str[11];
 };
 
-static serial_t *serial_open(const char *device)
+static serial_t *serial_open(const char *device, int timeout)
 {
 	serial_t *h = calloc(sizeof(serial_t), 1);
 	char *devName;
 
 	/* timeout in ms */
-	COMMTIMEOUTS timeouts = {MAXDWORD, MAXDWORD, 500, 0, 0};
+	COMMTIMEOUTS timeouts = {MAXDWORD, MAXDWORD, timeout ? timeout : 500, 0, 0};
 
 	/* Fix the device name if required */
 	if (strlen(device) > 4 && device[0] != '\\') {
@@ -211,7 +211,7 @@ static port_err_t serial_w32_open(struct port_interface *port,
 		return PORT_ERR_UNKNOWN;
 
 	/* 3. open it */
-	h = serial_open(ops->device);
+	h = serial_open(ops->device, ops->rx_timeout);
 	if (h == NULL)
 		return PORT_ERR_UNKNOWN;
 
@@ -0,0 +1,624 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "init.h"
+#include "session.h"
+#include "utils.h"
+
+/* wait for the bootloader after a reset, if ready_timeout is not set */
+#define SESSION_RECONNECT_TIMEOUT	5000	/* ms */
+
+struct session {
+	struct session_config cfg;
+	struct port_interface *port;
+	gpio_lines_t *lines;		/* held until the port is closed */
+	stm32_t *stm;
+};
+
+static void session_err(const session_t *s, const char *fmt, ...)
+	__attribute__ ((format (printf, 2, 3)));
+
+static void session_err(const session_t *s, const char *fmt, ...)
+{
+	char msg[128];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+	va_end(ap);
+	if (s->cfg.error)
+		s->cfg.error(s->cfg.ctx, msg);
+	else
+		fprintf(stderr, "%s\n", msg);
+}
+
+static void session_progress(const session_t *s, const char *op,
+			     uint32_t addr, uint32_t done, uint32_t total)
+{
+	if (s->cfg.progress)
+		s->cfg.progress(s->cfg.ctx, op, addr, done, total);
+}
+
+/* max data in one frame, write frames also carry length and checksum */
+static unsigned int session_max_read(const session_t *s)
+{
+	unsigned int max = s->cfg.port.rx_frame_max;
+
+	return max > STM32_MAX_RX_FRAME ? STM32_MAX_RX_FRAME : max;
+}
+
+static unsigned int session_max_write(const session_t *s)
+{
+	return (s->cfg.port.tx_frame_max - 2) & ~3;
+}
+
+/*
+ * Capability cache: one line per port with the device, the bus address
+ * and the replies to GVR, GET and GID in hex.
+ */
+#define CAPS_LINE	1200
+
+static void session_caps_hex(char *dst, const uint8_t *buf, unsigned int n)
+{
+	while (n--)
+		dst += sprintf(dst, "%02x", *buf++);
+}
+
+static int session_caps_unhex(const char *src, uint8_t *buf, unsigned int n)
+{
+	unsigned int b;
+
+	if (strlen(src) != 2 * n)
+		return 1;
+	while (n--) {
+		if (sscanf(src, "%2x", &b) != 1)
+			return 1;
+		*buf++ = b;
+		src += 2;
+	}
+	return 0;
+}
+
+/* replies stored for the port, 1 if none */
+static int session_caps_parse(const char *line, const char *device,
+			      int bus_addr, struct stm32_caps *caps)
+{
+	char dev[256], gvr[8], get[520], gid[520];
+	int addr;
+
+	if (sscanf(line, "%255s %x %7s %519s %519s", dev, &addr, gvr, get,
+		   gid) != 5)
+		return 1;
+	if (strcmp(dev, device) || addr != bus_addr)
+		return 1;
+	if (session_caps_unhex(gvr, caps->gvr, 3)
+	    || strlen(get) < 2 || sscanf(get, "%2hhx", &caps->get[0]) != 1
+	    || session_caps_unhex(get, caps->get, caps->get[0] + 2)
+	    || strlen(gid) < 2 || sscanf(gid, "%2hhx", &caps->gid[0]) != 1
+	    || session_caps_unhex(gid, caps->gid, caps->gid[0] + 2)) {
+		memset(caps, 0, sizeof(*caps));
+		return 1;
+	}
+	return 0;
+}
+
+static void session_caps_load(const session_t *s, struct stm32_caps *caps)
+{
+	char line[CAPS_LINE];
+	FILE *f;
+
+	memset(caps, 0, sizeof(*caps));
+	f = fopen(s->cfg.caps_file, "r");
+	if (!f)
+		return;
+	while (fgets(line, sizeof(line), f))
+		if (!session_caps_parse(line, s->cfg.port.device,
+					s->cfg.port.bus_addr, caps))
+			break;
+	fclose(f);
+}
+
+/* rewrite the file with the line of this port replaced */
+static void session_caps_save(const session_t *s,
+			      const struct stm32_caps *caps)
+{
+	char line[CAPS_LINE], tmp[CAPS_LINE], *p;
+	struct stm32_caps other;
+	FILE *in, *out;
+#if !defined(__WIN32__)
+	int fd;
+#endif
+
+	if (strchr(s->cfg.port.device, ' ')
+	    || strlen(s->cfg.port.device) > 255)
+		return;
+#if defined(__WIN32__)
+	snprintf(tmp, sizeof(tmp), "%s.tmp", s->cfg.caps_file);
+	out = fopen(tmp, "w");
+#else
+	/* gang children and station jobs save at the same time */
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", s->cfg.caps_file);
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		return;
+	out = fdopen(fd, "w");
+	if (!out) {
+		close(fd);
+		remove(tmp);
+	}
+#endif
+	if (!out)
+		return;
+
+	in = fopen(s->cfg.caps_file, "r");
+	if (in) {
+		while (fgets(line, sizeof(line), in))
+			if (session_caps_parse(line, s->cfg.port.device,
+					       s->cfg.port.bus_addr, &other))
+				fputs(line, out);
+		fclose(in);
+	}
+
+	p = line + sprintf(line, "%s %x ", s->cfg.port.device,
+			   s->cfg.port.bus_addr);
+	session_caps_hex(p, caps->gvr, 3);
+	p += strlen(p);
+	*p++ = ' ';
+	session_caps_hex(p, caps->get, caps->get[0] + 2);
+	p += strlen(p);
+	*p++ = ' ';
+	session_caps_hex(p, caps->gid, caps->gid[0] + 2);
+	fprintf(out, "%s\n", line);
+
+	if (fclose(out)) {
+		remove(tmp);
+		return;
+	}
+#if defined(__WIN32__)
+	remove(s->cfg.caps_file);
+#endif
+	if (rename(tmp, s->cfg.caps_file))
+		remove(tmp);
+}
+
+session_t *session_open(const struct session_config *cfg)
+{
+	struct stm32_caps caps;
+	int cached;
+	session_t *s;
+	char init;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+	s->cfg = *cfg;
+	if (!diag)
+		diag = stderr;
+
+	if (port_open(&s->cfg.port, &s->port) != PORT_ERR_OK) {
+		session_err(s, "Failed to open port: %s", s->cfg.port.device);
+		s->port = NULL;
+		goto err;
+	}
+	if (gpio_lines_request(s->cfg.gpio_seq, &s->lines)) {
+		session_err(s, "Failed to request the GPIO lines");
+		goto err;
+	}
+	if (s->cfg.init && init_bl_entry(s->port, s->cfg.gpio_seq, s->lines)) {
+		session_err(s, "Failed to send boot enter sequence");
+		goto err;
+	}
+	s->port->flush(s->port);
+	init = s->cfg.init;
+	if (init && s->cfg.ready_timeout && (s->port->flags & PORT_CMD_INIT)) {
+		if (stm32_wait_ready(s->port, s->cfg.ready_timeout)
+		    != STM32_ERR_OK) {
+			session_err(s, "No answer from the bootloader after %d ms",
+				    s->cfg.ready_timeout);
+			goto err;
+		}
+		/* the INIT sequence, with its recovery, is done */
+		init = 0;
+	}
+
+	if (!s->cfg.caps_file) {
+		s->stm = stm32_init(s->port, init);
+		if (!s->stm) {
+			session_err(s, "Failed to init device");
+			goto err;
+		}
+		return s;
+	}
+
+	session_caps_load(s, &caps);
+	s->stm = stm32_init_caps(s->port, init, &caps, &cached);
+	if (!s->stm) {
+		session_err(s, "Failed to init device");
+		goto err;
+	}
+	if (!cached)
+		session_caps_save(s, &caps);
+	return s;
+
+err:
+	session_close(s);
+	return NULL;
+}
+
+void session_close(session_t *s)
+{
+	if (!s)
+		return;
+	if (s->stm)
+		stm32_close(s->stm);
+	if (s->port)
+		port_close(s->port);
+	gpio_lines_release(s->lines);
+	free(s);
+}
+
+stm32_t *session_target(const session_t *s)
+{
+	return s->stm;
+}
+
+struct port_interface *session_port(const session_t *s)
+{
+	return s->port;
+}
+
+stm32_err_t session_read(session_t *s, uint32_t addr, uint8_t *buf,
+			 uint32_t len)
+{
+	unsigned int max = session_max_read(s);
+	uint32_t done, n;
+
+	for (done = 0; done < len; done += n) {
+		n = len - done < max ? len - done : max;
+		if (stm32_read_memory(s->stm, addr + done, buf + done, n)
+		    != STM32_ERR_OK) {
+			session_err(s, "Failed to read memory at address 0x%08x, target write-protected?",
+				    addr + done);
+			return STM32_ERR_UNKNOWN;
+		}
+		session_progress(s, "read", addr + done + n, done + n, len);
+	}
+	return STM32_ERR_OK;
+}
+
+static stm32_err_t session_compare(session_t *s, uint32_t addr,
+				   const uint8_t *buf, uint32_t len,
+				   int *mismatch, uint8_t *found)
+{
+	unsigned int max = session_max_read(s);
+	uint8_t compare[STM32_MAX_RX_FRAME];
+	uint32_t done, n, i;
+
+	*mismatch = -1;
+	for (done = 0; done < len; done += n) {
+		n = len - done < max ? len - done : max;
+		if (stm32_read_memory(s->stm, addr + done, compare, n)
+		    != STM32_ERR_OK) {
+			session_err(s, "Failed to read memory at address 0x%08x",
+				    addr + done);
+			return STM32_ERR_UNKNOWN;
+		}
+		for (i = 0; i < n; i++)
+			if (compare[i] != buf[done + i]) {
+				*mismatch = done + i;
+				*found = compare[i];
+				return STM32_ERR_OK;
+			}
+	}
+	return STM32_ERR_OK;
+}
+
+stm32_err_t session_verify(session_t *s, uint32_t addr, const uint8_t *buf,
+			   uint32_t len)
+{
+	unsigned int max = session_max_read(s);
+	uint32_t done, n;
+	int mismatch;
+	uint8_t found;
+
+	for (done = 0; done < len; done += n) {
+		n = len - done < max ? len - done : max;
+		if (session_compare(s, addr + done, buf + done, n, &mismatch,
+				    &found))
+			return STM32_ERR_UNKNOWN;
+		if (mismatch >= 0) {
+			session_err(s, "Failed to verify at address 0x%08x, expected 0x%02x and found 0x%02x",
+				    addr + done + mismatch,
+				    buf[done + mismatch], found);
+			return STM32_ERR_UNKNOWN;
+		}
+		session_progress(s, "verify", addr + done + n, done + n, len);
+	}
+	return STM32_ERR_OK;
+}
+
+/* each block is read back right after its write, and rewritten on error */
+stm32_err_t session_write(session_t *s, uint32_t addr, const uint8_t *buf,
+			  uint32_t len, int verify)
+{
+	unsigned int max = session_max_write(s);
+	uint32_t done, n;
+	int failed, mismatch, blank;
+	uint8_t found = 0;
+
+	for (done = 0; done < len; done += n) {
+		n = len - done < max ? len - done : max;
+		failed = 0;
+		/* still verified, it catches a failed erase */
+		blank = s->cfg.skip_blank
+			&& stm32_addr_in_flash(s->stm, addr + done)
+			&& is_blank(buf + done, n);
+		do {
+			if (!blank
+			    && stm32_write_memory(s->stm, addr + done, buf + done, n)
+			    != STM32_ERR_OK) {
+				session_err(s, "Failed to write memory at address 0x%08x",
+					    addr + done);
+				return STM32_ERR_UNKNOWN;
+			}
+			mismatch = -1;
+			if (verify && session_compare(s, addr + done, buf + done,
+						      n, &mismatch, &found))
+				return STM32_ERR_UNKNOWN;
+		} while (mismatch >= 0 && !blank && failed++ < s->cfg.retry);
+
+		if (mismatch >= 0) {
+			session_err(s, "Failed to verify at address 0x%08x, expected 0x%02x and found 0x%02x",
+				    addr + done + mismatch, buf[done + mismatch],
+				    found);
+			return STM32_ERR_UNKNOWN;
+		}
+		session_progress(s, "write", addr + done + n, done + n, len);
+	}
+	return STM32_ERR_OK;
+}
+
+/* erases the pages touched by the range, the whole flash by mass erase */
+stm32_err_t session_erase(session_t *s, uint32_t addr, uint32_t len)
+{
+	const stm32_t *stm = s->stm;
+	int first, pages;
+
+	if (!len)
+		return STM32_ERR_OK;
+	if (!stm32_addr_in_flash(stm, addr) || addr + len > stm->dev->fl_end) {
+		session_err(s, "Erase range 0x%08x-0x%08x outside flash",
+			    addr, addr + len);
+		return STM32_ERR_UNKNOWN;
+	}
+
+	first = stm32_flash_addr_to_page_floor(stm, addr);
+	if (!first && addr + len == stm->dev->fl_end)
+		pages = STM32_MASS_ERASE;
+	else
+		pages = stm32_flash_addr_to_page_ceil(stm, addr + len) - first;
+
+	session_progress(s, "erase", addr, 0, len);
+	if (stm32_erase_memory(stm, first, pages) != STM32_ERR_OK) {
+		session_err(s, "Failed to erase memory");
+		return STM32_ERR_UNKNOWN;
+	}
+	session_progress(s, "erase", addr + len, len, len);
+	return STM32_ERR_OK;
+}
+
+/*
+ * Erase and write the flash pages flagged in "dirty", the first flag is
+ * the page holding "addr", one erase command per run of pages.
+ */
+stm32_err_t session_write_pages(session_t *s, uint32_t addr,
+				const uint8_t *buf, uint32_t len, int verify,
+				const uint8_t *dirty)
+{
+	const stm32_t *stm = s->stm;
+	uint32_t pa, from, to, run;
+	int first, last, p, q;
+
+	first = stm32_flash_addr_to_page_floor(stm, addr);
+	last = stm32_flash_addr_to_page_ceil(stm, addr + len);
+	for (p = first; p < last; p = q) {
+		for (q = p + 1; q < last && dirty[q - first] == dirty[p - first];
+		     q++)
+			;
+		if (!dirty[p - first])
+			continue;
+
+		pa = stm32_flash_page_to_addr(stm, p);
+		run = stm32_flash_page_to_addr(stm, q) - pa;
+		from = pa > addr ? pa : addr;
+		to = pa + run < addr + len ? pa + run : addr + len;
+		if (session_erase(s, pa, run) != STM32_ERR_OK
+		    || session_write(s, from, buf + from - addr, to - from,
+				     verify) != STM32_ERR_OK)
+			return STM32_ERR_UNKNOWN;
+	}
+	return STM32_ERR_OK;
+}
+
+/* 1 if the page differs from "page", 0 if not, -1 on error */
+static int session_page_changed(session_t *s, uint32_t addr,
+				uint8_t *page, uint32_t size)
+{
+	uint32_t crc;
+	int mismatch;
+	uint8_t found;
+
+	if (stm32_has_crc(s->stm)) {
+		if (stm32_crc_memory(s->stm, addr, size, &crc) != STM32_ERR_OK) {
+			session_err(s, "Failed to read CRC at address 0x%08x",
+				    addr);
+			return -1;
+		}
+		/* 0xFFFFFFFF is the initial value of the bootloader */
+		return crc != stm32_sw_crc(0xFFFFFFFF, page, size);
+	}
+	if (session_compare(s, addr, page, size, &mismatch, &found))
+		return -1;
+	return mismatch >= 0;
+}
+
+/*
+ * Write only the flash pages whose content changes. Each page is checked
+ * with the CRC command, or read back if the bootloader has none, then the
+ * runs of changed pages are erased and written. As with a full write, the
+ * bytes of those pages outside the buffer end up erased.
+ */
+stm32_err_t session_write_diff(session_t *s, uint32_t addr,
+			       const uint8_t *buf, uint32_t len, int verify,
+			       int *changed, int *total)
+{
+	const stm32_t *stm = s->stm;
+	uint32_t pa, ps, from, to;
+	int first, last, p, ret;
+	uint8_t *page, *dirty;
+
+	*changed = *total = 0;
+	if (!len)
+		return STM32_ERR_OK;
+	if (!stm32_addr_in_flash(stm, addr) || addr + len > stm->dev->fl_end) {
+		session_err(s, "Write range 0x%08x-0x%08x outside flash",
+			    addr, addr + len);
+		return STM32_ERR_UNKNOWN;
+	}
+
+	first = stm32_flash_addr_to_page_floor(stm, addr);
+	last = stm32_flash_addr_to_page_ceil(stm, addr + len);
+	dirty = calloc(last - first, 1);
+	if (!dirty) {
+		session_err(s, "Out of memory");
+		return STM32_ERR_UNKNOWN;
+	}
+
+	/* the expected content of each page */
+	for (p = first; p < last; p++) {
+		pa = stm32_flash_page_to_addr(stm, p);
+		ps = stm32_flash_page_to_addr(stm, p + 1) - pa;
+		page = malloc(ps);
+		if (!page) {
+			session_err(s, "Out of memory");
+			free(dirty);
+			return STM32_ERR_UNKNOWN;
+		}
+		from = pa > addr ? pa : addr;
+		to = pa + ps < addr + len ? pa + ps : addr + len;
+		memset(page, 0xFF, ps);
+		memcpy(page + from - pa, buf + from - addr, to - from);
+		ret = session_page_changed(s, pa, page, ps);
+		free(page);
+		if (ret < 0) {
+			free(dirty);
+			return STM32_ERR_UNKNOWN;
+		}
+		dirty[p - first] = ret;
+		*changed += ret;
+		session_progress(s, "verify", pa + ps, to - addr, len);
+	}
+	*total = last - first;
+
+	ret = session_write_pages(s, addr, buf, len, verify, dirty);
+	free(dirty);
+	return ret ? STM32_ERR_UNKNOWN : STM32_ERR_OK;
+}
+
+stm32_err_t session_crc(session_t *s, uint32_t addr, uint32_t len,
+			uint32_t *crc)
+{
+	if (stm32_crc_wrapper(s->stm, addr, len, crc) != STM32_ERR_OK) {
+		session_err(s, "Failed to read CRC");
+		return STM32_ERR_UNKNOWN;
+	}
+	return STM32_ERR_OK;
+}
+
+stm32_err_t session_go(session_t *s, uint32_t addr)
+{
+	if (stm32_go(s->stm, addr) != STM32_ERR_OK) {
+		session_err(s, "Failed to start execution at address 0x%08x",
+			    addr);
+		return STM32_ERR_UNKNOWN;
+	}
+	return STM32_ERR_OK;
+}
+
+/* GPIO exit sequence if any, else reset by code run from RAM */
+stm32_err_t session_reset(session_t *s)
+{
+	if (init_bl_exit(s->stm, s->port, s->cfg.gpio_seq, s->lines)) {
+		session_err(s, "Reset failed");
+		return STM32_ERR_UNKNOWN;
+	}
+	return STM32_ERR_OK;
+}
+
+/* GPIO exit sequence, only if there is one */
+stm32_err_t session_exit(session_t *s)
+{
+	if (!init_seq_has_exit(s->cfg.gpio_seq))
+		return STM32_ERR_OK;
+	if (gpio_bl_exit(s->port, s->cfg.gpio_seq, s->lines)) {
+		session_err(s, "Failed to send boot exit sequence");
+		return STM32_ERR_UNKNOWN;
+	}
+	return STM32_ERR_OK;
+}
+
+/*
+ * The protection commands reset the device after the ACK: wait for the
+ * bootloader to come back on the same port and init it again, without
+ * the entry sequence, the boot pins still select the bootloader.
+ */
+stm32_err_t session_reconnect(session_t *s)
+{
+	int timeout = s->cfg.ready_timeout ? s->cfg.ready_timeout
+					   : SESSION_RECONNECT_TIMEOUT;
+	struct timeval start, now;
+
+	stm32_close(s->stm);
+	s->stm = NULL;
+
+	if (s->port->flags & PORT_CMD_INIT) {
+		if (stm32_wait_ready(s->port, timeout) == STM32_ERR_OK)
+			s->stm = stm32_init(s->port, 0);
+	} else {
+		/* no INIT on I2C, the first command tells it is back */
+		gettimeofday(&start, NULL);
+		do {
+			s->stm = stm32_init(s->port, 0);
+			gettimeofday(&now, NULL);
+		} while (!s->stm
+			 && (now.tv_sec - start.tv_sec) * 1000
+			    + (now.tv_usec - start.tv_usec) / 1000 < timeout);
+	}
+	if (!s->stm) {
+		session_err(s, "No bootloader after the reset");
+		return STM32_ERR_UNKNOWN;
+	}
+	return STM32_ERR_OK;
+}
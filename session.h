@@ -0,0 +1,87 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#ifndef _H_SESSION
+#define _H_SESSION
+
+#include <stdint.h>
+
+#include "init.h"
+#include "serial.h"
+#include "port.h"
+#include "stm32.h"
+
+/*
+ * libstm32flash: a session owns one port and the bootloader connection
+ * on it. Many sessions can be used at the same time in a process, each
+ * from one thread. They share only their output: the bootloader protocol
+ * errors, and the others without an error callback, go to stderr; the
+ * GPIO sequences to the process-wide "diag" stream of utils.h, which the
+ * first session_open() sets to stderr if the program has not.
+ */
+
+typedef struct session session_t;
+
+/* "op" is "read", "write", "verify" or "erase"; "addr" is the next one */
+typedef void (*session_progress_t)(void *ctx, const char *op, uint32_t addr,
+				   uint32_t done, uint32_t total);
+typedef void (*session_error_t)(void *ctx, const char *msg);
+
+struct session_config {
+	struct port_options port;	/* device, baud rate, mode, frames */
+	const init_seq_t *gpio_seq;	/* bootloader entry/exit from
+					   init_seq_compile(), or NULL */
+	char init;			/* send the INIT sequence */
+	int ready_timeout;		/* ms, poll with INIT until the bootloader
+					   answers, 0 to send it once */
+	int retry;			/* rewrites of a block failing verify */
+	int skip_blank;			/* the flash is erased before writing,
+					   blocks of 0xFF are not sent */
+	const char *caps_file;		/* bootloader capability cache, or NULL */
+	session_progress_t progress;	/* callbacks, both optional */
+	session_error_t error;
+	void *ctx;
+};
+
+session_t *session_open(const struct session_config *cfg);
+void session_close(session_t *s);
+stm32_t *session_target(const session_t *s);
+struct port_interface *session_port(const session_t *s);
+
+stm32_err_t session_read(session_t *s, uint32_t addr, uint8_t *buf,
+			 uint32_t len);
+stm32_err_t session_write(session_t *s, uint32_t addr, const uint8_t *buf,
+			  uint32_t len, int verify);
+stm32_err_t session_verify(session_t *s, uint32_t addr, const uint8_t *buf,
+			   uint32_t len);
+stm32_err_t session_erase(session_t *s, uint32_t addr, uint32_t len);
+stm32_err_t session_write_pages(session_t *s, uint32_t addr,
+				const uint8_t *buf, uint32_t len, int verify,
+				const uint8_t *dirty);
+stm32_err_t session_write_diff(session_t *s, uint32_t addr,
+			       const uint8_t *buf, uint32_t len, int verify,
+			       int *changed, int *total);
+stm32_err_t session_crc(session_t *s, uint32_t addr, uint32_t len,
+			uint32_t *crc);
+stm32_err_t session_go(session_t *s, uint32_t addr);
+stm32_err_t session_reset(session_t *s);
+stm32_err_t session_exit(session_t *s);
+stm32_err_t session_reconnect(session_t *s);
+
+#endif
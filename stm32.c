@@ -22,8 +22,12 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/time.h>
 #include <time.h>
 #include <unistd.h>
+#if !defined(__WIN32__)
+#include <poll.h>
+#endif
 
 #include "stm32.h"
 #include "port.h"
@@ -62,6 +66,8 @@
 #define STM32_WUNPROT_TIMEOUT	1	/* seconds */
 #define STM32_WPROT_TIMEOUT	1	/* seconds */
 #define STM32_RPROT_TIMEOUT	1	/* seconds */
+#define STM32_READY_POLL	10	/* ms, between INIT while booting */
+#define STM32_READY_QUIET	100	/* ms, longest reply to INIT once booted */
 
 #define STM32_CMD_GET_LENGTH	17	/* bytes in the reply */
 
@@ -119,8 +125,6 @@ static const uint32_t stm_obl_launch_code_length = sizeof(stm_obl_launch_code);
 
 extern const stm32_dev_t devices[];
 
-int flash_addr_to_page_ceil(uint32_t addr);
-
 static void stm32_warn_stretching(const char *f)
 {
 	fprintf(stderr, "Attention !!!\n");
@@ -307,9 +311,9 @@ static stm32_err_t stm32_guess_len_cmd(const stm32_t *stm, uint8_t cmd,
  * This function sends the init sequence and, in case of timeout, recovers
  * the interface.
  */
-static stm32_err_t stm32_send_init_seq(const stm32_t *stm)
+/* "warn" reports a NACK, expected after stm32_wait_ready() */
+static stm32_err_t stm32_port_init_seq(struct port_interface *port, int warn)
 {
-	struct port_interface *port = stm->port;
 	port_err_t p_err;
 	uint8_t byte, cmd = STM32_CMD_INIT;
 
@@ -323,8 +327,9 @@ static stm32_err_t stm32_send_init_seq(const stm32_t *stm)
 		return STM32_ERR_OK;
 	if (p_err == PORT_ERR_OK && byte == STM32_NACK) {
 		/* We could get error later, but let's continue, for now. */
-		fprintf(stderr,
-			"Warning: the interface was not closed properly.\n");
+		if (warn)
+			fprintf(stderr,
+				"Warning: the interface was not closed properly.\n");
 		return STM32_ERR_OK;
 	}
 	if (p_err != PORT_ERR_TIMEDOUT) {
@@ -348,54 +353,101 @@ static stm32_err_t stm32_send_init_seq(const stm32_t *stm)
 	return STM32_ERR_UNKNOWN;
 }
 
-/* find newer command by higher code */
-#define newer(prev, a) (((prev) == STM32_CMD_ERR) \
-			? (a) \
-			: (((prev) > (a)) ? (prev) : (a)))
+static stm32_err_t stm32_send_init_seq(const stm32_t *stm)
+{
+	return stm32_port_init_seq(stm->port, 1);
+}
 
-stm32_t *stm32_init(struct port_interface *port, const char init)
+static long stm32_ms_since(const struct timeval *start)
 {
-	uint8_t len, val, buf[257];
-	stm32_t *stm;
-	int i, new_cmds;
+	struct timeval now;
 
-	stm      = calloc(sizeof(stm32_t), 1);
-	stm->cmd = malloc(sizeof(stm32_cmd_t));
-	memset(stm->cmd, STM32_CMD_ERR, sizeof(stm32_cmd_t));
-	stm->port = port;
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) * 1000
+	       + (now.tv_usec - start->tv_usec) / 1000;
+}
 
-	if ((port->flags & PORT_CMD_INIT) && init)
-		if (stm32_send_init_seq(stm) != STM32_ERR_OK)
-			return NULL;
+/*
+ * Instead of a fixed delay after the reset, send INIT every few ms until
+ * the bootloader answers with ACK or NACK. When the link is slower than
+ * the polling (USB latency timer, RFC 2217 round trip) more INIT went out
+ * after the one answered: their replies are dropped once the line is
+ * quiet, but an odd one may still wait for its complement. One more INIT
+ * gets a NACK then, else the INIT sequence runs with its NACK recovery.
+ * Ports without non-blocking I/O poll at their read timeout.
+ */
+stm32_err_t stm32_wait_ready(struct port_interface *port, unsigned int timeout)
+{
+	uint8_t byte, cmd = STM32_CMD_INIT;
+	struct timeval start;
+#if !defined(__WIN32__)
+	struct pollfd pfd;
+	size_t n;
+#endif
+
+	gettimeofday(&start, NULL);
+#if !defined(__WIN32__)
+	if (port->get_fd && port->read_nb && port->write_nb) {
+		pfd.fd = port->get_fd(port);
+		pfd.events = POLLIN;
+		do {
+			n = 1;
+			if (port->write_nb(port, &cmd, &n) != PORT_ERR_OK)
+				return STM32_ERR_UNKNOWN;
+			if (poll(&pfd, 1, STM32_READY_POLL) <= 0)
+				continue;
+			n = 1;
+			if (port->read_nb(port, &byte, &n) != PORT_ERR_OK)
+				return STM32_ERR_UNKNOWN;
+			if (n != 1 || (byte != STM32_ACK && byte != STM32_NACK))
+				continue;
 
-	/* get the version and read protection status  */
-	if (stm32_send_command(stm, STM32_CMD_GVR) != STM32_ERR_OK) {
-		stm32_close(stm);
-		return NULL;
-	}
+			while (poll(&pfd, 1, STM32_READY_QUIET) > 0) {
+				n = 1;
+				if (port->read_nb(port, &byte, &n) != PORT_ERR_OK
+				    || !n)
+					break;
+			}
 
-	/* From AN, only UART bootloader returns 3 bytes */
-	len = (port->flags & PORT_GVR_ETX) ? 3 : 1;
-	if (port->read(port, buf, len) != PORT_ERR_OK)
-		return NULL;
-	stm->version = buf[0];
-	stm->option1 = (port->flags & PORT_GVR_ETX) ? buf[1] : 0;
-	stm->option2 = (port->flags & PORT_GVR_ETX) ? buf[2] : 0;
-	if (stm32_get_ack(stm) != STM32_ERR_OK) {
-		stm32_close(stm);
-		return NULL;
+			if (port->write(port, &cmd, 1) != PORT_ERR_OK)
+				return STM32_ERR_UNKNOWN;
+			n = 0;
+			if (poll(&pfd, 1, STM32_READY_QUIET) > 0) {
+				n = 1;
+				if (port->read_nb(port, &byte, &n) != PORT_ERR_OK)
+					return STM32_ERR_UNKNOWN;
+			}
+			if (n == 1 && byte == STM32_NACK)
+				return STM32_ERR_OK;
+			return stm32_port_init_seq(port, 0);
+		} while (stm32_ms_since(&start) < timeout);
+		return STM32_ERR_UNKNOWN;
 	}
+#endif
+
+	do {
+		if (port->write(port, &cmd, 1) != PORT_ERR_OK)
+			return STM32_ERR_UNKNOWN;
+		if (port->read(port, &byte, 1) == PORT_ERR_OK
+		    && (byte == STM32_ACK || byte == STM32_NACK)) {
+			port->flush(port);
+			return stm32_port_init_seq(port, 0);
+		}
+	} while (stm32_ms_since(&start) < timeout);
+	return STM32_ERR_UNKNOWN;
+}
+
+/* find newer command by higher code */
+#define newer(prev, a) (((prev) == STM32_CMD_ERR) \
+			? (a) \
+			: (((prev) > (a)) ? (prev) : (a)))
+
+/* command set from the reply to GET: count - 1, version, commands */
+static void stm32_parse_get(stm32_t *stm, const uint8_t *buf)
+{
+	uint8_t len, val;
+	int i, new_cmds;
 
-	/* get the bootloader information */
-	len = STM32_CMD_GET_LENGTH;
-	if (port->cmd_get_reply)
-		for (i = 0; port->cmd_get_reply[i].length; i++)
-			if (stm->version == port->cmd_get_reply[i].version) {
-				len = port->cmd_get_reply[i].length;
-				break;
-			}
-	if (stm32_guess_len_cmd(stm, STM32_CMD_GET, buf, len) != STM32_ERR_OK)
-		return NULL;
 	len = buf[0] + 1;
 	stm->bl_version = buf[1];
 	new_cmds = 0;
@@ -451,28 +503,18 @@ stm32_t *stm32_init(struct port_interface *port, const char init)
 	}
 	if (new_cmds)
 		fprintf(stderr, ")\n");
-	if (stm32_get_ack(stm) != STM32_ERR_OK) {
-		stm32_close(stm);
-		return NULL;
-	}
+}
 
-	if (stm->cmd->get == STM32_CMD_ERR
-	    || stm->cmd->gvr == STM32_CMD_ERR
-	    || stm->cmd->gid == STM32_CMD_ERR) {
-		fprintf(stderr, "Error: bootloader did not returned correct information from GET command\n");
-		return NULL;
-	}
+/* product ID from the reply to GID, and the matching device */
+static stm32_err_t stm32_parse_gid(stm32_t *stm, const uint8_t *buf)
+{
+	uint8_t len;
+	int i;
 
-	/* get the device ID */
-	if (stm32_guess_len_cmd(stm, stm->cmd->gid, buf, 1) != STM32_ERR_OK) {
-		stm32_close(stm);
-		return NULL;
-	}
 	len = buf[0] + 1;
 	if (len < 2) {
-		stm32_close(stm);
 		fprintf(stderr, "Only %d bytes sent in the PID, unknown/unsupported device\n", len);
-		return NULL;
+		return STM32_ERR_UNKNOWN;
 	}
 	stm->pid = (buf[1] << 8) | buf[2];
 	if (len > 2) {
@@ -481,10 +523,6 @@ stm32_t *stm32_init(struct port_interface *port, const char init)
 			fprintf(stderr, " %02x", buf[i]);
 		fprintf(stderr, "\n");
 	}
-	if (stm32_get_ack(stm) != STM32_ERR_OK) {
-		stm32_close(stm);
-		return NULL;
-	}
 
 	stm->dev = devices;
 	while (stm->dev->id != 0x00 && stm->dev->id != stm->pid)
@@ -492,13 +530,163 @@ stm32_t *stm32_init(struct port_interface *port, const char init)
 
 	if (!stm->dev->id) {
 		fprintf(stderr, "Unknown/unsupported device (Device ID: 0x%03x)\n", stm->pid);
-		stm32_close(stm);
-		return NULL;
+		return STM32_ERR_UNKNOWN;
 	}
+	return STM32_ERR_OK;
+}
+
+static stm32_t *stm32_alloc(struct port_interface *port)
+{
+	stm32_t *stm;
 
+	stm = calloc(sizeof(stm32_t), 1);
+	if (!stm)
+		return NULL;
+	stm->cmd = malloc(sizeof(stm32_cmd_t));
+	if (!stm->cmd) {
+		free(stm);
+		return NULL;
+	}
+	memset(stm->cmd, STM32_CMD_ERR, sizeof(stm32_cmd_t));
+	stm->port = port;
 	return stm;
 }
 
+/* the full handshake: GVR, GET and GID, the replies are kept in "caps" */
+static stm32_err_t stm32_handshake(stm32_t *stm, struct stm32_caps *caps)
+{
+	struct port_interface *port = stm->port;
+	uint8_t len, buf[257];
+	int i;
+
+	/* get the version and read protection status  */
+	if (stm32_send_command(stm, STM32_CMD_GVR) != STM32_ERR_OK)
+		return STM32_ERR_UNKNOWN;
+
+	/* From AN, only UART bootloader returns 3 bytes */
+	len = (port->flags & PORT_GVR_ETX) ? 3 : 1;
+	if (port->read(port, buf, len) != PORT_ERR_OK)
+		return STM32_ERR_UNKNOWN;
+	stm->version = buf[0];
+	stm->option1 = (port->flags & PORT_GVR_ETX) ? buf[1] : 0;
+	stm->option2 = (port->flags & PORT_GVR_ETX) ? buf[2] : 0;
+	if (stm32_get_ack(stm) != STM32_ERR_OK)
+		return STM32_ERR_UNKNOWN;
+	memset(caps, 0, sizeof(*caps));
+	caps->gvr[0] = stm->version;
+	caps->gvr[1] = stm->option1;
+	caps->gvr[2] = stm->option2;
+
+	/* get the bootloader information */
+	len = STM32_CMD_GET_LENGTH;
+	if (port->cmd_get_reply)
+		for (i = 0; port->cmd_get_reply[i].length; i++)
+			if (stm->version == port->cmd_get_reply[i].version) {
+				len = port->cmd_get_reply[i].length;
+				break;
+			}
+	if (stm32_guess_len_cmd(stm, STM32_CMD_GET, buf, len) != STM32_ERR_OK)
+		return STM32_ERR_UNKNOWN;
+	stm32_parse_get(stm, buf);
+	if (stm32_get_ack(stm) != STM32_ERR_OK)
+		return STM32_ERR_UNKNOWN;
+	memcpy(caps->get, buf, buf[0] + 2);
+
+	if (stm->cmd->get == STM32_CMD_ERR
+	    || stm->cmd->gvr == STM32_CMD_ERR
+	    || stm->cmd->gid == STM32_CMD_ERR) {
+		fprintf(stderr, "Error: bootloader did not returned correct information from GET command\n");
+		return STM32_ERR_UNKNOWN;
+	}
+
+	/* get the device ID */
+	if (stm32_guess_len_cmd(stm, stm->cmd->gid, buf, 1) != STM32_ERR_OK)
+		return STM32_ERR_UNKNOWN;
+	if (stm32_parse_gid(stm, buf) != STM32_ERR_OK)
+		return STM32_ERR_UNKNOWN;
+	if (stm32_get_ack(stm) != STM32_ERR_OK)
+		return STM32_ERR_UNKNOWN;
+	memcpy(caps->gid, buf, buf[0] + 2);
+	return STM32_ERR_OK;
+}
+
+/*
+ * Rebuild the target from the cached replies, once GID confirms the
+ * same device is still there. Returns STM32_ERR_NACK if it is another
+ * one, the full handshake is then needed.
+ */
+static stm32_err_t stm32_handshake_cached(stm32_t *stm,
+					  const struct stm32_caps *caps)
+{
+	struct port_interface *port = stm->port;
+	uint8_t buf[257];
+
+	stm32_parse_get(stm, caps->get);
+	if (stm->cmd->gid == STM32_CMD_ERR)
+		return STM32_ERR_NACK;
+
+	if (stm32_guess_len_cmd(stm, stm->cmd->gid, buf, caps->gid[0])
+	    != STM32_ERR_OK)
+		return STM32_ERR_UNKNOWN;
+	if (stm32_get_ack(stm) != STM32_ERR_OK)
+		return STM32_ERR_UNKNOWN;
+	if (memcmp(buf, caps->gid, caps->gid[0] + 2)) {
+		memset(stm->cmd, STM32_CMD_ERR, sizeof(stm32_cmd_t));
+		return STM32_ERR_NACK;
+	}
+
+	stm->version = caps->gvr[0];
+	stm->option1 = (port->flags & PORT_GVR_ETX) ? caps->gvr[1] : 0;
+	stm->option2 = (port->flags & PORT_GVR_ETX) ? caps->gvr[2] : 0;
+	return stm32_parse_gid(stm, caps->gid);
+}
+
+stm32_t *stm32_init(struct port_interface *port, const char init)
+{
+	struct stm32_caps caps;
+
+	memset(&caps, 0, sizeof(caps));
+	return stm32_init_caps(port, init, &caps, NULL);
+}
+
+/*
+ * As stm32_init(), starting from the replies of a previous handshake
+ * on the same port if "caps" holds them (caps->get[0] not zero).
+ * "caps" is updated, "cached" is set when the cache was good.
+ */
+stm32_t *stm32_init_caps(struct port_interface *port, const char init,
+			 struct stm32_caps *caps, int *cached)
+{
+	stm32_err_t s_err = STM32_ERR_NACK;
+	stm32_t *stm;
+
+	if (cached)
+		*cached = 0;
+	stm = stm32_alloc(port);
+	if (!stm)
+		return NULL;
+
+	if ((port->flags & PORT_CMD_INIT) && init)
+		if (stm32_send_init_seq(stm) != STM32_ERR_OK) {
+			stm32_close(stm);
+			return NULL;
+		}
+
+	if (caps->get[0])
+		s_err = stm32_handshake_cached(stm, caps);
+	if (s_err == STM32_ERR_OK) {
+		if (cached)
+			*cached = 1;
+		return stm;
+	}
+	if (s_err == STM32_ERR_NACK
+	    && stm32_handshake(stm, caps) == STM32_ERR_OK)
+		return stm;
+
+	stm32_close(stm);
+	return NULL;
+}
+
 void stm32_close(stm32_t *stm)
 {
 	if (stm)
@@ -763,57 +951,68 @@ static stm32_err_t stm32_mass_erase(const stm32_t *stm)
 	return STM32_ERR_OK;
 }
 
-static stm32_err_t stm32_pages_erase(const stm32_t *stm, uint32_t spage, uint32_t pages)
+/* extended erase of bank 1 (0xFFFE) or bank 2 (0xFFFD) */
+static stm32_err_t stm32_bank_erase(const stm32_t *stm, int bank)
 {
 	struct port_interface *port = stm->port;
-	stm32_err_t s_err;
-	port_err_t p_err;
-	uint32_t pg_num;
-	uint8_t pg_byte;
-	uint8_t cs = 0;
-	uint8_t *buf;
-	int i = 0;
+	uint8_t buf[3];
 
-	/* The erase command reported by the bootloader is either 0x43, 0x44 or 0x45 */
-	/* 0x44 is Extended Erase, a 2 byte based protocol and needs to be handled differently. */
-	/* 0x45 is clock no-stretching version of Extended Erase for I2C port. */
 	if (stm32_send_command(stm, stm->cmd->er) != STM32_ERR_OK) {
-		fprintf(stderr, "Can't initiate chip mass erase!\n");
+		fprintf(stderr, "Can't initiate bank erase!\n");
+		return STM32_ERR_UNKNOWN;
+	}
+
+	buf[0] = 0xFF;
+	buf[1] = bank == 1 ? 0xFE : 0xFD;
+	buf[2] = buf[0] ^ buf[1];
+	if (port->write(port, buf, 3) != PORT_ERR_OK) {
+		fprintf(stderr, "Bank erase error.\n");
+		return STM32_ERR_UNKNOWN;
+	}
+	if (stm32_get_ack_timeout(stm, STM32_MASSERASE_TIMEOUT) != STM32_ERR_OK) {
+		fprintf(stderr, "Bank %d erase failed.\n", bank);
+		if ((port->flags & PORT_STRETCH_W)
+		    && stm->cmd->er != STM32_CMD_EE_NS)
+			stm32_warn_stretching("bank erase");
 		return STM32_ERR_UNKNOWN;
 	}
+	return STM32_ERR_OK;
+}
+
+/* frame with the list of pages, for regular (0x43) or extended erase */
+/* the pages are "list", or "spage" and the following ones without list */
+static uint8_t *stm32_pages_erase_frame(const stm32_t *stm,
+					const uint32_t *list, uint32_t spage,
+					uint32_t pages, unsigned int *len)
+{
+	uint32_t pg_num, n;
+	uint8_t pg_byte;
+	uint8_t cs = 0;
+	uint8_t *buf;
+	int i = 0;
 
 	/* regular erase (0x43) */
 	if (stm->cmd->er == STM32_CMD_ER) {
 		buf = malloc(1 + pages + 1);
 		if (!buf)
-			return STM32_ERR_UNKNOWN;
+			return NULL;
 
 		buf[i++] = pages - 1;
 		cs ^= (pages-1);
 		for (pg_num = spage; pg_num < (pages + spage); pg_num++) {
-			buf[i++] = pg_num;
-			cs ^= pg_num;
+			pg_byte = list ? list[pg_num - spage] : pg_num;
+			buf[i++] = pg_byte;
+			cs ^= pg_byte;
 		}
 		buf[i++] = cs;
-		p_err = port->write(port, buf, i);
-		free(buf);
-		if (p_err != PORT_ERR_OK) {
-			fprintf(stderr, "Erase failed.\n");
-			return STM32_ERR_UNKNOWN;
-		}
-		s_err = stm32_get_ack_timeout(stm, pages * STM32_PAGEERASE_TIMEOUT);
-		if (s_err != STM32_ERR_OK) {
-			if (port->flags & PORT_STRETCH_W)
-				stm32_warn_stretching("erase");
-			return STM32_ERR_UNKNOWN;
-		}
-		return STM32_ERR_OK;
+		*len = i;
+		return buf;
 	}
 
 	/* extended erase */
 	buf = malloc(2 + 2 * pages + 1);
 	if (!buf)
-		return STM32_ERR_UNKNOWN;
+		return NULL;
 
 	/* Number of pages to be erased - 1, two bytes, MSB first */
 	pg_byte = (pages - 1) >> 8;
@@ -824,15 +1023,59 @@ static stm32_err_t stm32_pages_erase(const stm32_t *stm, uint32_t spage, uint32_
 	cs ^= pg_byte;
 
 	for (pg_num = spage; pg_num < spage + pages; pg_num++) {
-		pg_byte = pg_num >> 8;
+		n = list ? list[pg_num - spage] : pg_num;
+		pg_byte = n >> 8;
 		cs ^= pg_byte;
 		buf[i++] = pg_byte;
-		pg_byte = pg_num & 0xFF;
+		pg_byte = n & 0xFF;
 		cs ^= pg_byte;
 		buf[i++] = pg_byte;
 	}
 	buf[i++] = cs;
-	p_err = port->write(port, buf, i);
+	*len = i;
+	return buf;
+}
+
+static stm32_err_t stm32_pages_erase(const stm32_t *stm, const uint32_t *list,
+				     uint32_t spage, uint32_t pages)
+{
+	struct port_interface *port = stm->port;
+	stm32_err_t s_err;
+	port_err_t p_err;
+	unsigned int len;
+	uint8_t *buf;
+
+	/* The erase command reported by the bootloader is either 0x43, 0x44 or 0x45 */
+	/* 0x44 is Extended Erase, a 2 byte based protocol and needs to be handled differently. */
+	/* 0x45 is clock no-stretching version of Extended Erase for I2C port. */
+	if (stm32_send_command(stm, stm->cmd->er) != STM32_ERR_OK) {
+		fprintf(stderr, "Can't initiate chip mass erase!\n");
+		return STM32_ERR_UNKNOWN;
+	}
+
+	buf = stm32_pages_erase_frame(stm, list, spage, pages, &len);
+	if (!buf)
+		return STM32_ERR_UNKNOWN;
+
+	/* regular erase (0x43) */
+	if (stm->cmd->er == STM32_CMD_ER) {
+		p_err = port->write(port, buf, len);
+		free(buf);
+		if (p_err != PORT_ERR_OK) {
+			fprintf(stderr, "Erase failed.\n");
+			return STM32_ERR_UNKNOWN;
+		}
+		s_err = stm32_get_ack_timeout(stm, pages * STM32_PAGEERASE_TIMEOUT);
+		if (s_err != STM32_ERR_OK) {
+			if (port->flags & PORT_STRETCH_W)
+				stm32_warn_stretching("erase");
+			return STM32_ERR_UNKNOWN;
+		}
+		return STM32_ERR_OK;
+	}
+
+	/* extended erase */
+	p_err = port->write(port, buf, len);
 	free(buf);
 	if (p_err != PORT_ERR_OK) {
 		fprintf(stderr, "Page-by-page erase error.\n");
@@ -851,10 +1094,111 @@ static stm32_err_t stm32_pages_erase(const stm32_t *stm, uint32_t spage, uint32_
 	return STM32_ERR_OK;
 }
 
-stm32_err_t stm32_erase_memory(const stm32_t *stm, uint32_t spage, uint32_t pages)
+/* estimated ms to erase the pages "list", or "spage" and followers */
+static uint32_t stm32_page_erase_time(const stm32_t *stm, const uint32_t *list,
+				      uint32_t spage, uint32_t pages)
 {
-	uint32_t n;
-	stm32_err_t s_err;
+	const stm32_erase_time_t *et = stm->dev->et;
+	uint32_t i, p, size, ms = 0;
+
+	for (i = 0; i < pages; i++) {
+		p = list ? list[i] : spage + i;
+		size = stm32_flash_page_to_addr(stm, p + 1)
+		       - stm32_flash_page_to_addr(stm, p);
+		ms += et->page + et->kib * size / 1024;
+	}
+	return ms;
+}
+
+/*
+ * 1 if a mass erase, which also erases the other pages, is expected to be
+ * faster than erasing the pages in "list" (all of them without list).
+ * Without a model for the device, only when the list is the whole flash.
+ */
+int stm32_mass_erase_faster(const stm32_t *stm, const uint32_t *list,
+			    uint32_t pages)
+{
+	const stm32_erase_time_t *et = stm->dev->et;
+	uint32_t total, mass;
+
+	if (stm->dev->flags & F_NO_ME)
+		return 0;
+	total = stm32_flash_addr_to_page_ceil(stm, stm->dev->fl_end);
+	if (!et)
+		return pages == total;
+	mass = et->mass + et->mass_kib
+	       * ((stm->dev->fl_end - stm->dev->fl_start) / 1024);
+	return mass < stm32_page_erase_time(stm, list, 0, pages);
+}
+
+/* dual bank device with a time model, bank erase is an extended erase */
+static int stm32_has_bank_erase(const stm32_t *stm)
+{
+	return stm->dev->bank2 && stm->dev->et
+	       && stm->cmd->er != STM32_CMD_ER && stm->cmd->er != STM32_CMD_ERR
+	       && !(stm->dev->flags & F_NO_ME);
+}
+
+/* 1 or 2, the bank holding all the pages of "list", 0 if none */
+static int stm32_list_bank(const stm32_t *stm, const uint32_t *list,
+			   uint32_t pages)
+{
+	uint32_t i, addr;
+	int bank = 0, b;
+
+	if (!stm32_has_bank_erase(stm) || !pages)
+		return 0;
+	for (i = 0; i < pages; i++) {
+		addr = stm32_flash_page_to_addr(stm, list[i]);
+		b = addr < stm->dev->bank2 ? 1 : 2;
+		if (bank && b != bank)
+			return 0;
+		bank = b;
+	}
+	return bank;
+}
+
+static uint32_t stm32_bank_erase_time(const stm32_t *stm, int bank)
+{
+	const stm32_erase_time_t *et = stm->dev->et;
+	uint32_t size;
+
+	size = bank == 1 ? stm->dev->bank2 - stm->dev->fl_start
+			 : stm->dev->fl_end - stm->dev->bank2;
+	return et->mass + et->mass_kib * (size / 1024);
+}
+
+/*
+ * Erase at least the pages of "list" with the fastest command the model
+ * of the device finds: the page list, the erase of the bank holding them
+ * all, or a mass erase. A bank is never erased by a mass erase, which is
+ * slower and loses the other bank. Nothing outside "start".."end" may be
+ * erased, so a bank or mass erase needs that range to cover the whole bank
+ * or flash.
+ */
+stm32_err_t stm32_erase_fastest(const stm32_t *stm, const uint32_t *list,
+				uint32_t pages, uint32_t start, uint32_t end)
+{
+	int bank = stm32_list_bank(stm, list, pages);
+	uint32_t bstart, bend;
+
+	bstart = bank == 2 ? stm->dev->bank2 : stm->dev->fl_start;
+	bend = bank == 1 ? stm->dev->bank2 : stm->dev->fl_end;
+	if (bank && start <= bstart && end >= bend
+	    && stm32_bank_erase_time(stm, bank)
+		    < stm32_page_erase_time(stm, list, 0, pages))
+		return stm32_bank_erase(stm, bank);
+	if (!bank && start <= stm->dev->fl_start && end >= stm->dev->fl_end
+	    && stm32_mass_erase_faster(stm, list, pages))
+		return stm32_erase_memory(stm, 0, STM32_MASS_ERASE);
+	return stm32_erase_page_list(stm, list, pages);
+}
+
+stm32_err_t stm32_erase_memory(const stm32_t *stm, uint32_t spage, uint32_t pages)
+{
+	uint32_t n, start, end;
+	stm32_err_t s_err;
+	int bank;
 
 	if (!pages || spage > STM32_MAX_PAGES ||
 	    ((pages != STM32_MASS_ERASE) && ((spage + pages) > STM32_MAX_PAGES)))
@@ -866,6 +1210,7 @@ stm32_err_t stm32_erase_memory(const stm32_t *stm, uint32_t spage, uint32_t page
 	}
 
 	if (pages == STM32_MASS_ERASE) {
+		pages = stm32_flash_addr_to_page_ceil(stm, stm->dev->fl_end);
 		/*
 		 * Not all chips support mass erase.
 		 * Mass erase can be obtained executing a "readout protect"
@@ -875,11 +1220,22 @@ stm32_err_t stm32_erase_memory(const stm32_t *stm, uint32_t spage, uint32_t page
 		 * protection" mode it will consider the debug connection as
 		 * a tentative of intrusion and will hang.
 		 * Erasing the flash page-by-page is the safer way to go.
+		 * It is also faster on some families, see the device table.
 		 */
-		if (!(stm->dev->flags & F_NO_ME))
+		if (stm32_mass_erase_faster(stm, NULL, pages))
 			return stm32_mass_erase(stm);
+	}
 
-		pages = flash_addr_to_page_ceil(stm->dev->fl_end);
+	/* exactly one bank */
+	if (stm32_has_bank_erase(stm)) {
+		start = stm32_flash_page_to_addr(stm, spage);
+		end = stm32_flash_page_to_addr(stm, spage + pages);
+		bank = start == stm->dev->fl_start && end == stm->dev->bank2 ? 1
+		       : start == stm->dev->bank2 && end == stm->dev->fl_end ? 2
+		       : 0;
+		if (bank && stm32_bank_erase_time(stm, bank)
+			    < stm32_page_erase_time(stm, NULL, spage, pages))
+			return stm32_bank_erase(stm, bank);
 	}
 
 	/*
@@ -888,7 +1244,7 @@ stm32_err_t stm32_erase_memory(const stm32_t *stm, uint32_t spage, uint32_t page
 	 */
 	while (pages) {
 		n = (pages <= 512) ? pages : 512;
-		s_err = stm32_pages_erase(stm, spage, n);
+		s_err = stm32_pages_erase(stm, NULL, spage, n);
 		if (s_err != STM32_ERR_OK)
 			return s_err;
 		spage += n;
@@ -897,6 +1253,34 @@ stm32_err_t stm32_erase_memory(const stm32_t *stm, uint32_t spage, uint32_t page
 	return STM32_ERR_OK;
 }
 
+/*
+ * Erase the pages in "list", not necessarily contiguous, with as few
+ * commands as the bootloader takes: 256 pages for the regular erase,
+ * 512 for the extended one.
+ */
+stm32_err_t stm32_erase_page_list(const stm32_t *stm, const uint32_t *list,
+				  uint32_t pages)
+{
+	uint32_t n, max;
+	stm32_err_t s_err;
+
+	if (stm->cmd->er == STM32_CMD_ERR) {
+		fprintf(stderr, "Error: ERASE command not implemented in bootloader.\n");
+		return STM32_ERR_NO_CMD;
+	}
+
+	max = stm->cmd->er == STM32_CMD_ER ? 256 : 512;
+	while (pages) {
+		n = pages <= max ? pages : max;
+		s_err = stm32_pages_erase(stm, list, 0, n);
+		if (s_err != STM32_ERR_OK)
+			return s_err;
+		list += n;
+		pages -= n;
+	}
+	return STM32_ERR_OK;
+}
+
 static stm32_err_t stm32_run_raw_code(const stm32_t *stm,
 				      uint32_t target_address,
 				      const uint8_t *code, uint32_t code_size)
@@ -977,6 +1361,11 @@ stm32_err_t stm32_reset_device(const stm32_t *stm)
 	}
 }
 
+int stm32_has_crc(const stm32_t *stm)
+{
+	return stm->cmd->crc != STM32_CMD_ERR;
+}
+
 stm32_err_t stm32_crc_memory(const stm32_t *stm, uint32_t address,
 			     uint32_t length, uint32_t *crc)
 {
@@ -1110,3 +1499,911 @@ stm32_err_t stm32_crc_wrapper(const stm32_t *stm, uint32_t address,
 	*crc = current_crc;
 	return STM32_ERR_OK;
 }
+
+/*
+ * The 96-bit unique ID, from its address in the reference manual of each
+ * family. On L0 and L1 the third word is 0x14 after the first.
+ */
+stm32_err_t stm32_read_uid(const stm32_t *stm, uint8_t uid[12])
+{
+	uint32_t addr, third = 8;
+
+	switch (stm->pid) {
+	case 0x440: case 0x442: case 0x444: case 0x445: case 0x448:	/* F0 */
+	case 0x432: case 0x422: case 0x439: case 0x438: case 0x446:	/* F3 */
+		addr = 0x1FFFF7AC;
+		break;
+	case 0x412: case 0x410: case 0x414: case 0x420: case 0x428:	/* F1 */
+	case 0x418: case 0x430:
+		addr = 0x1FFFF7E8;
+		break;
+	case 0x411:							/* F2 */
+	case 0x413: case 0x419: case 0x423: case 0x433: case 0x458:	/* F4 */
+	case 0x431: case 0x441: case 0x463: case 0x421: case 0x434:
+		addr = 0x1FFF7A10;
+		break;
+	case 0x452:							/* F72/73 */
+		addr = 0x1FF07A10;
+		break;
+	case 0x449: case 0x451:						/* F74-77 */
+		addr = 0x1FF0F420;
+		break;
+	case 0x425: case 0x417: case 0x447:				/* L0 */
+	case 0x416: case 0x429:						/* L1 cat 1/2 */
+		addr = 0x1FF80050;
+		third = 0x14;
+		break;
+	case 0x427: case 0x436: case 0x437:				/* L1 cat 3+ */
+		addr = 0x1FF800D0;
+		third = 0x14;
+		break;
+	case 0x415: case 0x435: case 0x461:				/* L4 */
+		addr = 0x1FFF7590;
+		break;
+	default:
+		return STM32_ERR_NO_CMD;
+	}
+
+	if (stm32_read_memory(stm, addr, uid, 8) != STM32_ERR_OK
+	    || stm32_read_memory(stm, addr + third, uid + 8, 4) != STM32_ERR_OK)
+		return STM32_ERR_UNKNOWN;
+	return STM32_ERR_OK;
+}
+
+/*
+ * Broadcast: when several targets get the same data at the same address,
+ * each frame is built once and written to all the ports, then the replies
+ * are collected one port at a time. The targets proceed in lockstep and
+ * the time per frame is the one of the slowest target, not the sum.
+ *
+ * Only the targets with err[i] == STM32_ERR_OK take part, and they must
+ * match the first one in device and bootloader commands to share the
+ * frames. A target that differs, or that fails during the broadcast, is
+ * then served alone with the regular functions (slow path); err[i]
+ * reports its final result.
+ */
+enum {
+	BCAST_SKIP,
+	BCAST_FAST,
+	BCAST_SLOW,
+};
+
+/* returns the first target taking part, or -1 if none */
+static int stm32_bcast_group(stm32_t *const stm[], int n,
+			     const stm32_err_t err[], char mode[])
+{
+	int i, first = -1;
+
+	for (i = 0; i < n; i++) {
+		mode[i] = BCAST_SKIP;
+		if (err[i] != STM32_ERR_OK)
+			continue;
+		if (first < 0)
+			first = i;
+		if (stm[i]->dev == stm[first]->dev
+		    && !memcmp(stm[i]->cmd, stm[first]->cmd, sizeof(stm32_cmd_t)))
+			mode[i] = BCAST_FAST;
+		else
+			mode[i] = BCAST_SLOW;
+	}
+	return first;
+}
+
+/* the same frame to all the ports, then wait the ACK from each one */
+static void stm32_bcast_frame(stm32_t *const stm[], int n, const char mode[],
+			      stm32_err_t err[], uint8_t *buf,
+			      unsigned int len, time_t timeout)
+{
+	struct port_interface *port;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (mode[i] != BCAST_FAST || err[i] != STM32_ERR_OK)
+			continue;
+		port = stm[i]->port;
+		if (port->write(port, buf, len) != PORT_ERR_OK)
+			err[i] = STM32_ERR_UNKNOWN;
+	}
+
+	for (i = 0; i < n; i++)
+		if (mode[i] == BCAST_FAST && err[i] == STM32_ERR_OK)
+			err[i] = stm32_get_ack_timeout(stm[i], timeout);
+}
+
+/* true if target "i" has to go through the slow path */
+static int stm32_bcast_slow(stm32_t *const stm[], int i, const char mode[],
+			    const stm32_err_t err[])
+{
+	if (mode[i] == BCAST_SKIP)
+		return 0;
+	if (mode[i] == BCAST_SLOW)
+		return 1;
+	if (err[i] == STM32_ERR_OK)
+		return 0;
+	/* after a NACK the bootloader already waits for a new command */
+	if (err[i] != STM32_ERR_NACK)
+		stm32_resync(stm[i]);
+	return 1;
+}
+
+static void stm32_bcast_addr(uint8_t *buf, uint32_t address)
+{
+	buf[0] = address >> 24;
+	buf[1] = (address >> 16) & 0xFF;
+	buf[2] = (address >> 8) & 0xFF;
+	buf[3] = address & 0xFF;
+	buf[4] = buf[0] ^ buf[1] ^ buf[2] ^ buf[3];
+}
+
+void stm32_bcast_write_memory(stm32_t *const stm[], int n, stm32_err_t err[],
+			      uint32_t address, const uint8_t data[],
+			      unsigned int len)
+{
+	uint8_t cs, cmd[2], addr[5], buf[256 + 2];
+	unsigned int i, aligned_len;
+	char mode[n > 0 ? n : 1];
+	int t, first;
+
+	if (!len || n <= 0)
+		return;
+
+	first = stm32_bcast_group(stm, n, err, mode);
+	if (first < 0)
+		return;
+
+	/* let the regular function report the errors */
+	if (len > 256 || (address & 0x3) || stm[first]->cmd->wm == STM32_CMD_ERR)
+		goto slow;
+
+	cmd[0] = stm[first]->cmd->wm;
+	cmd[1] = cmd[0] ^ 0xFF;
+	stm32_bcast_addr(addr, address);
+
+	aligned_len = (len + 3) & ~3;
+	cs = aligned_len - 1;
+	buf[0] = aligned_len - 1;
+	for (i = 0; i < len; i++) {
+		cs ^= data[i];
+		buf[i + 1] = data[i];
+	}
+	/* padding data */
+	for (i = len; i < aligned_len; i++) {
+		cs ^= 0xFF;
+		buf[i + 1] = 0xFF;
+	}
+	buf[aligned_len + 1] = cs;
+
+	stm32_bcast_frame(stm, n, mode, err, cmd, 2, 0);
+	stm32_bcast_frame(stm, n, mode, err, addr, 5, 0);
+	stm32_bcast_frame(stm, n, mode, err, buf, aligned_len + 2,
+			  STM32_BLKWRITE_TIMEOUT);
+
+slow:
+	for (t = 0; t < n; t++)
+		if (stm32_bcast_slow(stm, t, mode, err))
+			err[t] = stm32_write_memory(stm[t], address, data, len);
+}
+
+void stm32_bcast_read_memory(stm32_t *const stm[], int n, stm32_err_t err[],
+			     uint32_t address, uint8_t *const data[],
+			     unsigned int len)
+{
+	struct port_interface *port;
+	uint8_t cmd[2], addr[5], rlen[2];
+	char mode[n > 0 ? n : 1];
+	int t, first;
+
+	if (!len || n <= 0)
+		return;
+
+	first = stm32_bcast_group(stm, n, err, mode);
+	if (first < 0)
+		return;
+
+	if (len > 256 || stm[first]->cmd->rm == STM32_CMD_ERR)
+		goto slow;
+
+	cmd[0] = stm[first]->cmd->rm;
+	cmd[1] = cmd[0] ^ 0xFF;
+	stm32_bcast_addr(addr, address);
+	rlen[0] = len - 1;
+	rlen[1] = rlen[0] ^ 0xFF;
+
+	stm32_bcast_frame(stm, n, mode, err, cmd, 2, 0);
+	stm32_bcast_frame(stm, n, mode, err, addr, 5, 0);
+	stm32_bcast_frame(stm, n, mode, err, rlen, 2, 0);
+	for (t = 0; t < n; t++) {
+		if (mode[t] != BCAST_FAST || err[t] != STM32_ERR_OK)
+			continue;
+		port = stm[t]->port;
+		if (port->read(port, data[t], len) != PORT_ERR_OK)
+			err[t] = STM32_ERR_UNKNOWN;
+	}
+
+slow:
+	for (t = 0; t < n; t++)
+		if (stm32_bcast_slow(stm, t, mode, err))
+			err[t] = stm32_read_memory(stm[t], address, data[t], len);
+}
+
+void stm32_bcast_erase_memory(stm32_t *const stm[], int n, stm32_err_t err[],
+			      uint32_t spage, uint32_t pages)
+{
+	const stm32_t *ref;
+	uint32_t p_start = spage, p_num = pages, cnt;
+	uint8_t cmd[2], *buf;
+	char mode[n > 0 ? n : 1];
+	unsigned int len;
+	int t, first;
+
+	if (n <= 0 || !pages || spage > STM32_MAX_PAGES ||
+	    ((pages != STM32_MASS_ERASE) && ((spage + pages) > STM32_MAX_PAGES)))
+		return;
+
+	first = stm32_bcast_group(stm, n, err, mode);
+	if (first < 0)
+		return;
+
+	ref = stm[first];
+	if (ref->cmd->er == STM32_CMD_ERR)
+		goto slow;
+
+	cmd[0] = ref->cmd->er;
+	cmd[1] = cmd[0] ^ 0xFF;
+
+	if (pages == STM32_MASS_ERASE) {
+		pages = stm32_flash_addr_to_page_ceil(ref, ref->dev->fl_end);
+		if (stm32_mass_erase_faster(ref, NULL, pages)) {
+			/* 0xFF for regular erase, 0xFFFF for extended erase */
+			uint8_t me[] = { 0xFF, 0x00 };
+			uint8_t eme[] = { 0xFF, 0xFF, 0x00 };
+
+			stm32_bcast_frame(stm, n, mode, err, cmd, 2, 0);
+			if (ref->cmd->er == STM32_CMD_ER)
+				stm32_bcast_frame(stm, n, mode, err, me,
+						  sizeof(me),
+						  STM32_MASSERASE_TIMEOUT);
+			else
+				stm32_bcast_frame(stm, n, mode, err, eme,
+						  sizeof(eme),
+						  STM32_MASSERASE_TIMEOUT);
+			goto slow;
+		}
+	}
+
+	while (pages) {
+		cnt = (pages <= 512) ? pages : 512;
+		buf = stm32_pages_erase_frame(ref, NULL, spage, cnt, &len);
+		if (!buf) {
+			for (t = 0; t < n; t++)
+				if (mode[t] == BCAST_FAST && err[t] == STM32_ERR_OK)
+					err[t] = STM32_ERR_UNKNOWN;
+			break;
+		}
+		stm32_bcast_frame(stm, n, mode, err, cmd, 2, 0);
+		stm32_bcast_frame(stm, n, mode, err, buf, len,
+				  cnt * STM32_PAGEERASE_TIMEOUT);
+		free(buf);
+		spage += cnt;
+		pages -= cnt;
+	}
+
+slow:
+	/* the slow path restarts the whole erase */
+	for (t = 0; t < n; t++)
+		if (stm32_bcast_slow(stm, t, mode, err))
+			err[t] = stm32_erase_memory(stm[t], p_start, p_num);
+}
+
+int stm32_addr_in_ram(const stm32_t *stm, uint32_t addr)
+{
+	return addr >= stm->dev->ram_start && addr < stm->dev->ram_end;
+}
+
+int stm32_addr_in_flash(const stm32_t *stm, uint32_t addr)
+{
+	return addr >= stm->dev->fl_start && addr < stm->dev->fl_end;
+}
+
+int stm32_addr_in_opt_bytes(const stm32_t *stm, uint32_t addr)
+{
+	/* option bytes upper range is inclusive in our device table */
+	return addr >= stm->dev->opt_start && addr <= stm->dev->opt_end;
+}
+
+int stm32_addr_in_sysmem(const stm32_t *stm, uint32_t addr)
+{
+	return addr >= stm->dev->mem_start && addr < stm->dev->mem_end;
+}
+
+/* returns the page that contains address "addr" */
+int stm32_flash_addr_to_page_floor(const stm32_t *stm, uint32_t addr)
+{
+	int page;
+	uint32_t *psize;
+
+	if (!stm32_addr_in_flash(stm, addr))
+		return 0;
+
+	page = 0;
+	addr -= stm->dev->fl_start;
+	psize = stm->dev->fl_ps;
+
+	while (addr >= psize[0]) {
+		addr -= psize[0];
+		page++;
+		if (psize[1])
+			psize++;
+	}
+
+	return page;
+}
+
+/* returns the first page whose start addr is >= "addr" */
+int stm32_flash_addr_to_page_ceil(const stm32_t *stm, uint32_t addr)
+{
+	int page;
+	uint32_t *psize;
+
+	if (!(addr >= stm->dev->fl_start && addr <= stm->dev->fl_end))
+		return 0;
+
+	page = 0;
+	addr -= stm->dev->fl_start;
+	psize = stm->dev->fl_ps;
+
+	while (addr >= psize[0]) {
+		addr -= psize[0];
+		page++;
+		if (psize[1])
+			psize++;
+	}
+
+	return addr ? page + 1 : page;
+}
+
+/* returns the lower address of flash page "page" */
+uint32_t stm32_flash_page_to_addr(const stm32_t *stm, int page)
+{
+	int i;
+	uint32_t addr, *psize;
+
+	addr = stm->dev->fl_start;
+	psize = stm->dev->fl_ps;
+
+	for (i = 0; i < page; i++) {
+		addr += psize[0];
+		if (psize[1])
+			psize++;
+	}
+
+	return addr;
+}
+
+/*
+ * Non-blocking engine.
+ * A command is a list of phases: each one sends a frame, if any, then
+ * waits for an ACK or for a reply of known or announced length. The
+ * phases run from stm32_async_step(), which never waits: it does what
+ * the port allows and returns. Commands made of several exchanges
+ * (init, erase of many pages) queue their next phases from "next".
+ */
+
+enum stm32_async_rx {
+	RX_ACK,		/* ACK, NACK is an error */
+	RX_SYNC,	/* ACK or NACK, answer to the init byte */
+	RX_DATA,	/* rx_len bytes */
+	RX_LEN,		/* one byte N, then N + 1 bytes */
+};
+
+#define STM32_ASYNC_PHASES	8
+#define STM32_ASYNC_TIMEOUT	1000	/* ms, default for the replies */
+
+struct stm32_async_phase {
+	unsigned int tx_off, tx_len;	/* frame, in the tx buffer */
+	enum stm32_async_rx rx;
+	uint8_t *rx_buf;
+	unsigned int rx_len;
+	int timeout;			/* ms */
+};
+
+struct stm32_async {
+	struct port_interface *port;
+	stm32_t *stm;
+	int timeout;
+	stm32_async_state_t state;
+	stm32_err_t err;
+
+	struct stm32_async_phase ph[STM32_ASYNC_PHASES];
+	int n_ph, cur;
+	uint8_t *tx;
+	unsigned int tx_size, tx_used;
+	unsigned int tx_sent;		/* bytes of the running phase */
+	int resync;
+	unsigned int rx_done;
+	uint8_t ack;
+	uint64_t deadline;		/* ms */
+	int (*next)(stm32_async_t *a);	/* 1: more phases, 0: done, -1 */
+
+	/* replies and state of the running command */
+	uint8_t gvr[3], get[257], gid[257], crc[5];
+	uint32_t spage, pages;
+	uint32_t crc_val;
+};
+
+static uint64_t stm32_async_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/* the port must be byte oriented and usable without blocking */
+stm32_async_t *stm32_async_new(struct port_interface *port, int timeout)
+{
+	stm32_async_t *a;
+
+	if (!(port->flags & PORT_BYTE) || !port->get_fd || !port->read_nb
+	    || !port->write_nb)
+		return NULL;
+
+	a = calloc(1, sizeof(*a));
+	if (!a)
+		return NULL;
+	a->port = port;
+	a->timeout = timeout ? timeout : STM32_ASYNC_TIMEOUT;
+	return a;
+}
+
+void stm32_async_free(stm32_async_t *a)
+{
+	if (!a)
+		return;
+	stm32_close(a->stm);
+	free(a->tx);
+	free(a);
+}
+
+stm32_t *stm32_async_target(const stm32_async_t *a)
+{
+	if (a->state == STM32_ASYNC_BUSY || !a->stm || !a->stm->dev)
+		return NULL;
+	return a->stm;
+}
+
+stm32_err_t stm32_async_error(const stm32_async_t *a)
+{
+	return a->err;
+}
+
+uint32_t stm32_async_crc(const stm32_async_t *a)
+{
+	return a->crc_val;
+}
+
+int stm32_async_fd(const stm32_async_t *a)
+{
+	return a->port->get_fd(a->port);
+}
+
+int stm32_async_events(const stm32_async_t *a)
+{
+	if (a->state != STM32_ASYNC_BUSY)
+		return 0;
+	return a->tx_sent < a->ph[a->cur].tx_len ? STM32_ASYNC_WRITE
+						   : STM32_ASYNC_READ;
+}
+
+/* ms until the running phase times out, -1 when nothing runs */
+int stm32_async_timeout(const stm32_async_t *a)
+{
+	uint64_t now;
+
+	if (a->state != STM32_ASYNC_BUSY)
+		return -1;
+	now = stm32_async_now();
+	return a->deadline > now ? a->deadline - now : 0;
+}
+
+static void stm32_async_clear(stm32_async_t *a)
+{
+	a->n_ph = 0;
+	a->cur = 0;
+	a->tx_used = 0;
+	a->tx_sent = 0;
+	a->rx_done = 0;
+	a->resync = 0;
+}
+
+static int stm32_async_add(stm32_async_t *a, const uint8_t *tx,
+			   unsigned int tx_len, enum stm32_async_rx rx,
+			   uint8_t *rx_buf, unsigned int rx_len, int timeout)
+{
+	struct stm32_async_phase *ph;
+	uint8_t *tmp;
+
+	if (a->n_ph == STM32_ASYNC_PHASES)
+		return -1;
+	if (a->tx_used + tx_len > a->tx_size) {
+		tmp = realloc(a->tx, a->tx_used + tx_len);
+		if (!tmp)
+			return -1;
+		a->tx = tmp;
+		a->tx_size = a->tx_used + tx_len;
+	}
+	ph = &a->ph[a->n_ph++];
+	ph->tx_off = a->tx_used;
+	ph->tx_len = tx_len;
+	if (tx_len)
+		memcpy(a->tx + a->tx_used, tx, tx_len);
+	a->tx_used += tx_len;
+	ph->rx = rx;
+	ph->rx_buf = rx_buf;
+	ph->rx_len = rx_len;
+	ph->timeout = timeout ? timeout : a->timeout;
+	return 0;
+}
+
+static int stm32_async_cmd(stm32_async_t *a, uint8_t cmd, int timeout)
+{
+	uint8_t buf[2] = { cmd, cmd ^ 0xFF };
+
+	return stm32_async_add(a, buf, 2, RX_ACK, NULL, 0, timeout);
+}
+
+static int stm32_async_addr(stm32_async_t *a, uint32_t address)
+{
+	uint8_t buf[5];
+
+	buf[0] = address >> 24;
+	buf[1] = (address >> 16) & 0xFF;
+	buf[2] = (address >> 8) & 0xFF;
+	buf[3] = address & 0xFF;
+	buf[4] = buf[0] ^ buf[1] ^ buf[2] ^ buf[3];
+	return stm32_async_add(a, buf, 5, RX_ACK, NULL, 0, 0);
+}
+
+static stm32_err_t stm32_async_start(stm32_async_t *a,
+				     int (*next)(stm32_async_t *a))
+{
+	a->next = next;
+	a->err = STM32_ERR_OK;
+	a->state = STM32_ASYNC_BUSY;
+	a->deadline = stm32_async_now() + a->ph[0].timeout;
+	return STM32_ERR_OK;
+}
+
+static stm32_async_state_t stm32_async_fail(stm32_async_t *a, stm32_err_t err)
+{
+	a->err = err;
+	a->state = STM32_ASYNC_FAILED;
+	return a->state;
+}
+
+static unsigned int stm32_async_need(const stm32_async_t *a,
+				     const struct stm32_async_phase *ph)
+{
+	switch (ph->rx) {
+	case RX_DATA:
+		return ph->rx_len;
+	case RX_LEN:
+		return a->rx_done ? ph->rx_buf[0] + 2 : 1;
+	default:
+		return 1;
+	}
+}
+
+/* the phase got its reply: 1 to go on, 0 to wait again, -1 on error */
+static int stm32_async_check(stm32_async_t *a,
+			     const struct stm32_async_phase *ph)
+{
+	if (ph->rx == RX_SYNC)
+		return (a->ack == STM32_ACK || a->ack == STM32_NACK) ? 1 : -1;
+	if (ph->rx != RX_ACK)
+		return 1;
+	if (a->ack == STM32_ACK)
+		return 1;
+	if (a->ack == STM32_BUSY) {
+		a->rx_done = 0;
+		return 0;
+	}
+	a->err = a->ack == STM32_NACK ? STM32_ERR_NACK : STM32_ERR_UNKNOWN;
+	return -1;
+}
+
+stm32_async_state_t stm32_async_step(stm32_async_t *a)
+{
+	struct stm32_async_phase *ph;
+	uint8_t *dst;
+	size_t n;
+	int r;
+
+	while (a->state == STM32_ASYNC_BUSY) {
+		ph = &a->ph[a->cur];
+		if (a->tx_sent < ph->tx_len) {
+			n = ph->tx_len - a->tx_sent;
+			if (a->port->write_nb(a->port,
+					      a->tx + ph->tx_off + a->tx_sent,
+					      &n) != PORT_ERR_OK)
+				return stm32_async_fail(a, STM32_ERR_UNKNOWN);
+			a->tx_sent += n;
+			if (a->tx_sent < ph->tx_len) {
+				if (stm32_async_now() >= a->deadline)
+					return stm32_async_fail(a, STM32_ERR_UNKNOWN);
+				return a->state;
+			}
+			a->deadline = stm32_async_now() + ph->timeout;
+		}
+
+		dst = ph->rx == RX_ACK || ph->rx == RX_SYNC ? &a->ack : ph->rx_buf;
+		n = stm32_async_need(a, ph) - a->rx_done;
+		if (a->port->read_nb(a->port, dst + a->rx_done, &n) != PORT_ERR_OK)
+			return stm32_async_fail(a, STM32_ERR_UNKNOWN);
+		if (!n) {
+			if (stm32_async_now() < a->deadline)
+				return a->state;
+			/* the init byte may have completed a stale command */
+			if (ph->rx == RX_SYNC && !a->resync) {
+				a->resync = 1;
+				a->tx_sent = 0;
+				continue;
+			}
+			return stm32_async_fail(a, STM32_ERR_UNKNOWN);
+		}
+		a->rx_done += n;
+		if (a->rx_done < stm32_async_need(a, ph))
+			continue;
+
+		r = stm32_async_check(a, ph);
+		if (r < 0)
+			return stm32_async_fail(a, a->err ? a->err : STM32_ERR_UNKNOWN);
+		if (!r)
+			continue;
+
+		a->tx_sent = 0;
+		a->rx_done = 0;
+		if (++a->cur < a->n_ph) {
+			a->deadline = stm32_async_now() + a->ph[a->cur].timeout;
+			continue;
+		}
+		r = a->next ? a->next(a) : 0;
+		if (r < 0)
+			return stm32_async_fail(a, STM32_ERR_UNKNOWN);
+		if (!r) {
+			a->state = STM32_ASYNC_IDLE;
+			break;
+		}
+		a->deadline = stm32_async_now() + a->ph[0].timeout;
+	}
+	return a->state;
+}
+
+static int stm32_async_init_gid(stm32_async_t *a)
+{
+	return stm32_parse_gid(a->stm, a->gid) == STM32_ERR_OK ? 0 : -1;
+}
+
+static int stm32_async_init_get(stm32_async_t *a)
+{
+	stm32_t *stm = a->stm;
+	int etx = a->port->flags & PORT_GVR_ETX;
+
+	stm->version = a->gvr[0];
+	stm->option1 = etx ? a->gvr[1] : 0;
+	stm->option2 = etx ? a->gvr[2] : 0;
+	stm32_parse_get(stm, a->get);
+	if (stm->cmd->get == STM32_CMD_ERR
+	    || stm->cmd->gvr == STM32_CMD_ERR
+	    || stm->cmd->gid == STM32_CMD_ERR)
+		return -1;
+
+	stm32_async_clear(a);
+	if (stm32_async_cmd(a, stm->cmd->gid, 0)
+	    || stm32_async_add(a, NULL, 0, RX_LEN, a->gid, 0, 0)
+	    || stm32_async_add(a, NULL, 0, RX_ACK, NULL, 0, 0))
+		return -1;
+	a->next = stm32_async_init_gid;
+	return 1;
+}
+
+/* sync, then GVR, GET and GID; the target is ready when it completes */
+stm32_err_t stm32_async_init(stm32_async_t *a, const char init)
+{
+	uint8_t cmd = STM32_CMD_INIT;
+
+	if (a->state == STM32_ASYNC_BUSY)
+		return STM32_ERR_UNKNOWN;
+
+	stm32_close(a->stm);
+	a->stm = stm32_alloc(a->port);
+	if (!a->stm)
+		return STM32_ERR_UNKNOWN;
+
+	stm32_async_clear(a);
+	if ((init && (a->port->flags & PORT_CMD_INIT)
+	     && stm32_async_add(a, &cmd, 1, RX_SYNC, NULL, 0, 0))
+	    || stm32_async_cmd(a, STM32_CMD_GVR, 0)
+	    || stm32_async_add(a, NULL, 0, RX_DATA, a->gvr,
+			       (a->port->flags & PORT_GVR_ETX) ? 3 : 1, 0)
+	    || stm32_async_add(a, NULL, 0, RX_ACK, NULL, 0, 0)
+	    || stm32_async_cmd(a, STM32_CMD_GET, 0)
+	    || stm32_async_add(a, NULL, 0, RX_LEN, a->get, 0, 0)
+	    || stm32_async_add(a, NULL, 0, RX_ACK, NULL, 0, 0))
+		return STM32_ERR_UNKNOWN;
+	return stm32_async_start(a, stm32_async_init_get);
+}
+
+/* checks shared by the commands that need an initialized target */
+static stm32_err_t stm32_async_ready(stm32_async_t *a, uint8_t cmd)
+{
+	if (a->state == STM32_ASYNC_BUSY || !a->stm || !a->stm->dev)
+		return STM32_ERR_UNKNOWN;
+	if (cmd == STM32_CMD_ERR)
+		return STM32_ERR_NO_CMD;
+	stm32_async_clear(a);
+	return STM32_ERR_OK;
+}
+
+stm32_err_t stm32_async_read_memory(stm32_async_t *a, uint32_t address,
+				    uint8_t data[], unsigned int len)
+{
+	stm32_err_t s_err;
+
+	if (!len || len > 256)
+		return STM32_ERR_UNKNOWN;
+	s_err = stm32_async_ready(a, a->stm ? a->stm->cmd->rm : STM32_CMD_ERR);
+	if (s_err != STM32_ERR_OK)
+		return s_err;
+
+	if (stm32_async_cmd(a, a->stm->cmd->rm, 0)
+	    || stm32_async_addr(a, address)
+	    || stm32_async_cmd(a, len - 1, 0)
+	    || stm32_async_add(a, NULL, 0, RX_DATA, data, len, 0))
+		return STM32_ERR_UNKNOWN;
+	return stm32_async_start(a, NULL);
+}
+
+stm32_err_t stm32_async_write_memory(stm32_async_t *a, uint32_t address,
+				     const uint8_t data[], unsigned int len)
+{
+	uint8_t cs, buf[256 + 2];
+	unsigned int i, aligned_len;
+	stm32_err_t s_err;
+
+	if (!len || len > 256 || (address & 0x3))
+		return STM32_ERR_UNKNOWN;
+	s_err = stm32_async_ready(a, a->stm ? a->stm->cmd->wm : STM32_CMD_ERR);
+	if (s_err != STM32_ERR_OK)
+		return s_err;
+
+	aligned_len = (len + 3) & ~3;
+	cs = aligned_len - 1;
+	buf[0] = aligned_len - 1;
+	for (i = 0; i < len; i++) {
+		cs ^= data[i];
+		buf[i + 1] = data[i];
+	}
+	/* padding data */
+	for (i = len; i < aligned_len; i++) {
+		cs ^= 0xFF;
+		buf[i + 1] = 0xFF;
+	}
+	buf[aligned_len + 1] = cs;
+
+	if (stm32_async_cmd(a, a->stm->cmd->wm, 0)
+	    || stm32_async_addr(a, address)
+	    || stm32_async_add(a, buf, aligned_len + 2, RX_ACK, NULL, 0,
+			       STM32_BLKWRITE_TIMEOUT * 1000))
+		return STM32_ERR_UNKNOWN;
+	return stm32_async_start(a, NULL);
+}
+
+/* one erase command for up to 512 pages, see stm32_erase_memory() */
+static int stm32_async_erase_next(stm32_async_t *a)
+{
+	uint32_t n;
+	unsigned int len;
+	uint8_t *buf;
+	int r;
+
+	if (!a->pages)
+		return 0;
+
+	n = (a->pages <= 512) ? a->pages : 512;
+	buf = stm32_pages_erase_frame(a->stm, NULL, a->spage, n, &len);
+	if (!buf)
+		return -1;
+	stm32_async_clear(a);
+	r = stm32_async_cmd(a, a->stm->cmd->er, 0)
+	    || stm32_async_add(a, buf, len, RX_ACK, NULL, 0,
+			       n * STM32_PAGEERASE_TIMEOUT * 1000);
+	free(buf);
+	if (r)
+		return -1;
+	a->spage += n;
+	a->pages -= n;
+	return 1;
+}
+
+stm32_err_t stm32_async_erase_memory(stm32_async_t *a, uint32_t spage,
+				     uint32_t pages)
+{
+	static const uint8_t mass_ee[] = { 0xFF, 0xFF, 0x00 };
+	static const uint8_t mass_er[] = { 0xFF, 0x00 };
+	stm32_t *stm = a->stm;
+	stm32_err_t s_err;
+
+	if (!pages || spage > STM32_MAX_PAGES ||
+	    ((pages != STM32_MASS_ERASE) && ((spage + pages) > STM32_MAX_PAGES)))
+		return STM32_ERR_UNKNOWN;
+	s_err = stm32_async_ready(a, stm ? stm->cmd->er : STM32_CMD_ERR);
+	if (s_err != STM32_ERR_OK)
+		return s_err;
+
+	if (pages == STM32_MASS_ERASE) {
+		pages = stm32_flash_addr_to_page_ceil(stm, stm->dev->fl_end);
+		if (stm32_mass_erase_faster(stm, NULL, pages)) {
+			if (stm32_async_cmd(a, stm->cmd->er, 0))
+				return STM32_ERR_UNKNOWN;
+			if (stm->cmd->er == STM32_CMD_ER
+			    ? stm32_async_add(a, mass_er, 2, RX_ACK, NULL, 0,
+					      STM32_MASSERASE_TIMEOUT * 1000)
+			    : stm32_async_add(a, mass_ee, 3, RX_ACK, NULL, 0,
+					      STM32_MASSERASE_TIMEOUT * 1000))
+				return STM32_ERR_UNKNOWN;
+			return stm32_async_start(a, NULL);
+		}
+	}
+
+	a->spage = spage;
+	a->pages = pages;
+	if (stm32_async_erase_next(a) < 0)
+		return STM32_ERR_UNKNOWN;
+	return stm32_async_start(a, stm32_async_erase_next);
+}
+
+static int stm32_async_crc_done(stm32_async_t *a)
+{
+	uint8_t *buf = a->crc;
+
+	if (buf[4] != (buf[0] ^ buf[1] ^ buf[2] ^ buf[3]))
+		return -1;
+	a->crc_val = (buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+	return 0;
+}
+
+/* result with stm32_async_crc() */
+stm32_err_t stm32_async_crc_memory(stm32_async_t *a, uint32_t address,
+				   uint32_t length)
+{
+	stm32_err_t s_err;
+
+	if ((address & 0x3) || (length & 0x3))
+		return STM32_ERR_UNKNOWN;
+	s_err = stm32_async_ready(a, a->stm ? a->stm->cmd->crc : STM32_CMD_ERR);
+	if (s_err != STM32_ERR_OK)
+		return s_err;
+
+	if (stm32_async_cmd(a, a->stm->cmd->crc, 0)
+	    || stm32_async_addr(a, address)
+	    || stm32_async_addr(a, length)
+	    || stm32_async_add(a, NULL, 0, RX_ACK, NULL, 0, 0)
+	    || stm32_async_add(a, NULL, 0, RX_DATA, a->crc, 5, 0))
+		return STM32_ERR_UNKNOWN;
+	return stm32_async_start(a, stm32_async_crc_done);
+}
+
+stm32_err_t stm32_async_go(stm32_async_t *a, uint32_t address)
+{
+	stm32_err_t s_err;
+
+	s_err = stm32_async_ready(a, a->stm ? a->stm->cmd->go : STM32_CMD_ERR);
+	if (s_err != STM32_ERR_OK)
+		return s_err;
+
+	if (stm32_async_cmd(a, a->stm->cmd->go, 0)
+	    || stm32_async_addr(a, address))
+		return STM32_ERR_UNKNOWN;
+	return stm32_async_start(a, NULL);
+}
@@ -45,6 +45,7 @@ typedef enum {
 typedef struct stm32		stm32_t;
 typedef struct stm32_cmd	stm32_cmd_t;
 typedef struct stm32_dev	stm32_dev_t;
+typedef struct stm32_erase_time	stm32_erase_time_t;
 
 struct stm32 {
 	const serial_t		*serial;
@@ -67,9 +68,27 @@ struct stm32_dev {
 	uint32_t	opt_start, opt_end;
 	uint32_t	mem_start, mem_end;
 	uint32_t	flags;
+	const stm32_erase_time_t *et;	// erase time model
+	uint32_t	bank2;	// start of bank 2, 0 if single bank
 };
 
+/* ms, page erase: page + kib * page KiB, mass erase: mass + mass_kib * flash KiB */
+struct stm32_erase_time {
+	uint16_t	page, kib;
+	uint16_t	mass, mass_kib;
+};
+
+/* raw bootloader replies, enough to skip GVR and GET on the next init */
+struct stm32_caps {
+	uint8_t		gvr[3];		/* version, option 1, option 2 */
+	uint8_t		get[257];	/* count - 1, version, commands */
+	uint8_t		gid[257];	/* count - 1, product ID */
+};
+
+stm32_err_t stm32_wait_ready(struct port_interface *port, unsigned int timeout);
 stm32_t *stm32_init(struct port_interface *port, const char init);
+stm32_t *stm32_init_caps(struct port_interface *port, const char init,
+			 struct stm32_caps *caps, int *cached);
 void stm32_close(stm32_t *stm);
 stm32_err_t stm32_read_memory(const stm32_t *stm, uint32_t address,
 			      uint8_t data[], unsigned int len);
@@ -79,15 +98,75 @@ stm32_err_t stm32_wunprot_memory(const stm32_t *stm);
 stm32_err_t stm32_wprot_memory(const stm32_t *stm);
 stm32_err_t stm32_erase_memory(const stm32_t *stm, uint32_t spage,
 			       uint32_t pages);
+stm32_err_t stm32_erase_page_list(const stm32_t *stm, const uint32_t *list,
+				  uint32_t pages);
+int stm32_mass_erase_faster(const stm32_t *stm, const uint32_t *list,
+			    uint32_t pages);
+stm32_err_t stm32_erase_fastest(const stm32_t *stm, const uint32_t *list,
+				uint32_t pages, uint32_t start, uint32_t end);
 stm32_err_t stm32_go(const stm32_t *stm, uint32_t address);
 stm32_err_t stm32_reset_device(const stm32_t *stm);
 stm32_err_t stm32_readprot_memory(const stm32_t *stm);
 stm32_err_t stm32_runprot_memory(const stm32_t *stm);
+int stm32_has_crc(const stm32_t *stm);
 stm32_err_t stm32_crc_memory(const stm32_t *stm, uint32_t address,
 			     uint32_t length, uint32_t *crc);
 stm32_err_t stm32_crc_wrapper(const stm32_t *stm, uint32_t address,
 			      uint32_t length, uint32_t *crc);
 uint32_t stm32_sw_crc(uint32_t crc, uint8_t *buf, unsigned int len);
+stm32_err_t stm32_read_uid(const stm32_t *stm, uint8_t uid[12]);
+int stm32_addr_in_ram(const stm32_t *stm, uint32_t addr);
+int stm32_addr_in_flash(const stm32_t *stm, uint32_t addr);
+int stm32_addr_in_opt_bytes(const stm32_t *stm, uint32_t addr);
+int stm32_addr_in_sysmem(const stm32_t *stm, uint32_t addr);
+int stm32_flash_addr_to_page_floor(const stm32_t *stm, uint32_t addr);
+int stm32_flash_addr_to_page_ceil(const stm32_t *stm, uint32_t addr);
+uint32_t stm32_flash_page_to_addr(const stm32_t *stm, int page);
+void stm32_bcast_write_memory(stm32_t *const stm[], int n, stm32_err_t err[],
+			      uint32_t address, const uint8_t data[],
+			      unsigned int len);
+void stm32_bcast_read_memory(stm32_t *const stm[], int n, stm32_err_t err[],
+			     uint32_t address, uint8_t *const data[],
+			     unsigned int len);
+void stm32_bcast_erase_memory(stm32_t *const stm[], int n, stm32_err_t err[],
+			      uint32_t spage, uint32_t pages);
+
+/*
+ * Non-blocking form of the core commands, for event loops driving many
+ * targets from one thread. A command is started, then stm32_async_step()
+ * is called each time the descriptor is ready for stm32_async_events()
+ * or stm32_async_timeout() ms have passed, until it is no longer busy.
+ */
+typedef struct stm32_async	stm32_async_t;
+
+typedef enum {
+	STM32_ASYNC_IDLE = 0,	/* nothing running, the last command succeeded */
+	STM32_ASYNC_BUSY,
+	STM32_ASYNC_FAILED,
+} stm32_async_state_t;
+
+#define STM32_ASYNC_READ	(1 << 0)
+#define STM32_ASYNC_WRITE	(1 << 1)
+
+stm32_async_t *stm32_async_new(struct port_interface *port, int timeout);
+void stm32_async_free(stm32_async_t *a);
+int stm32_async_fd(const stm32_async_t *a);
+int stm32_async_events(const stm32_async_t *a);
+int stm32_async_timeout(const stm32_async_t *a);
+stm32_async_state_t stm32_async_step(stm32_async_t *a);
+stm32_err_t stm32_async_error(const stm32_async_t *a);
+stm32_t *stm32_async_target(const stm32_async_t *a);
+uint32_t stm32_async_crc(const stm32_async_t *a);
+stm32_err_t stm32_async_init(stm32_async_t *a, const char init);
+stm32_err_t stm32_async_read_memory(stm32_async_t *a, uint32_t address,
+				    uint8_t data[], unsigned int len);
+stm32_err_t stm32_async_write_memory(stm32_async_t *a, uint32_t address,
+				     const uint8_t data[], unsigned int len);
+stm32_err_t stm32_async_erase_memory(stm32_async_t *a, uint32_t spage,
+				     uint32_t pages);
+stm32_err_t stm32_async_crc_memory(stm32_async_t *a, uint32_t address,
+				   uint32_t length);
+stm32_err_t stm32_async_go(stm32_async_t *a, uint32_t address);
 
 #endif
 
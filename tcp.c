@@ -0,0 +1,673 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "serial.h"
+#include "port.h"
+#include "stm32.h"
+
+
+#if defined(__WIN32__)
+
+static port_err_t tcp_open(struct port_interface *port,
+			   struct port_options *ops)
+{
+	return PORT_ERR_NODEV;
+}
+
+struct port_interface port_tcp = {
+	.name	= "tcp",
+	.open	= tcp_open,
+};
+
+#else
+
+#include <netdb.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#ifndef TCP_TIMEOUT_MS
+#define TCP_TIMEOUT_MS 500
+#endif
+
+#define TCP_PREFIX	"tcp://"
+#define RFC2217_PREFIX	"rfc2217://"
+
+/* telnet (RFC 854) */
+#define TN_SE		240
+#define TN_SB		250
+#define TN_WILL		251
+#define TN_WONT		252
+#define TN_DO		253
+#define TN_DONT		254
+#define TN_IAC		255
+
+#define TNOPT_BINARY	0
+#define TNOPT_SGA	3
+#define TNOPT_COMPORT	44
+
+/* RFC 2217 client to access server commands */
+#define CPO_SET_BAUDRATE	1
+#define CPO_SET_DATASIZE	2
+#define CPO_SET_PARITY		3
+#define CPO_SET_STOPSIZE	4
+#define CPO_SET_CONTROL		5
+#define CPO_PURGE_DATA		12
+
+#define CPO_CONTROL_BREAK_ON	5
+#define CPO_CONTROL_BREAK_OFF	6
+#define CPO_CONTROL_DTR_ON	8
+#define CPO_CONTROL_DTR_OFF	9
+#define CPO_CONTROL_RTS_ON	11
+#define CPO_CONTROL_RTS_OFF	12
+
+#define CPO_PURGE_RX		1
+
+/* state of the telnet parser, kept across read() calls */
+enum tn_state {
+	TN_DATA,
+	TN_CMD,		/* after IAC */
+	TN_OPT,		/* after IAC WILL/WONT/DO/DONT */
+	TN_SUB,		/* inside IAC SB ... */
+	TN_SUB_IAC,	/* IAC inside IAC SB ... */
+};
+
+struct tcp_priv {
+	int fd;
+	int rfc2217;
+	int timeout;	/* ms */
+	enum tn_state state;
+	uint8_t verb;
+	char setup_str[300];
+};
+
+/*
+ * Every frame is sent with a single send(); with Nagle disabled it leaves
+ * the host as a single segment, which is what the bootloader protocol
+ * expects before waiting for the ACK.
+ */
+static port_err_t tcp_send(struct tcp_priv *h, const uint8_t *buf,
+			   size_t nbyte)
+{
+	ssize_t r;
+
+	while (nbyte) {
+		r = send(h->fd, buf, nbyte, MSG_NOSIGNAL);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 1)
+			return PORT_ERR_UNKNOWN;
+		nbyte -= r;
+		buf += r;
+	}
+	return PORT_ERR_OK;
+}
+
+static port_err_t tcp_telnet_cmd(struct tcp_priv *h, uint8_t verb,
+				 uint8_t opt)
+{
+	uint8_t buf[3] = { TN_IAC, verb, opt };
+
+	return tcp_send(h, buf, sizeof(buf));
+}
+
+/* send IAC SB COM-PORT-OPTION <cmd> <val> IAC SE, escaping IAC in val */
+static port_err_t tcp_comport_cmd(struct tcp_priv *h, uint8_t cmd,
+				  const uint8_t *val, size_t len)
+{
+	uint8_t buf[4 + 2 * 4 + 2];
+	size_t i, n = 0;
+
+	if (len > 4)
+		return PORT_ERR_UNKNOWN;
+
+	buf[n++] = TN_IAC;
+	buf[n++] = TN_SB;
+	buf[n++] = TNOPT_COMPORT;
+	buf[n++] = cmd;
+	for (i = 0; i < len; i++) {
+		buf[n++] = val[i];
+		if (val[i] == TN_IAC)
+			buf[n++] = TN_IAC;
+	}
+	buf[n++] = TN_IAC;
+	buf[n++] = TN_SE;
+	return tcp_send(h, buf, n);
+}
+
+static port_err_t tcp_comport_byte(struct tcp_priv *h, uint8_t cmd,
+				   uint8_t val)
+{
+	return tcp_comport_cmd(h, cmd, &val, 1);
+}
+
+/*
+ * Answer an option negotiation from the access server.
+ * We only agree on the options we have requested ourselves, everything
+ * else is refused; acknowledges of our own requests need no reply.
+ */
+static port_err_t tcp_telnet_negotiate(struct tcp_priv *h, uint8_t verb,
+				       uint8_t opt)
+{
+	int ours = (opt == TNOPT_BINARY || opt == TNOPT_SGA
+		    || opt == TNOPT_COMPORT);
+
+	if (ours)
+		return PORT_ERR_OK;
+	if (verb == TN_DO)
+		return tcp_telnet_cmd(h, TN_WONT, opt);
+	if (verb == TN_WILL)
+		return tcp_telnet_cmd(h, TN_DONT, opt);
+	return PORT_ERR_OK;
+}
+
+/* wait until the socket is readable, PORT_ERR_TIMEDOUT if it does not */
+static port_err_t tcp_wait(struct tcp_priv *h, int timeout)
+{
+	struct pollfd pfd;
+	int r;
+
+	pfd.fd = h->fd;
+	pfd.events = POLLIN;
+	do {
+		r = poll(&pfd, 1, timeout);
+	} while (r < 0 && errno == EINTR);
+
+	if (r < 0)
+		return PORT_ERR_UNKNOWN;
+	if (r == 0)
+		return PORT_ERR_TIMEDOUT;
+	return PORT_ERR_OK;
+}
+
+/*
+ * Strip the telnet protocol from the received bytes in place.
+ * Returns the amount of payload left in buf.
+ */
+static ssize_t tcp_telnet_filter(struct tcp_priv *h, uint8_t *buf, ssize_t n)
+{
+	ssize_t i, out = 0;
+	uint8_t c;
+
+	for (i = 0; i < n; i++) {
+		c = buf[i];
+		switch (h->state) {
+		case TN_DATA:
+			if (c == TN_IAC)
+				h->state = TN_CMD;
+			else
+				buf[out++] = c;
+			break;
+		case TN_CMD:
+			if (c == TN_IAC) {
+				buf[out++] = c;
+				h->state = TN_DATA;
+			} else if (c >= TN_WILL) {
+				h->verb = c;
+				h->state = TN_OPT;
+			} else if (c == TN_SB) {
+				h->state = TN_SUB;
+			} else {
+				h->state = TN_DATA;
+			}
+			break;
+		case TN_OPT:
+			tcp_telnet_negotiate(h, h->verb, c);
+			h->state = TN_DATA;
+			break;
+		case TN_SUB:
+			/* notifications from the server are ignored */
+			if (c == TN_IAC)
+				h->state = TN_SUB_IAC;
+			break;
+		case TN_SUB_IAC:
+			h->state = (c == TN_SE) ? TN_DATA : TN_SUB;
+			break;
+		}
+	}
+	return out;
+}
+
+static port_err_t tcp_setup_rfc2217(struct tcp_priv *h,
+				    struct port_options *ops)
+{
+	unsigned int baud;
+	size_t len;
+	uint8_t val[4];
+	uint8_t parity, stopsize;
+
+	baud = serial_get_baud_int(ops->baudRate);
+	val[0] = baud >> 24;
+	val[1] = (baud >> 16) & 0xFF;
+	val[2] = (baud >> 8) & 0xFF;
+	val[3] = baud & 0xFF;
+
+	switch (serial_get_parity(ops->serial_mode)) {
+	case SERIAL_PARITY_NONE: parity = 1; break;
+	case SERIAL_PARITY_ODD:  parity = 2; break;
+	case SERIAL_PARITY_EVEN: parity = 3; break;
+	default:
+		return PORT_ERR_UNKNOWN;
+	}
+
+	switch (serial_get_stopbit(ops->serial_mode)) {
+	case SERIAL_STOPBIT_1: stopsize = 1; break;
+	case SERIAL_STOPBIT_2: stopsize = 2; break;
+	default:
+		return PORT_ERR_UNKNOWN;
+	}
+
+	if (tcp_telnet_cmd(h, TN_WILL, TNOPT_BINARY) != PORT_ERR_OK
+	    || tcp_telnet_cmd(h, TN_DO, TNOPT_BINARY) != PORT_ERR_OK
+	    || tcp_telnet_cmd(h, TN_WILL, TNOPT_SGA) != PORT_ERR_OK
+	    || tcp_telnet_cmd(h, TN_DO, TNOPT_SGA) != PORT_ERR_OK
+	    || tcp_telnet_cmd(h, TN_WILL, TNOPT_COMPORT) != PORT_ERR_OK)
+		return PORT_ERR_UNKNOWN;
+
+	if (tcp_comport_cmd(h, CPO_SET_BAUDRATE, val, 4) != PORT_ERR_OK
+	    || tcp_comport_byte(h, CPO_SET_DATASIZE,
+			serial_get_bits_int(serial_get_bits(ops->serial_mode)))
+	       != PORT_ERR_OK
+	    || tcp_comport_byte(h, CPO_SET_PARITY, parity) != PORT_ERR_OK
+	    || tcp_comport_byte(h, CPO_SET_STOPSIZE, stopsize) != PORT_ERR_OK)
+		return PORT_ERR_UNKNOWN;
+
+	len = strlen(h->setup_str);
+	snprintf(h->setup_str + len, sizeof(h->setup_str) - len, " %u %d%c%d",
+		 baud,
+		 serial_get_bits_int(serial_get_bits(ops->serial_mode)),
+		 serial_get_parity_str(serial_get_parity(ops->serial_mode)),
+		 serial_get_stopbit_int(serial_get_stopbit(ops->serial_mode)));
+	return PORT_ERR_OK;
+}
+
+static port_err_t tcp_open(struct port_interface *port,
+			   struct port_options *ops)
+{
+	struct tcp_priv *h;
+	struct addrinfo hints, *res, *ai;
+	const char *addr, *colon;
+	char host[256];
+	int fd = -1, rfc2217, one = 1;
+	size_t len;
+
+	/* 1. check device name match */
+	if (!strncmp(ops->device, TCP_PREFIX, strlen(TCP_PREFIX))) {
+		addr = ops->device + strlen(TCP_PREFIX);
+		rfc2217 = 0;
+	} else if (!strncmp(ops->device, RFC2217_PREFIX,
+			    strlen(RFC2217_PREFIX))) {
+		addr = ops->device + strlen(RFC2217_PREFIX);
+		rfc2217 = 1;
+	} else
+		return PORT_ERR_NODEV;
+
+	/* 2. check options: "host:port", "[ipv6]:port" */
+	colon = strrchr(addr, ':');
+	if (colon == NULL || colon[1] == '\0') {
+		fprintf(stderr, "TCP port number missing in \"%s\"\n",
+			ops->device);
+		return PORT_ERR_UNKNOWN;
+	}
+	len = colon - addr;
+	if (len && addr[0] == '[' && addr[len - 1] == ']') {
+		addr++;
+		len -= 2;
+	}
+	if (len == 0 || len >= sizeof(host)) {
+		fprintf(stderr, "Invalid TCP host in \"%s\"\n", ops->device);
+		return PORT_ERR_UNKNOWN;
+	}
+	memcpy(host, addr, len);
+	host[len] = '\0';
+
+	/* 3. open it */
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, colon + 1, &hints, &res)) {
+		fprintf(stderr, "Cannot resolve \"%s\"\n", ops->device);
+		return PORT_ERR_UNKNOWN;
+	}
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd < 0) {
+		fprintf(stderr, "Unable to connect to \"%s\"\n", ops->device);
+		return PORT_ERR_UNKNOWN;
+	}
+
+	/* 4. set options */
+	if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)))
+		fprintf(stderr, "Warning: cannot disable Nagle on %s\n",
+			ops->device);
+
+	h = calloc(sizeof(*h), 1);
+	if (h == NULL) {
+		fprintf(stderr, "End of memory\n");
+		close(fd);
+		return PORT_ERR_UNKNOWN;
+	}
+	h->fd = fd;
+	h->rfc2217 = rfc2217;
+	h->timeout = ops->rx_timeout ? ops->rx_timeout : TCP_TIMEOUT_MS;
+	h->state = TN_DATA;
+	snprintf(h->setup_str, sizeof(h->setup_str), "%s:%s", host, colon + 1);
+
+	if (rfc2217 && tcp_setup_rfc2217(h, ops) != PORT_ERR_OK) {
+		fprintf(stderr, "RFC 2217 setup failed on \"%s\"\n",
+			ops->device);
+		close(fd);
+		free(h);
+		return PORT_ERR_UNKNOWN;
+	}
+
+	port->private = h;
+	return PORT_ERR_OK;
+}
+
+static port_err_t tcp_close(struct port_interface *port)
+{
+	struct tcp_priv *h;
+
+	h = (struct tcp_priv *)port->private;
+	if (h == NULL)
+		return PORT_ERR_UNKNOWN;
+	close(h->fd);
+	free(h);
+	port->private = NULL;
+	return PORT_ERR_OK;
+}
+
+static port_err_t tcp_read(struct port_interface *port, void *buf,
+			   size_t nbyte)
+{
+	struct tcp_priv *h;
+	uint8_t *pos = (uint8_t *)buf;
+	port_err_t p_err;
+	ssize_t r;
+
+	h = (struct tcp_priv *)port->private;
+	if (h == NULL)
+		return PORT_ERR_UNKNOWN;
+
+	/*
+	 * With telnet, escaped IAC makes the stream longer than the payload;
+	 * read at most what is still missing and filter it in place.
+	 */
+	while (nbyte) {
+		p_err = tcp_wait(h, h->timeout);
+		if (p_err != PORT_ERR_OK)
+			return p_err;
+		r = recv(h->fd, pos, nbyte, 0);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 1)
+			return PORT_ERR_UNKNOWN;
+		if (h->rfc2217)
+			r = tcp_telnet_filter(h, pos, r);
+
+		nbyte -= r;
+		pos += r;
+	}
+	return PORT_ERR_OK;
+}
+
+/*
+ * Escape IAC, keeping the whole frame in one send(). The frame is built
+ * in stack_frame (2 * STM32_MAX_TX_FRAME) unless it is too big for it.
+ */
+static uint8_t *tcp_escape(const uint8_t *data, size_t nbyte,
+			   uint8_t *stack_frame, size_t *len)
+{
+	uint8_t *frame = stack_frame;
+	size_t i, n;
+
+	if (nbyte > STM32_MAX_TX_FRAME) {
+		/* page lists of extended erase */
+		frame = malloc(2 * nbyte);
+		if (frame == NULL)
+			return NULL;
+	}
+	for (i = 0, n = 0; i < nbyte; i++) {
+		frame[n++] = data[i];
+		if (data[i] == TN_IAC)
+			frame[n++] = TN_IAC;
+	}
+	*len = n;
+	return frame;
+}
+
+static port_err_t tcp_write(struct port_interface *port, void *buf,
+			    size_t nbyte)
+{
+	struct tcp_priv *h;
+	uint8_t stack_frame[2 * STM32_MAX_TX_FRAME], *frame;
+	port_err_t p_err;
+	size_t n;
+
+	h = (struct tcp_priv *)port->private;
+	if (h == NULL)
+		return PORT_ERR_UNKNOWN;
+
+	if (!h->rfc2217)
+		return tcp_send(h, buf, nbyte);
+
+	frame = tcp_escape(buf, nbyte, stack_frame, &n);
+	if (frame == NULL)
+		return PORT_ERR_UNKNOWN;
+	p_err = tcp_send(h, frame, n);
+	if (frame != stack_frame)
+		free(frame);
+	return p_err;
+}
+
+static port_err_t tcp_gpio(struct port_interface *port, serial_gpio_t n,
+			   int level)
+{
+	struct tcp_priv *h;
+
+	h = (struct tcp_priv *)port->private;
+	if (h == NULL)
+		return PORT_ERR_UNKNOWN;
+
+	if (!h->rfc2217) {
+		fprintf(stderr, "Port signals need rfc2217:// on TCP\n");
+		return PORT_ERR_UNKNOWN;
+	}
+
+	switch (n) {
+	case GPIO_RTS:
+		return tcp_comport_byte(h, CPO_SET_CONTROL,
+			level ? CPO_CONTROL_RTS_ON : CPO_CONTROL_RTS_OFF);
+
+	case GPIO_DTR:
+		return tcp_comport_byte(h, CPO_SET_CONTROL,
+			level ? CPO_CONTROL_DTR_ON : CPO_CONTROL_DTR_OFF);
+
+	case GPIO_BRK:
+		if (level == 0)
+			return PORT_ERR_OK;
+		if (tcp_comport_byte(h, CPO_SET_CONTROL, CPO_CONTROL_BREAK_ON)
+		    != PORT_ERR_OK)
+			return PORT_ERR_UNKNOWN;
+		/* same duration as tcsendbreak(fd, 1) on Linux */
+		usleep(250000);
+		return tcp_comport_byte(h, CPO_SET_CONTROL,
+					CPO_CONTROL_BREAK_OFF);
+
+	default:
+		return PORT_ERR_UNKNOWN;
+	}
+}
+
+static const char *tcp_get_cfg_str(struct port_interface *port)
+{
+	struct tcp_priv *h;
+
+	h = (struct tcp_priv *)port->private;
+	return h ? h->setup_str : "INVALID";
+}
+
+static port_err_t tcp_flush(struct port_interface *port)
+{
+	struct tcp_priv *h;
+	uint8_t buf[256];
+	ssize_t r;
+
+	h = (struct tcp_priv *)port->private;
+	if (h == NULL)
+		return PORT_ERR_UNKNOWN;
+
+	if (h->rfc2217
+	    && tcp_comport_byte(h, CPO_PURGE_DATA, CPO_PURGE_RX) != PORT_ERR_OK)
+		return PORT_ERR_UNKNOWN;
+
+	/* drop whatever already reached the host */
+	do {
+		r = recv(h->fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (r > 0 && h->rfc2217)
+			tcp_telnet_filter(h, buf, r);
+	} while (r > 0);
+
+	return PORT_ERR_OK;
+}
+
+static int tcp_get_fd(struct port_interface *port)
+{
+	struct tcp_priv *h;
+
+	h = (struct tcp_priv *)port->private;
+	return h ? h->fd : -1;
+}
+
+/* telnet commands alone may leave no payload, that is not an error */
+static port_err_t tcp_read_nb(struct port_interface *port, void *buf,
+			      size_t *nbyte)
+{
+	struct tcp_priv *h;
+	ssize_t r;
+
+	h = (struct tcp_priv *)port->private;
+	if (h == NULL)
+		return PORT_ERR_UNKNOWN;
+
+	do {
+		r = recv(h->fd, buf, *nbyte, MSG_DONTWAIT);
+	} while (r < 0 && errno == EINTR);
+	if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		*nbyte = 0;
+		return PORT_ERR_OK;
+	}
+	if (r < 1)
+		return PORT_ERR_UNKNOWN;
+	if (h->rfc2217)
+		r = tcp_telnet_filter(h, buf, r);
+	*nbyte = r;
+	return PORT_ERR_OK;
+}
+
+/*
+ * Send what the socket takes now, *nbyte is the amount of payload gone.
+ * With RFC 2217 a send() ending between the two bytes of an escaped IAC
+ * is completed at once, the payload byte can't be half sent.
+ */
+static port_err_t tcp_write_nb(struct port_interface *port, void *buf,
+			       size_t *nbyte)
+{
+	struct tcp_priv *h;
+	const uint8_t *data = (const uint8_t *)buf;
+	uint8_t stack_frame[2 * STM32_MAX_TX_FRAME], *frame;
+	port_err_t p_err = PORT_ERR_OK;
+	size_t i, n, sent;
+	ssize_t r;
+
+	h = (struct tcp_priv *)port->private;
+	if (h == NULL)
+		return PORT_ERR_UNKNOWN;
+
+	frame = (uint8_t *)data;
+	n = *nbyte;
+	if (h->rfc2217) {
+		frame = tcp_escape(data, *nbyte, stack_frame, &n);
+		if (frame == NULL)
+			return PORT_ERR_UNKNOWN;
+	}
+
+	do {
+		r = send(h->fd, frame, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+	} while (r < 0 && errno == EINTR);
+	if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		r = 0;
+	if (r < 0) {
+		p_err = PORT_ERR_UNKNOWN;
+		goto out;
+	}
+	if (!h->rfc2217) {
+		*nbyte = r;
+		goto out;
+	}
+
+	for (i = 0, sent = 0; sent < (size_t)r; i++)
+		sent += data[i] == TN_IAC ? 2 : 1;
+	if (sent > (size_t)r)
+		p_err = tcp_send(h, &data[i - 1], 1);
+	*nbyte = i;
+out:
+	if (frame != data && frame != stack_frame)
+		free(frame);
+	return p_err;
+}
+
+struct port_interface port_tcp = {
+	.name	= "tcp",
+	.flags	= PORT_BYTE | PORT_GVR_ETX | PORT_CMD_INIT | PORT_RETRY,
+	.open	= tcp_open,
+	.close	= tcp_close,
+	.flush  = tcp_flush,
+	.read	= tcp_read,
+	.write	= tcp_write,
+	.gpio	= tcp_gpio,
+	.get_cfg_str	= tcp_get_cfg_str,
+	.get_fd	= tcp_get_fd,
+	.read_nb	= tcp_read_nb,
+	.write_nb	= tcp_write_nb,
+};
+
+#endif
@@ -0,0 +1,190 @@
+#!/usr/bin/env python3
+#
+# stm32flash - Open Source ST STM32 flash program for *nix
+#
+# Minimal loopback responder for the tcp:// and rfc2217:// back-ends.
+#
+# It listens on 127.0.0.1, plays a blank STM32F4 bootloader (INIT, GET,
+# GVR, GID and READ of erased flash) and, in RFC 2217 mode, checks that
+# the client escapes IAC in both directions and answers the telnet
+# option negotiation as RFC 854/2217 require.  Any violation is printed
+# and makes the responder exit with status 1.
+#
+# Usage:
+#	tools/tcp_responder.py [--rfc2217] [PORT]
+#	stm32flash -r out.bin -S 0x08000000:1024 rfc2217://127.0.0.1:PORT
+#
+# out.bin must then contain only 0xFF, every byte of which went through
+# the IAC escaping of both sides.
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation; either version 2
+# of the License, or (at your option) any later version.
+
+import socket
+import sys
+
+IAC, SB, SE = 255, 250, 240
+WILL, WONT, DO, DONT = 251, 252, 253, 254
+BINARY, SGA, TTYPE, COMPORT = 0, 3, 24, 44
+
+ACK, NACK = 0x79, 0x1F
+PID = 0x413
+COMMANDS = [0x00, 0x01, 0x02, 0x11, 0x21, 0x31, 0x44, 0x63, 0x73, 0x82, 0x92]
+
+
+class Violation(Exception):
+	pass
+
+
+class Link:
+	def __init__(self, conn, rfc2217):
+		self.conn = conn
+		self.rfc2217 = rfc2217
+		self.buf = bytearray()
+		self.options = set()
+		self.refused = False
+
+	def send(self, data):
+		data = bytes(data)
+		if self.rfc2217:
+			data = data.replace(b'\xff', b'\xff\xff')
+		self.conn.sendall(data)
+
+	def telnet(self, *cmd):
+		self.conn.sendall(bytes([IAC] + list(cmd)))
+
+	def fill(self):
+		data = self.conn.recv(4096)
+		if not data:
+			raise EOFError
+		self.buf += data
+
+	def take(self):
+		while not self.buf:
+			self.fill()
+		return self.buf.pop(0)
+
+	def byte(self):
+		"""Return the next payload byte, handling the telnet protocol."""
+		while True:
+			c = self.take()
+			if not self.rfc2217 or c != IAC:
+				return c
+			c = self.take()
+			if c == IAC:
+				return IAC
+			if c in (WILL, WONT, DO, DONT):
+				self.negotiate(c, self.take())
+			elif c == SB:
+				self.subnegotiate()
+			else:
+				raise Violation('unexpected telnet command %d' % c)
+
+	def negotiate(self, verb, opt):
+		if opt == TTYPE:
+			if verb != WONT:
+				raise Violation('option %d not refused' % opt)
+			self.refused = True
+			return
+		if opt not in (BINARY, SGA, COMPORT):
+			raise Violation('unexpected option %d' % opt)
+		if verb in (WILL, DO):
+			self.options.add((verb, opt))
+			self.telnet(DO if verb == WILL else WILL, opt)
+
+	def subnegotiate(self):
+		data = bytearray()
+		while True:
+			c = self.take()
+			if c == IAC:
+				c = self.take()
+				if c == SE:
+					break
+				if c != IAC:
+					raise Violation('unescaped IAC in subnegotiation')
+			data.append(c)
+		if len(data) < 2 or data[0] != COMPORT:
+			raise Violation('bad subnegotiation %s' % data.hex())
+		if (WILL, COMPORT) not in self.options:
+			raise Violation('COM-PORT-OPTION used before WILL')
+		print('com-port cmd %d value %s' % (data[1], data[2:].hex()))
+		# server replies carry the command code plus 100
+		reply = [IAC, SB, COMPORT, data[1] + 100]
+		for c in data[2:]:
+			reply += [c, IAC] if c == IAC else [c]
+		self.conn.sendall(bytes(reply + [IAC, SE]))
+
+
+def xor(data):
+	x = 0
+	for c in data:
+		x ^= c
+	return x
+
+
+def serve(link):
+	if link.rfc2217:
+		# an option nobody asked for must be refused
+		link.telnet(DO, TTYPE)
+	while True:
+		c = link.byte()
+		if c == 0x7F:
+			link.send([ACK])
+			continue
+		if link.byte() != c ^ 0xFF:
+			link.send([NACK])
+			continue
+		if c == 0x00:
+			link.send([ACK, len(COMMANDS), 0x31] + COMMANDS + [ACK])
+		elif c == 0x01:
+			link.send([ACK, 0x31, 0x00, 0x00, ACK])
+		elif c == 0x02:
+			link.send([ACK, 1, PID >> 8, PID & 0xFF, ACK])
+		elif c == 0x11:
+			link.send([ACK])
+			addr = [link.byte() for i in range(5)]
+			if xor(addr):
+				link.send([NACK])
+				continue
+			link.send([ACK])
+			n, cs = link.byte(), link.byte()
+			if n ^ cs != 0xFF:
+				link.send([NACK])
+				continue
+			link.send([ACK] + [0xFF] * (n + 1))
+		else:
+			link.send([NACK])
+
+
+def main():
+	rfc2217 = '--rfc2217' in sys.argv
+	args = [a for a in sys.argv[1:] if a != '--rfc2217']
+	port = int(args[0]) if args else 4001
+
+	srv = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+	srv.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+	srv.bind(('127.0.0.1', port))
+	srv.listen(1)
+	print('listening on 127.0.0.1:%d (%s)' %
+	      (port, 'rfc2217' if rfc2217 else 'raw'))
+
+	conn, peer = srv.accept()
+	link = Link(conn, rfc2217)
+	try:
+		serve(link)
+	except EOFError:
+		pass
+	except Violation as e:
+		print('protocol violation: %s' % e)
+		return 1
+	if rfc2217 and not link.refused:
+		print('protocol violation: option %d never refused' % TTYPE)
+		return 1
+	print('ok')
+	return 0
+
+
+if __name__ == '__main__':
+	sys.exit(main())
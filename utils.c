@@ -18,8 +18,12 @@
 */
 
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include "utils.h"
 
+FILE *diag;
+
 /* detect CPU endian */
 char cpu_le() {
 	const uint32_t cpu_le_test = 0x12345678;
@@ -44,6 +48,41 @@ uint32_t le_u32(const uint32_t v) {
         return v;
 }
 
+/*
+ * 1 if all the bytes read as erased flash (0xFF). The words of each
+ * 64 byte chunk are ANDed without branches, a loop the compiler vectorizes.
+ */
+int is_blank(const uint8_t *buf, uint32_t len)
+{
+	unsigned long w, all;
+	unsigned int i;
+
+	for (; len >= 64; len -= 64, buf += 64) {
+		all = ~0UL;
+		for (i = 0; i < 64; i += sizeof(w)) {
+			memcpy(&w, buf + i, sizeof(w));
+			all &= w;
+		}
+		if (all != ~0UL)
+			return 0;
+	}
+	while (len--)
+		if (*buf++ != 0xFF)
+			return 0;
+	return 1;
+}
+
+/* the whole string is a number, in C notation: 0 on success */
+int parse_u32(const char *s, uint32_t *val)
+{
+	char *end;
+
+	if (s == NULL)
+		return 1;
+	*val = strtoul(s, &end, 0);
+	return *s == '\0' || *end != '\0';
+}
+
 void printStatus(FILE *fd, int condition){
 	if(condition)
 		fprintf(fd, "Error!\n");
@@ -29,5 +29,10 @@ uint32_t be_u32(const uint32_t v);
 uint32_t le_u32(const uint32_t v);
 
 void printStatus(FILE *fd, int condition);
+int is_blank(const uint8_t *buf, uint32_t len);
+int parse_u32(const char *s, uint32_t *val);
+
+/* progress messages, set by the application (stderr by default) */
+extern FILE *diag;
 
 #endif